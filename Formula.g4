@@ -6,6 +6,7 @@ main
 
 expr
     : '(' expr ')'  # Parens
+    | FUNC '(' arg (',' arg)* ')'  # Function
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
@@ -13,6 +14,12 @@ expr
     | NUMBER  # Literal
     ;
 
+// a range is only meaningful as an argument of an aggregate function
+arg
+    : CELL ':' CELL  # RangeArg
+    | expr  # ExprArg
+    ;
+
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
 fragment INT: [-+]? UINT ;
 fragment UINT: [0-9]+ ;
@@ -26,5 +33,6 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
+FUNC: 'SUM' | 'AVERAGE' | 'MIN' | 'MAX' | 'COUNT' ;
 CELL: [A-Z]+[0-9]+ ;
 WS: [ \t\n\r]+ -> skip ;
\ No newline at end of file
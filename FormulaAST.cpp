@@ -3,12 +3,20 @@
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#include "sheet.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <string_view>
 
 namespace ASTImpl {
 
@@ -67,17 +75,55 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
+// node tags of a serialized tree
+enum SerializedTag : char {
+    ST_NUMBER = 'n',
+    ST_CELL = 'c',
+    ST_UNARY = 'u',
+    ST_BINARY = 'b',
+    ST_RANGE = 'r',
+    ST_FUNCTION = 'f',
+};
+
+constexpr std::string_view FUNCTION_NAMES[] = {"SUM", "AVERAGE", "MIN", "MAX", "COUNT"};
+
+std::optional<Function> FindFunction(std::string_view name) {
+    auto it = std::find(std::begin(FUNCTION_NAMES), std::end(FUNCTION_NAMES), name);
+    if (it == std::end(FUNCTION_NAMES)) {
+        return std::nullopt;
+    }
+    return static_cast<Function>(it - std::begin(FUNCTION_NAMES));
+}
+
+template <typename T>
+void AppendRaw(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
 class Expr {
 public:
     virtual ~Expr() = default;
-    virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(const std::function<CellInterface::Value(Position)>& sheetVisitor) const = 0;
+    // cell positions in the tree are offsets from the anchor, the cell
+    // that holds the formula
+    virtual void Print(std::ostream& out, Position anchor) const = 0;
+    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position anchor) const = 0;
+    virtual double Evaluate(FunctionRef<CellInterface::Value(Position)> sheetVisitor,
+                            Position anchor) const = 0;
+    // appends the node in reverse Polish notation
+    virtual void Compile(Program& program) const = 0;
+    // appends the node in postfix order, see FormulaAST::Serialize
+    virtual void Serialize(std::string& out) const = 0;
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
 
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+    // offsets of the corners for a range, which is only an argument of
+    // a function and is never evaluated on its own
+    virtual const Range* GetRange() const {
+        return nullptr;
+    }
+
+    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence, Position anchor,
                       bool right_child = false) const {
         auto precedence = GetPrecedence();
         auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -86,7 +132,7 @@ public:
             out << '(';
         }
 
-        DoPrintFormula(out, precedence);
+        DoPrintFormula(out, precedence, anchor);
 
         if (parens_needed) {
             out << ')';
@@ -105,24 +151,24 @@ public:
     };
 
 public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+    explicit BinaryOpExpr(Type type, const Expr* lhs, const Expr* rhs)
         : type_(type)
-        , lhs_(std::move(lhs))
-        , rhs_(std::move(rhs)) {
+        , lhs_(lhs)
+        , rhs_(rhs) {
     }
 
-    void Print(std::ostream& out) const override {
+    void Print(std::ostream& out, Position anchor) const override {
         out << '(' << static_cast<char>(type_) << ' ';
-        lhs_->Print(out);
+        lhs_->Print(out, anchor);
         out << ' ';
-        rhs_->Print(out);
+        rhs_->Print(out, anchor);
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position anchor) const override {
+        lhs_->PrintFormula(out, precedence, anchor);
         out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+        rhs_->PrintFormula(out, precedence, anchor, /* right_child = */ true);
     }
 
     ExprPrecedence GetPrecedence() const override {
@@ -142,26 +188,27 @@ public:
         }
     }
 
-    double Evaluate(const std::function<CellInterface::Value(Position)>& sheetVisitor) const override {
+    double Evaluate(FunctionRef<CellInterface::Value(Position)> sheetVisitor,
+                    Position anchor) const override {
 
         double res;
 
         switch (type_)
         {
         case Type::Add:
-            res = lhs_->Evaluate(sheetVisitor) + rhs_->Evaluate(sheetVisitor);
+            res = lhs_->Evaluate(sheetVisitor, anchor) + rhs_->Evaluate(sheetVisitor, anchor);
             break;
 
         case Type::Divide:
-            res = lhs_->Evaluate(sheetVisitor) / rhs_->Evaluate(sheetVisitor);
+            res = lhs_->Evaluate(sheetVisitor, anchor) / rhs_->Evaluate(sheetVisitor, anchor);
             break;
 
         case Type::Multiply:
-            res = lhs_->Evaluate(sheetVisitor) * rhs_->Evaluate(sheetVisitor);
+            res = lhs_->Evaluate(sheetVisitor, anchor) * rhs_->Evaluate(sheetVisitor, anchor);
             break;
 
         case Type::Subtract:
-            res = lhs_->Evaluate(sheetVisitor) - rhs_->Evaluate(sheetVisitor);
+            res = lhs_->Evaluate(sheetVisitor, anchor) - rhs_->Evaluate(sheetVisitor, anchor);
             break;
         
         default:    FormulaError(FormulaError::Category::Div0);
@@ -176,10 +223,38 @@ public:
 
     }
 
+    void Compile(Program& program) const override {
+        lhs_->Compile(program);
+        size_t rhs_begin = program.GetSize();
+        rhs_->Compile(program);
+
+        switch (type_) {
+            case Add:
+                program.Apply(Instruction::Op::Add, rhs_begin);
+                break;
+            case Subtract:
+                program.Apply(Instruction::Op::Subtract, rhs_begin);
+                break;
+            case Multiply:
+                program.Apply(Instruction::Op::Multiply, rhs_begin);
+                break;
+            case Divide:
+                program.Apply(Instruction::Op::Divide, rhs_begin);
+                break;
+        }
+    }
+
+    void Serialize(std::string& out) const override {
+        lhs_->Serialize(out);
+        rhs_->Serialize(out);
+        out += ST_BINARY;
+        out += static_cast<char>(type_);
+    }
+
 private:
     Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
+    const Expr* lhs_;
+    const Expr* rhs_;
 };
 
 class UnaryOpExpr final : public Expr {
@@ -190,39 +265,57 @@ public:
     };
 
 public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
+    explicit UnaryOpExpr(Type type, const Expr* operand)
         : type_(type)
-        , operand_(std::move(operand)) {
+        , operand_(operand) {
     }
 
-    void Print(std::ostream& out) const override {
+    void Print(std::ostream& out, Position anchor) const override {
         out << '(' << static_cast<char>(type_) << ' ';
-        operand_->Print(out);
+        operand_->Print(out, anchor);
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position anchor) const override {
         out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
+        operand_->PrintFormula(out, precedence, anchor);
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_UNARY;
     }
 
-    double Evaluate(const std::function<CellInterface::Value(Position)>& sheetVisitor) const override {
+    double Evaluate(FunctionRef<CellInterface::Value(Position)> sheetVisitor,
+                    Position anchor) const override {
         if(type_ == Type::UnaryMinus){
-            return -1 * operand_->Evaluate(sheetVisitor);
+            return -1 * operand_->Evaluate(sheetVisitor, anchor);
         }
 
-        return operand_->Evaluate(sheetVisitor);
+        return operand_->Evaluate(sheetVisitor, anchor);
+    }
+
+    void Compile(Program& program) const override {
+        operand_->Compile(program);
+        if (type_ == UnaryMinus) {
+            program.Negate();
+        }
+    }
+
+    void Serialize(std::string& out) const override {
+        operand_->Serialize(out);
+        out += ST_UNARY;
+        out += static_cast<char>(type_);
     }
 
 private:
     Type type_;
-    std::unique_ptr<Expr> operand_;
+    const Expr* operand_;
 };
 
+Position Translate(Position offset, Position anchor) {
+    return {anchor.row + offset.row, anchor.col + offset.col};
+}
+
 bool is_number(const std::string& s)
 {
     std::string::const_iterator it = s.begin();
@@ -230,55 +323,76 @@ bool is_number(const std::string& s)
     return !s.empty() && it == s.end();
 }
 
+// converts the value of a referenced cell to an operand; text that is not
+// a number gives an error encoded by ErrorToNumber
+double ToOperand(const CellInterface::Value& value) {
+    if(std::holds_alternative<std::string>(value)){
+        const std::string& str = std::get<std::string>(value);
+
+        if(!is_number(str)){
+            return ErrorToNumber(FormulaError::Category::Value);
+        }
+
+        return std::stod(str);
+    }
+
+    if(std::holds_alternative<double>(value)){
+        return std::get<double>(value);
+    }
+
+    return 0;
+}
+
+// same, but throws the error
+double ToNumber(const CellInterface::Value& value) {
+    double number = ToOperand(value);
+    if (auto error = NumberToError(number)) {
+        throw *error;
+    }
+    return number;
+}
+
 class CellExpr final : public Expr {
 public:
-    explicit CellExpr(const Position* cell)
+    explicit CellExpr(Position cell)
         : cell_(cell) {
     }
 
-    void Print(std::ostream& out) const override {
-        if (!cell_->IsValid()) {
+    void Print(std::ostream& out, Position anchor) const override {
+        Position cell = Translate(cell_, anchor);
+        if (!cell.IsValid()) {
             out << FormulaError::Category::Ref;
         } else {
-            out << cell_->ToString();
+            char buffer[Position::MAX_POSITION_LENGTH];
+            out.write(buffer, cell.ToChars(buffer) - buffer);
         }
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position anchor) const override {
+        Print(out, anchor);
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_ATOM;
     }
 
-    double Evaluate(const std::function<CellInterface::Value(Position)>& sheetVisitor) const override {
-        CellInterface::Value value = sheetVisitor(*cell_);
-
-        if(std::holds_alternative<std::string>(value)){
-            std::string str = std::get<std::string>(value);
-
-            if(!is_number(str)){
-                throw FormulaError(FormulaError::Category::Value);
-            }
-
-            if(str.size() == 0){
-                return 0.0;
-            }
-            return std::stod(str);
-        }
-
+    double Evaluate(FunctionRef<CellInterface::Value(Position)> sheetVisitor,
+                    Position anchor) const override {
+        return ToNumber(sheetVisitor(Translate(cell_, anchor)));
+    }
 
-        if(std::holds_alternative<double>(value)){
-            return std::get<double>(value);
-        }
-        std::get<FormulaError>(value);
+    void Compile(Program& program) const override {
+        program.PushCell(cell_);
+    }
 
-        return 0;
+    void Serialize(std::string& out) const override {
+        out += ST_CELL;
+        AppendRaw<std::int32_t>(out, cell_.row);
+        AppendRaw<std::int32_t>(out, cell_.col);
     }
 
 private:
-    const Position* cell_;
+    Position cell_;
 };
 
 class NumberExpr final : public Expr {
@@ -287,11 +401,11 @@ public:
         : value_(value) {
     }
 
-    void Print(std::ostream& out) const override {
+    void Print(std::ostream& out, Position /* anchor */) const override {
         out << value_;
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position /* anchor */) const override {
         out << value_;
     }
 
@@ -299,33 +413,321 @@ public:
         return EP_ATOM;
     }
 
-    double Evaluate(const std::function<CellInterface::Value(Position)>&) const override {
+    double Evaluate(FunctionRef<CellInterface::Value(Position)>, Position) const override {
         return value_;
     }
 
+    void Compile(Program& program) const override {
+        program.PushNumber(value_);
+    }
+
+    void Serialize(std::string& out) const override {
+        out += ST_NUMBER;
+        AppendRaw(out, value_);
+    }
+
 private:
     double value_;
 };
 
-class ParseASTListener final : public FormulaBaseListener {
+// the operand of a range cell: a number or NaN for a cell that is skipped
+double ToRangeNumber(const CellInterface::Value& value) {
+    if (const double* number = std::get_if<double>(&value)) {
+        return *number;
+    }
+    if (const std::string* str = std::get_if<std::string>(&value); str && is_number(*str)) {
+        double number = 0;
+        auto [end, error] = std::from_chars(str->data(), str->data() + str->size(), number);
+        if (error == std::errc()) {
+            return number;
+        }
+    }
+    return std::numeric_limits<double>::quiet_NaN();
+}
+
+void PrintRange(std::ostream& out, Range offsets, Position anchor) {
+    Range range{Translate(offsets.first, anchor), Translate(offsets.last, anchor)};
+    if (!range.IsValid()) {
+        out << FormulaError::Category::Ref;
+        return;
+    }
+    char buffer[2 * Position::MAX_POSITION_LENGTH + 1];
+    char* end = range.first.ToChars(buffer);
+    *end++ = ':';
+    end = range.last.ToChars(end);
+    out.write(buffer, end - buffer);
+}
+
+class RangeExpr final : public Expr {
 public:
-    std::unique_ptr<Expr> MoveRoot() {
-        assert(args_.size() == 1);
-        auto root = std::move(args_.front());
-        args_.clear();
+    explicit RangeExpr(Range offsets)
+        : offsets_(offsets) {
+    }
+
+    void Print(std::ostream& out, Position anchor) const override {
+        PrintRange(out, offsets_, anchor);
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position anchor) const override {
+        PrintRange(out, offsets_, anchor);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    const Range* GetRange() const override {
+        return &offsets_;
+    }
+
+    double Evaluate(FunctionRef<CellInterface::Value(Position)>, Position) const override {
+        assert(false);
+        throw FormulaError(FormulaError::Category::Value);
+    }
+
+    void Compile(Program& /* program */) const override {
+        // compiled by the function, which knows what to aggregate
+        assert(false);
+    }
+
+    void Serialize(std::string& out) const override {
+        out += ST_RANGE;
+        AppendRaw<std::int32_t>(out, offsets_.first.row);
+        AppendRaw<std::int32_t>(out, offsets_.first.col);
+        AppendRaw<std::int32_t>(out, offsets_.last.row);
+        AppendRaw<std::int32_t>(out, offsets_.last.col);
+    }
+
+private:
+    Range offsets_;
+};
+
+class FunctionExpr final : public Expr {
+public:
+    FunctionExpr(Function function, const Expr* const* args, size_t arg_count)
+        : function_(function)
+        , args_(args)
+        , arg_count_(arg_count) {
+    }
+
+    void Print(std::ostream& out, Position anchor) const override {
+        out << '(' << GetFunctionName(function_);
+        for (const Expr* arg : GetArgs()) {
+            out << ' ';
+            arg->Print(out, anchor);
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position anchor) const override {
+        out << GetFunctionName(function_) << '(';
+        bool first = true;
+        for (const Expr* arg : GetArgs()) {
+            if (!first) {
+                out << ',';
+            }
+            first = false;
+            // an argument is a whole expression, like the formula itself
+            arg->PrintFormula(out, EP_ATOM, anchor);
+        }
+        out << ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(FunctionRef<CellInterface::Value(Position)> sheetVisitor,
+                    Position anchor) const override {
+        Aggregate aggregate(function_);
+        for (const Expr* arg : GetArgs()) {
+            if (const Range* offsets = arg->GetRange()) {
+                Position first = Translate(offsets->first, anchor);
+                Position last = Translate(offsets->last, anchor);
+                if (!Range{first, last}.IsValid()) {
+                    throw FormulaError(FormulaError::Category::Ref);
+                }
+                for (int row = first.row; row <= last.row; ++row) {
+                    for (int col = first.col; col <= last.col; ++col) {
+                        aggregate.Add(ToRangeNumber(sheetVisitor(Position{row, col})));
+                    }
+                }
+            } else {
+                aggregate.Merge(arg->Evaluate(sheetVisitor, anchor), 1);
+            }
+        }
+
+        double result = aggregate.GetResult();
+        if (auto error = NumberToError(result)) {
+            throw *error;
+        }
+        if (!std::isfinite(result)) {
+            throw FormulaError(FormulaError::Category::Div0);
+        }
+        return result;
+    }
+
+    void Compile(Program& program) const override {
+        // every argument leaves a partial result: a value and a count
+        for (const Expr* arg : GetArgs()) {
+            if (const Range* offsets = arg->GetRange()) {
+                program.PushRange(function_, *offsets);
+            } else {
+                arg->Compile(program);
+                program.PushNumber(1);
+            }
+        }
+        program.Call(function_, arg_count_);
+    }
+
+    void Serialize(std::string& out) const override {
+        for (const Expr* arg : GetArgs()) {
+            arg->Serialize(out);
+        }
+        out += ST_FUNCTION;
+        out += static_cast<char>(function_);
+        AppendRaw<std::uint32_t>(out, static_cast<std::uint32_t>(arg_count_));
+    }
 
-        return root;
+private:
+    ArrayView<const Expr*> GetArgs() const {
+        return {args_, arg_count_};
     }
 
-    std::forward_list<Position> MoveCells() {
-        return std::move(cells_);
+    Function function_;
+    const Expr* const* args_;
+    size_t arg_count_;
+};
+
+static_assert(sizeof(UnaryOpExpr) <= sizeof(BinaryOpExpr));
+
+// Upper bound of the nodes of a formula, known before it is parsed.
+// An operator may turn out unary, which takes no more memory than binary.
+struct NodeCounts {
+    size_t numbers = 0;
+    size_t cells = 0;
+    size_t operators = 0;
+    size_t ranges = 0;
+    size_t functions = 0;
+    // arguments of all functions
+    size_t arguments = 0;
+
+    size_t GetNodes() const {
+        return numbers + cells + operators + ranges + functions;
+    }
+
+    // nodes, the cell and range lists, the argument lists and one
+    // instruction per node and per argument, plus padding after the lists
+    size_t GetArenaSize() const {
+        return numbers * sizeof(NumberExpr) + cells * (sizeof(CellExpr) + sizeof(Position))
+               + operators * sizeof(BinaryOpExpr) + ranges * (sizeof(RangeExpr) + sizeof(Range))
+               + functions * sizeof(FunctionExpr) + arguments * (sizeof(const Expr*) + sizeof(Instruction))
+               + GetNodes() * sizeof(Instruction) + alignof(Instruction);
+    }
+};
+
+// Counts the tokens of a formula. Lexing errors are left to the parser,
+// the tokens before them are counted.
+NodeCounts CountNodes(std::string_view in);
+
+// Allocates the nodes, the cell and range lists of one formula from its arena.
+class TreeBuilder {
+public:
+    explicit TreeBuilder(const NodeCounts& counts)
+        : arena_(Arena::Create(counts.GetArenaSize()))
+        , cells_(arena_->Allocate<Position>(counts.cells))
+        , cell_capacity_(counts.cells)
+        , ranges_(arena_->Allocate<Range>(counts.ranges))
+        , range_capacity_(counts.ranges) {
+    }
+
+    const Expr* MakeNumber(double value) {
+        return Make<NumberExpr>(value);
+    }
+
+    const Expr* MakeCell(Position offset) {
+        Append(cells_, cell_count_, cell_capacity_, offset);
+        return Make<CellExpr>(offset);
+    }
+
+    const Expr* MakeRange(Range offsets) {
+        Append(ranges_, range_count_, range_capacity_, offsets);
+        return Make<RangeExpr>(offsets);
+    }
+
+    const Expr* MakeFunction(Function function, const Expr* const* args, size_t arg_count) {
+        assert(arg_count > 0);
+        const Expr** own_args = arena_->Allocate<const Expr*>(arg_count);
+        std::copy(args, args + arg_count, own_args);
+        // a plain argument is followed by its count, see FunctionExpr::Compile
+        instruction_count_ += std::count_if(args, args + arg_count, [](const Expr* arg) {
+            return arg->GetRange() == nullptr;
+        });
+        return Make<FunctionExpr>(function, own_args, arg_count);
+    }
+
+    const Expr* MakeUnary(UnaryOpExpr::Type type, const Expr* operand) {
+        return Make<UnaryOpExpr>(type, operand);
+    }
+
+    const Expr* MakeBinary(BinaryOpExpr::Type type, const Expr* lhs, const Expr* rhs) {
+        return Make<BinaryOpExpr>(type, lhs, rhs);
+    }
+
+    FormulaAST Finish(const Expr* root) {
+        return FormulaAST(std::move(arena_), root, cells_, cell_count_, ranges_, range_count_,
+                          instruction_count_);
+    }
+
+private:
+    template <typename T, typename... Args>
+    const Expr* Make(Args&&... args) {
+        // one instruction per node
+        ++instruction_count_;
+        return arena_->New<T>(std::forward<Args>(args)...);
+    }
+
+    template <typename T>
+    void Append(T*& items, size_t& count, size_t& capacity, T item) {
+        if (count == capacity) {
+            // only when the counts were not known up front
+            size_t new_capacity = std::max<size_t>(4, capacity * 2);
+            T* new_items = arena_->Allocate<T>(new_capacity);
+            std::copy(items, items + count, new_items);
+            items = new_items;
+            capacity = new_capacity;
+        }
+        items[count++] = item;
+    }
+
+    ArenaPtr arena_;
+    Position* cells_;
+    size_t cell_count_ = 0;
+    size_t cell_capacity_;
+    Range* ranges_;
+    size_t range_count_ = 0;
+    size_t range_capacity_;
+    size_t instruction_count_ = 0;
+};
+
+class ParseASTListener final : public FormulaBaseListener {
+public:
+    // the reference parser does not know the size of the tree up front
+    // and lets the arena grow
+    ParseASTListener()
+        : builder_(NodeCounts{}) {
+    }
+
+    FormulaAST Finish() {
+        assert(args_.size() == 1);
+        return builder_.Finish(args_.front());
     }
 
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
 
-        auto operand = std::move(args_.back());
+        auto operand = args_.back();
 
         UnaryOpExpr::Type type;
         if (ctx->SUB()) {
@@ -335,8 +737,7 @@ public:
             type = UnaryOpExpr::UnaryPlus;
         }
 
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-        args_.back() = std::move(node);
+        args_.back() = builder_.MakeUnary(type, operand);
     }
 
     void exitLiteral(FormulaParser::LiteralContext* ctx) override {
@@ -348,29 +749,38 @@ public:
             throw ParsingError("Invalid number: " + valueStr);
         }
 
-        auto node = std::make_unique<NumberExpr>(value);
-        args_.push_back(std::move(node));
+        args_.push_back(builder_.MakeNumber(value));
     }
 
     void exitCell(FormulaParser::CellContext* ctx) override {
-        auto value_str = ctx->CELL()->getSymbol()->getText();
-        auto value = Position::FromString(value_str);
-        if (!value.IsValid()) {
-            throw FormulaException("Invalid position: " + value_str);
-        }
+        args_.push_back(builder_.MakeCell(GetPosition(ctx->CELL())));
+    }
 
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
-        args_.push_back(std::move(node));
+    void exitRangeArg(FormulaParser::RangeArgContext* ctx) override {
+        auto range = Range::FromCorners(GetPosition(ctx->CELL(0)), GetPosition(ctx->CELL(1)));
+        args_.push_back(builder_.MakeRange(range));
+    }
+
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        size_t arg_count = ctx->arg().size();
+        assert(arg_count >= 1 && args_.size() >= arg_count);
+
+        auto function = FindFunction(ctx->FUNC()->getSymbol()->getText());
+        assert(function.has_value());
+
+        auto first = args_.end() - arg_count;
+        auto expr = builder_.MakeFunction(*function, &*first, arg_count);
+        args_.erase(first, args_.end());
+        args_.push_back(expr);
     }
 
     void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
         assert(args_.size() >= 2);
 
-        auto rhs = std::move(args_.back());
+        auto rhs = args_.back();
         args_.pop_back();
 
-        auto lhs = std::move(args_.back());
+        auto lhs = args_.back();
 
         BinaryOpExpr::Type type;
         if (ctx->ADD()) {
@@ -384,8 +794,7 @@ public:
             type = BinaryOpExpr::Divide;
         }
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-        args_.back() = std::move(node);
+        args_.back() = builder_.MakeBinary(type, lhs, rhs);
     }
 
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
@@ -393,8 +802,17 @@ public:
     }
 
 private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    static Position GetPosition(antlr4::tree::TerminalNode* cell) {
+        auto value_str = cell->getSymbol()->getText();
+        auto value = Position::FromString(value_str);
+        if (!value.IsValid()) {
+            throw FormulaException("Invalid position: " + value_str);
+        }
+        return value;
+    }
+
+    TreeBuilder builder_;
+    std::vector<const Expr*> args_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -407,10 +825,528 @@ public:
     }
 };
 
+// Hand-written counterpart of the ANTLR pipeline above. It implements the
+// grammar from Formula.g4 directly on the input buffer and builds the same
+// AST as ParseASTListener:
+//   main    : sum EOF
+//   sum     : product ((ADD | SUB) product)*
+//   product : unary ((MUL | DIV) unary)*
+//   unary   : (ADD | SUB) unary | primary
+//   primary : '(' sum ')' | FUNC '(' arg (',' arg)* ')' | CELL | NUMBER
+//   arg     : CELL ':' CELL | sum
+// Unary operators bind tighter than binary ones, as the UnaryOp alternative
+// precedes the BinaryOp ones in the grammar.
+struct Token {
+    enum Type {
+        Number,
+        Cell,
+        Function,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        LeftParen,
+        RightParen,
+        Colon,
+        Comma,
+        End,
+    };
+
+    Type type = End;
+    std::string_view text;
+};
+
+class Tokenizer {
+public:
+    explicit Tokenizer(std::string_view in)
+        : in_(in) {
+    }
+
+    Token Next() {
+        while (pos_ < in_.size() && IsSpace(in_[pos_])) {
+            ++pos_;
+        }
+        if (pos_ == in_.size()) {
+            return {Token::End, {}};
+        }
+
+        size_t start = pos_;
+        char ch = in_[pos_];
+        switch (ch) {
+            case '+':
+                return Single(Token::Add);
+            case '-':
+                return Single(Token::Sub);
+            case '*':
+                return Single(Token::Mul);
+            case '/':
+                return Single(Token::Div);
+            case '(':
+                return Single(Token::LeftParen);
+            case ')':
+                return Single(Token::RightParen);
+            case ':':
+                return Single(Token::Colon);
+            case ',':
+                return Single(Token::Comma);
+            default:
+                break;
+        }
+
+        if (IsUpper(ch)) {
+            SkipWhile(IsUpper);
+            size_t letters_end = pos_;
+            if (SkipWhile(IsDigit) == 0) {
+                std::string_view name = in_.substr(start, letters_end - start);
+                if (!FindFunction(name)) {
+                    throw ParsingError("Error when lexing: " + std::string(in_.substr(start)));
+                }
+                return {Token::Function, name};
+            }
+            return {Token::Cell, in_.substr(start, pos_ - start)};
+        }
+
+        if (IsDigit(ch) || ch == '.') {
+            // NUMBER : UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+            size_t int_digits = SkipWhile(IsDigit);
+            if (pos_ < in_.size() && in_[pos_] == '.') {
+                size_t dot = pos_++;
+                if (SkipWhile(IsDigit) == 0) {
+                    if (int_digits == 0) {
+                        throw ParsingError("Error when lexing: " + std::string(in_.substr(start)));
+                    }
+                    // the lexer backs off to the integer part,
+                    // the lone dot is then unrecognizable
+                    pos_ = dot;
+                }
+            }
+            SkipExponent();
+            return {Token::Number, in_.substr(start, pos_ - start)};
+        }
+
+        throw ParsingError("Error when lexing: " + std::string(in_.substr(start)));
+    }
+
+private:
+    static bool IsSpace(char ch) {
+        return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+    }
+
+    static bool IsDigit(char ch) {
+        return ch >= '0' && ch <= '9';
+    }
+
+    static bool IsUpper(char ch) {
+        return ch >= 'A' && ch <= 'Z';
+    }
+
+    Token Single(Token::Type type) {
+        return {type, in_.substr(pos_++, 1)};
+    }
+
+    template <typename Predicate>
+    size_t SkipWhile(Predicate predicate) {
+        size_t start = pos_;
+        while (pos_ < in_.size() && predicate(in_[pos_])) {
+            ++pos_;
+        }
+        return pos_ - start;
+    }
+
+    // EXPONENT : [eE] [-+]? UINT, taken only when complete
+    void SkipExponent() {
+        size_t start = pos_;
+        if (pos_ < in_.size() && (in_[pos_] == 'e' || in_[pos_] == 'E')) {
+            ++pos_;
+            if (pos_ < in_.size() && (in_[pos_] == '+' || in_[pos_] == '-')) {
+                ++pos_;
+            }
+            if (SkipWhile(IsDigit) == 0) {
+                pos_ = start;
+            }
+        }
+    }
+
+    std::string_view in_;
+    size_t pos_ = 0;
+};
+
+double ParseNumber(std::string_view text) {
+    double value = 0;
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (error == std::errc() && end == text.data() + text.size()) {
+        return value;
+    }
+
+    // from_chars also rejects underflow, which the stream accepts as zero
+    // or a denormal; let the stream decide like exitLiteral does
+    std::istringstream in{std::string(text)};
+    in >> value;
+    if (!in) {
+        throw ParsingError("Invalid number: " + std::string(text));
+    }
+    return value;
+}
+
+class RecursiveDescentParser {
+public:
+    RecursiveDescentParser(std::string_view in, Position anchor)
+        : tokenizer_(in)
+        , anchor_(anchor)
+        , builder_(CountNodes(in)) {
+        Advance();
+    }
+
+    FormulaAST ParseMain() {
+        auto root = ParseSum();
+        if (token_.type != Token::End) {
+            throw ParsingError("Error when parsing: " + std::string(token_.text));
+        }
+        return builder_.Finish(root);
+    }
+
+private:
+    void Advance() {
+        token_ = tokenizer_.Next();
+    }
+
+    // the token after the current one
+    Token Peek() const {
+        return Tokenizer(tokenizer_).Next();
+    }
+
+    void Expect(Token::Type type, const char* what) {
+        if (token_.type != type) {
+            throw ParsingError(std::string("Error when parsing: expected ") + what);
+        }
+        Advance();
+    }
+
+    // offset of the cell in the current token from the anchor
+    Position ParseCell() {
+        if (token_.type != Token::Cell) {
+            throw ParsingError("Error when parsing: " + std::string(token_.text));
+        }
+        auto value = Position::FromString(token_.text);
+        if (!value.IsValid()) {
+            throw FormulaException("Invalid position: " + std::string(token_.text));
+        }
+        Advance();
+        return {value.row - anchor_.row, value.col - anchor_.col};
+    }
+
+    const Expr* ParseSum() {
+        auto lhs = ParseProduct();
+        while (token_.type == Token::Add || token_.type == Token::Sub) {
+            auto type = token_.type == Token::Add ? BinaryOpExpr::Add : BinaryOpExpr::Subtract;
+            Advance();
+            auto rhs = ParseProduct();
+            lhs = builder_.MakeBinary(type, lhs, rhs);
+        }
+        return lhs;
+    }
+
+    const Expr* ParseProduct() {
+        auto lhs = ParseUnary();
+        while (token_.type == Token::Mul || token_.type == Token::Div) {
+            auto type = token_.type == Token::Mul ? BinaryOpExpr::Multiply : BinaryOpExpr::Divide;
+            Advance();
+            auto rhs = ParseUnary();
+            lhs = builder_.MakeBinary(type, lhs, rhs);
+        }
+        return lhs;
+    }
+
+    const Expr* ParseUnary() {
+        if (token_.type == Token::Add || token_.type == Token::Sub) {
+            auto type = token_.type == Token::Add ? UnaryOpExpr::UnaryPlus : UnaryOpExpr::UnaryMinus;
+            Advance();
+            return builder_.MakeUnary(type, ParseUnary());
+        }
+        return ParsePrimary();
+    }
+
+    const Expr* ParsePrimary() {
+        Token token = token_;
+        switch (token.type) {
+            case Token::LeftParen: {
+                Advance();
+                auto expr = ParseSum();
+                Expect(Token::RightParen, "')'");
+                return expr;
+            }
+            case Token::Number:
+                Advance();
+                return builder_.MakeNumber(ParseNumber(token.text));
+            case Token::Cell:
+                return builder_.MakeCell(ParseCell());
+            case Token::Function:
+                return ParseFunction();
+            default:
+                throw ParsingError("Error when parsing: " + std::string(token.text));
+        }
+    }
+
+    const Expr* ParseFunction() {
+        Function function = *FindFunction(token_.text);
+        Advance();
+        Expect(Token::LeftParen, "'('");
+
+        // arguments of nested calls are pushed above and popped before
+        size_t first = args_.size();
+        args_.push_back(ParseArgument());
+        while (token_.type == Token::Comma) {
+            Advance();
+            args_.push_back(ParseArgument());
+        }
+        Expect(Token::RightParen, "')'");
+
+        auto expr = builder_.MakeFunction(function, args_.data() + first, args_.size() - first);
+        args_.resize(first);
+        return expr;
+    }
+
+    const Expr* ParseArgument() {
+        if (token_.type != Token::Cell || Peek().type != Token::Colon) {
+            return ParseSum();
+        }
+        Position first = ParseCell();
+        Advance();
+        Position last = ParseCell();
+        return builder_.MakeRange(Range::FromCorners(first, last));
+    }
+
+    Tokenizer tokenizer_;
+    Position anchor_;
+    Token token_;
+    TreeBuilder builder_;
+    std::vector<const Expr*> args_;
+};
+
+NodeCounts CountNodes(std::string_view in) {
+    NodeCounts counts;
+    Tokenizer tokenizer(in);
+    // the corners of a range are not cells of their own
+    bool range_end = false;
+    try {
+        for (Token token = tokenizer.Next(); token.type != Token::End; token = tokenizer.Next()) {
+            switch (token.type) {
+                case Token::Number:
+                    ++counts.numbers;
+                    break;
+                case Token::Cell:
+                    if (!range_end) {
+                        ++counts.cells;
+                    }
+                    break;
+                case Token::Colon:
+                    ++counts.ranges;
+                    if (counts.cells > 0) {
+                        --counts.cells;
+                    }
+                    break;
+                case Token::Function:
+                    ++counts.functions;
+                    ++counts.arguments;
+                    break;
+                case Token::Comma:
+                    ++counts.arguments;
+                    break;
+                case Token::Add:
+                case Token::Sub:
+                case Token::Mul:
+                case Token::Div:
+                    ++counts.operators;
+                    break;
+                default:
+                    break;
+            }
+            range_end = token.type == Token::Colon;
+        }
+    } catch (const ParsingError&) {
+    }
+    return counts;
+}
+
+// Same for a serialized tree. Malformed input is left to the reader.
+NodeCounts CountSerializedNodes(std::string_view in) {
+    NodeCounts counts;
+    size_t pos = 0;
+    while (pos < in.size()) {
+        switch (in[pos]) {
+            case ST_NUMBER:
+                ++counts.numbers;
+                pos += 1 + sizeof(double);
+                break;
+            case ST_CELL:
+                ++counts.cells;
+                pos += 1 + 2 * sizeof(std::int32_t);
+                break;
+            case ST_UNARY:
+            case ST_BINARY:
+                ++counts.operators;
+                pos += 2;
+                break;
+            case ST_RANGE:
+                ++counts.ranges;
+                pos += 1 + 4 * sizeof(std::int32_t);
+                break;
+            case ST_FUNCTION: {
+                ++counts.functions;
+                std::uint32_t arg_count = 0;
+                if (pos + 2 + sizeof(arg_count) <= in.size()) {
+                    std::memcpy(&arg_count, in.data() + pos + 2, sizeof(arg_count));
+                    // each argument takes at least one byte before the call
+                    counts.arguments += std::min<size_t>(arg_count, pos);
+                }
+                pos += 2 + sizeof(arg_count);
+                break;
+            }
+            default:
+                return counts;
+        }
+    }
+    return counts;
+}
+
 }  // namespace
 }  // namespace ASTImpl
 
+FormulaAST ParseFormulaAST(std::string_view in, Position anchor) {
+    ASTImpl::RecursiveDescentParser parser(in, anchor);
+    return parser.ParseMain();
+}
+
+FormulaAST DeserializeFormulaAST(std::string_view in) {
+    using namespace ASTImpl;
+
+    auto read = [&in](auto& value) {
+        if (in.size() < sizeof(value)) {
+            throw ParsingError("Truncated formula tree");
+        }
+        std::memcpy(&value, in.data(), sizeof(value));
+        in.remove_prefix(sizeof(value));
+    };
+
+    TreeBuilder builder(CountSerializedNodes(in));
+    std::vector<const Expr*> stack;
+    while (!in.empty()) {
+        char tag = 0;
+        read(tag);
+        switch (tag) {
+            case ST_NUMBER: {
+                double value = 0;
+                read(value);
+                stack.push_back(builder.MakeNumber(value));
+                break;
+            }
+            case ST_CELL: {
+                std::int32_t row = 0;
+                std::int32_t col = 0;
+                read(row);
+                read(col);
+                stack.push_back(builder.MakeCell({row, col}));
+                break;
+            }
+            case ST_UNARY: {
+                char type = 0;
+                read(type);
+                if (stack.empty() || (type != UnaryOpExpr::UnaryPlus && type != UnaryOpExpr::UnaryMinus)
+                    || stack.back()->GetRange()) {
+                    throw ParsingError("Malformed formula tree");
+                }
+                stack.back() = builder.MakeUnary(static_cast<UnaryOpExpr::Type>(type), stack.back());
+                break;
+            }
+            case ST_BINARY: {
+                char type = 0;
+                read(type);
+                if (stack.size() < 2 || (type != BinaryOpExpr::Add && type != BinaryOpExpr::Subtract
+                                         && type != BinaryOpExpr::Multiply && type != BinaryOpExpr::Divide)) {
+                    throw ParsingError("Malformed formula tree");
+                }
+                auto rhs = stack.back();
+                stack.pop_back();
+                if (stack.back()->GetRange() || rhs->GetRange()) {
+                    throw ParsingError("Malformed formula tree");
+                }
+                stack.back() = builder.MakeBinary(static_cast<BinaryOpExpr::Type>(type), stack.back(), rhs);
+                break;
+            }
+            case ST_RANGE: {
+                std::int32_t corners[4] = {};
+                for (auto& corner : corners) {
+                    read(corner);
+                }
+                Range offsets{{corners[0], corners[1]}, {corners[2], corners[3]}};
+                if (!(Range::FromCorners(offsets.first, offsets.last) == offsets)) {
+                    throw ParsingError("Malformed formula tree");
+                }
+                stack.push_back(builder.MakeRange(offsets));
+                break;
+            }
+            case ST_FUNCTION: {
+                char function = 0;
+                std::uint32_t arg_count = 0;
+                read(function);
+                read(arg_count);
+                if (static_cast<unsigned char>(function) >= std::size(FUNCTION_NAMES) || arg_count == 0
+                    || arg_count > stack.size()) {
+                    throw ParsingError("Malformed formula tree");
+                }
+                auto first = stack.end() - arg_count;
+                auto expr = builder.MakeFunction(static_cast<Function>(function), &*first, arg_count);
+                stack.erase(first, stack.end());
+                stack.push_back(expr);
+                break;
+            }
+            default:
+                throw ParsingError("Malformed formula tree");
+        }
+    }
+
+    if (stack.size() != 1 || stack.back()->GetRange()) {
+        throw ParsingError("Malformed formula tree");
+    }
+    return builder.Finish(stack.back());
+}
+
+std::string GetRelativeForm(std::string_view in, Position anchor) {
+    using ASTImpl::Token;
+
+    std::string result;
+    result.reserve(in.size() + 16);
+
+    ASTImpl::Tokenizer tokenizer(in);
+    for (Token token = tokenizer.Next(); token.type != Token::End; token = tokenizer.Next()) {
+        if (!result.empty()) {
+            result += ' ';
+        }
+        if (token.type == Token::Cell) {
+            auto pos = Position::FromString(token.text);
+            if (!pos.IsValid()) {
+                throw FormulaException("Invalid position: " + std::string(token.text));
+            }
+            result += 'R';
+            result += '[';
+            result += std::to_string(pos.row - anchor.row);
+            result += "]C[";
+            result += std::to_string(pos.col - anchor.col);
+            result += ']';
+        } else {
+            result += token.text;
+        }
+    }
+
+    return result;
+}
+
 FormulaAST ParseFormulaAST(std::istream& in) {
+    std::string in_str{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    return ParseFormulaAST(std::string_view(in_str));
+}
+
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in) {
     using namespace antlr4;
 
     ANTLRInputStream input(in);
@@ -431,36 +1367,524 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return listener.Finish();
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
+FormulaAST ParseFormulaASTWithAntlr(const std::string& in_str) {
     std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+    return ParseFormulaASTWithAntlr(in);
 }
 
-void FormulaAST::PrintCells(std::ostream& out) const {
-    for (auto cell : cells_) {
-        out << cell.ToString() << ' ';
+void FormulaAST::PrintCells(std::ostream& out, Position anchor) const {
+    for (auto cell : GetCells()) {
+        char buffer[Position::MAX_POSITION_LENGTH];
+        char* end = Position{anchor.row + cell.row, anchor.col + cell.col}.ToChars(buffer);
+        out.write(buffer, end - buffer);
+        out << ' ';
     }
 }
 
-void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+void FormulaAST::Print(std::ostream& out, Position anchor) const {
+    root_expr_->Print(out, anchor);
+}
+
+void FormulaAST::PrintFormula(std::ostream& out, Position anchor) const {
+    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM, anchor);
+}
+
+void FormulaAST::Serialize(std::string& out) const {
+    root_expr_->Serialize(out);
+}
+
+double FormulaAST::Execute(FunctionRef<CellInterface::Value(Position)> sheetVisitor,
+                           Position anchor) const {
+    return program_.Execute(sheetVisitor, anchor);
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+double FormulaAST::ExecuteNumbers(FunctionRef<double(Position)> cellNumber,
+                                  Position anchor) const {
+    return program_.ExecuteNumbers(cellNumber, anchor);
 }
 
-double FormulaAST::Execute(const std::function<CellInterface::Value(Position)>& sheetVisitor) const {
-    return root_expr_->Evaluate(sheetVisitor);
+double FormulaAST::ExecuteOnSheet(const Sheet& sheet, Position anchor) const {
+    return program_.ExecuteOnSheet(sheet, anchor);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
+double FormulaAST::ExecuteTree(FunctionRef<CellInterface::Value(Position)> sheetVisitor,
+                               Position anchor) const {
+    return root_expr_->Evaluate(sheetVisitor, anchor);
 }
 
+FormulaAST::FormulaAST(ASTImpl::ArenaPtr arena, const ASTImpl::Expr* root_expr, Position* cells,
+                       size_t cell_count, Range* ranges, size_t range_count, size_t instruction_count)
+    : arena_(std::move(arena))
+    , root_expr_(root_expr)
+    , program_(arena_->Allocate<ASTImpl::Instruction>(instruction_count), instruction_count, ranges,
+               range_count)
+    , cells_(cells)
+    , cell_count_(cell_count)
+    , ranges_(ranges)
+    , range_count_(range_count) {
+    std::sort(cells_, cells_ + cell_count_);  // to avoid sorting in GetReferencedCells
+    std::sort(ranges_, ranges_ + range_count_);  // before the program refers to them
+    root_expr_->Compile(program_);
+}
+
+namespace ASTImpl {
+
+ArenaPtr Arena::Create(size_t capacity) {
+    capacity = std::max(capacity, alignof(std::max_align_t));
+    void* block = ::operator new(sizeof(Arena) + capacity);
+    return ArenaPtr(new (block) Arena(static_cast<char*>(block) + sizeof(Arena), capacity));
+}
+
+Arena::Arena(void* buffer, size_t capacity)
+    : resource_(buffer, capacity) {
+}
+
+void ArenaDeleter::operator()(Arena* arena) const {
+    arena->~Arena();
+    ::operator delete(arena);
+}
+
+std::string_view GetFunctionName(Function function) {
+    return FUNCTION_NAMES[static_cast<size_t>(function)];
+}
+
+Aggregate::Aggregate(Function function)
+    : function_(function) {
+    switch (function_) {
+        case Function::Min:
+            value_ = std::numeric_limits<double>::infinity();
+            break;
+        case Function::Max:
+            value_ = -std::numeric_limits<double>::infinity();
+            break;
+        default:
+            value_ = 0;
+            break;
+    }
+}
+
+void Aggregate::Add(const double* numbers, size_t count) {
+    // four independent accumulators: each loop step is one vector
+    // operation, and the sum does not wait for the previous addition
+    size_t i = 0;
+    switch (function_) {
+        case Function::Sum:
+        case Function::Average: {
+            double sum[4] = {0, 0, 0, 0};
+            for (; i + 4 <= count; i += 4) {
+                sum[0] += numbers[i];
+                sum[1] += numbers[i + 1];
+                sum[2] += numbers[i + 2];
+                sum[3] += numbers[i + 3];
+            }
+            for (; i < count; ++i) {
+                sum[0] += numbers[i];
+            }
+            value_ += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+            break;
+        }
+        case Function::Min: {
+            double min[4] = {value_, value_, value_, value_};
+            for (; i + 4 <= count; i += 4) {
+                min[0] = numbers[i] < min[0] ? numbers[i] : min[0];
+                min[1] = numbers[i + 1] < min[1] ? numbers[i + 1] : min[1];
+                min[2] = numbers[i + 2] < min[2] ? numbers[i + 2] : min[2];
+                min[3] = numbers[i + 3] < min[3] ? numbers[i + 3] : min[3];
+            }
+            for (; i < count; ++i) {
+                min[0] = numbers[i] < min[0] ? numbers[i] : min[0];
+            }
+            value_ = std::min(std::min(min[0], min[1]), std::min(min[2], min[3]));
+            break;
+        }
+        case Function::Max: {
+            double max[4] = {value_, value_, value_, value_};
+            for (; i + 4 <= count; i += 4) {
+                max[0] = numbers[i] > max[0] ? numbers[i] : max[0];
+                max[1] = numbers[i + 1] > max[1] ? numbers[i + 1] : max[1];
+                max[2] = numbers[i + 2] > max[2] ? numbers[i + 2] : max[2];
+                max[3] = numbers[i + 3] > max[3] ? numbers[i + 3] : max[3];
+            }
+            for (; i < count; ++i) {
+                max[0] = numbers[i] > max[0] ? numbers[i] : max[0];
+            }
+            value_ = std::max(std::max(max[0], max[1]), std::max(max[2], max[3]));
+            break;
+        }
+        case Function::Count:
+            break;
+    }
+    count_ += static_cast<double>(count);
+}
+
+void Aggregate::Merge(double value, double count) {
+    if (count == 0) {
+        return;
+    }
+    switch (function_) {
+        case Function::Sum:
+        case Function::Average:
+            value_ += value;
+            break;
+        case Function::Min:
+            value_ = std::min(value_, value);
+            break;
+        case Function::Max:
+            value_ = std::max(value_, value);
+            break;
+        case Function::Count:
+            break;
+    }
+    count_ += count;
+}
+
+void Aggregate::Flush() {
+    size_t size = block_size_;
+    block_size_ = 0;
+    Add(block_, size);
+}
+
+double Aggregate::GetValue() {
+    Flush();
+    return value_;
+}
+
+double Aggregate::GetCount() {
+    Flush();
+    return count_;
+}
+
+double Aggregate::GetResult() {
+    Flush();
+    switch (function_) {
+        case Function::Average:
+            return count_ > 0 ? value_ / count_ : ErrorToNumber(FormulaError::Category::Div0);
+        case Function::Min:
+        case Function::Max:
+            return count_ > 0 ? value_ : 0;
+        case Function::Count:
+            return count_;
+        default:
+            return value_;
+    }
+}
+
+Program::Program(Instruction* storage, size_t capacity, const Range* ranges, size_t range_count)
+    : code_(storage)
+    , capacity_(capacity)
+    , ranges_(ranges)
+    , range_count_(range_count) {
+}
+
+void Program::PushNumber(double value) {
+    Instruction instruction;
+    instruction.op = Instruction::Op::PushNumber;
+    instruction.number = value;
+    assert(size_ < capacity_);
+    code_[size_++] = instruction;
+
+    max_stack_depth_ = std::max(max_stack_depth_, ++stack_depth_);
+}
+
+void Program::PushCell(Position pos) {
+    Instruction instruction;
+    instruction.op = Instruction::Op::PushCell;
+    instruction.cell = {pos.row, pos.col};
+    assert(size_ < capacity_);
+    code_[size_++] = instruction;
+
+    max_stack_depth_ = std::max(max_stack_depth_, ++stack_depth_);
+}
+
+void Program::PushRange(Function function, Range offsets) {
+    const Range* range = std::lower_bound(ranges_, ranges_ + range_count_, offsets);
+    assert(range != ranges_ + range_count_ && *range == offsets);
+
+    Instruction instruction;
+    instruction.op = Instruction::Op::PushRange;
+    instruction.range = {function, static_cast<int>(range - ranges_)};
+    assert(size_ < capacity_);
+    code_[size_++] = instruction;
+
+    stack_depth_ += 2;
+    max_stack_depth_ = std::max(max_stack_depth_, stack_depth_);
+}
+
+void Program::Call(Function function, size_t arg_count) {
+    assert(arg_count > 0 && stack_depth_ >= 2 * arg_count);
+
+    // every argument is a constant followed by its count; a range takes
+    // one instruction, so there may be fewer instructions than values
+    const Instruction* end = code_ + size_;
+    const Instruction* args = end - std::min(size_, 2 * arg_count);
+    if (args + 2 * arg_count == end && std::all_of(args, end, [](const Instruction& instruction) {
+            return instruction.op == Instruction::Op::PushNumber;
+        })) {
+        Aggregate aggregate(function);
+        for (const Instruction* arg = args; arg != end; arg += 2) {
+            aggregate.Merge(arg[0].number, arg[1].number);
+        }
+        double result = aggregate.GetResult();
+        if (std::isfinite(result)) {
+            size_ -= 2 * arg_count;
+            stack_depth_ -= 2 * arg_count;
+            PushNumber(result);
+            return;
+        }
+    }
+
+    Instruction instruction;
+    instruction.op = Instruction::Op::Call;
+    instruction.call = {function, static_cast<int>(arg_count)};
+    assert(size_ < capacity_);
+    code_[size_++] = instruction;
+
+    stack_depth_ -= 2 * arg_count - 1;
+}
+
+void Program::Negate() {
+    assert(stack_depth_ >= 1);
+
+    // the last instruction is the root of the operand
+    Instruction& operand = code_[size_ - 1];
+    if (operand.op == Instruction::Op::PushNumber) {
+        operand.number = -operand.number;
+        return;
+    }
+    if (operand.op == Instruction::Op::Negate) {
+        --size_;
+        return;
+    }
+
+    Instruction instruction;
+    instruction.op = Instruction::Op::Negate;
+    instruction.number = 0;
+    assert(size_ < capacity_);
+    code_[size_++] = instruction;
+}
+
+namespace {
+// the value of a binary operator, as Run computes it
+double Calculate(Instruction::Op op, double lhs, double rhs) {
+    switch (op) {
+        case Instruction::Op::Add:
+            return lhs + rhs;
+        case Instruction::Op::Subtract:
+            return lhs - rhs;
+        case Instruction::Op::Multiply:
+            return lhs * rhs;
+        case Instruction::Op::Divide:
+            return lhs / rhs;
+        default:
+            assert(false);
+            return std::numeric_limits<double>::quiet_NaN();
+    }
+}
+}  // namespace
+
+void Program::Apply(Instruction::Op op, size_t rhs_begin) {
+    assert(op == Instruction::Op::Add || op == Instruction::Op::Subtract
+           || op == Instruction::Op::Multiply || op == Instruction::Op::Divide);
+    assert(stack_depth_ >= 2 && 0 < rhs_begin && rhs_begin < size_);
+
+    // the roots of the operands; a constant operand is a single instruction
+    Instruction& lhs = code_[rhs_begin - 1];
+    const Instruction& rhs = code_[size_ - 1];
+    bool lhs_constant = lhs.op == Instruction::Op::PushNumber;
+    bool rhs_constant = rhs.op == Instruction::Op::PushNumber;
+
+    // An operation that would fail is left for Run, so the error is
+    // reported in the same order as without folding.
+    if (lhs_constant && rhs_constant) {
+        double result = Calculate(op, lhs.number, rhs.number);
+        if (std::isfinite(result)) {
+            lhs.number = result;
+            --size_;
+            --stack_depth_;
+            return;
+        }
+    }
+
+    // Operands are finite, so x * 1, x / 1 and x - 0 are x exactly. x + 0
+    // is not: -0 + 0 is 0. Neither is x - -0.
+    bool rhs_identity = rhs_constant
+                        && ((op == Instruction::Op::Subtract && rhs.number == 0 && !std::signbit(rhs.number))
+                            || ((op == Instruction::Op::Multiply || op == Instruction::Op::Divide)
+                                && rhs.number == 1));
+    if (rhs_identity) {
+        --size_;
+        --stack_depth_;
+        return;
+    }
+    if (lhs_constant && op == Instruction::Op::Multiply && lhs.number == 1) {
+        std::copy(code_ + rhs_begin, code_ + size_, code_ + rhs_begin - 1);
+        --size_;
+        --stack_depth_;
+        return;
+    }
+
+    Instruction instruction;
+    instruction.op = op;
+    instruction.number = 0;
+    assert(size_ < capacity_);
+    code_[size_++] = instruction;
+
+    --stack_depth_;
+}
+
+namespace {
+double ThrowIfError(double result) {
+    if (auto error = NumberToError(result)) {
+        throw *error;
+    }
+    return result;
+}
+
+// reads a range cell by cell, for sheets that give nothing better
+template <typename RangeNumber>
+void AddRange(Range range, Aggregate& aggregate, const RangeNumber& rangeNumber) {
+    for (int row = range.first.row; row <= range.last.row; ++row) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            aggregate.Add(rangeNumber(Position{row, col}));
+        }
+    }
+}
+}  // namespace
+
+double Program::Execute(FunctionRef<CellInterface::Value(Position)> sheetVisitor,
+                        Position anchor) const {
+    return Run([&sheetVisitor](Position pos) {
+        if (!pos.IsValid()) {
+            return ErrorToNumber(FormulaError::Category::Ref);
+        }
+        return ToOperand(sheetVisitor(pos));
+    }, [&sheetVisitor](Range range, Aggregate& aggregate) {
+        AddRange(range, aggregate, [&sheetVisitor](Position pos) {
+            return ToRangeNumber(sheetVisitor(pos));
+        });
+    }, anchor);
+}
+
+double Program::ExecuteNumbers(FunctionRef<double(Position)> cellNumber, Position anchor) const {
+    return ThrowIfError(Run(cellNumber, [&cellNumber](Range range, Aggregate& aggregate) {
+        AddRange(range, aggregate, cellNumber);
+    }, anchor));
+}
+
+double Program::ExecuteOnSheet(const Sheet& sheet, Position anchor) const {
+    return Run([&sheet](Position pos) {
+        return sheet.GetNumber(pos);
+    }, [&sheet](Range range, Aggregate& aggregate) {
+        sheet.AggregateRange(range, aggregate);
+    }, anchor);
+}
+
+template <typename CellOperand, typename RangeOperand>
+double Program::Run(const CellOperand& cellOperand, const RangeOperand& rangeOperand,
+                    Position anchor) const {
+    // formulas rarely nest deeper than this, so the stack usually
+    // lives on the native stack frame
+    constexpr size_t INLINE_STACK_SIZE = 64;
+    double inline_stack[INLINE_STACK_SIZE];
+    std::unique_ptr<double[]> heap_stack;
+    double* stack = inline_stack;
+    if (max_stack_depth_ > INLINE_STACK_SIZE) {
+        heap_stack = std::make_unique<double[]>(max_stack_depth_);
+        stack = heap_stack.get();
+    }
+
+    // errors travel as values: the first one ends the evaluation, as the
+    // first thrown error used to
+    const double div0 = ErrorToNumber(FormulaError::Category::Div0);
+
+    size_t top = 0;
+    for (const Instruction* it = code_; it != code_ + size_; ++it) {
+        const Instruction& instruction = *it;
+        switch (instruction.op) {
+            case Instruction::Op::PushNumber:
+                stack[top++] = instruction.number;
+                break;
+            case Instruction::Op::PushCell: {
+                double value = cellOperand(
+                    Position{anchor.row + instruction.cell.row, anchor.col + instruction.cell.col});
+                if (std::isnan(value) && NumberToError(value)) {
+                    return value;
+                }
+                stack[top++] = value;
+                break;
+            }
+            case Instruction::Op::PushRange: {
+                const Range& offsets = ranges_[instruction.range.index];
+                Range range{{anchor.row + offsets.first.row, anchor.col + offsets.first.col},
+                            {anchor.row + offsets.last.row, anchor.col + offsets.last.col}};
+                if (!range.IsValid()) {
+                    return ErrorToNumber(FormulaError::Category::Ref);
+                }
+                Aggregate aggregate(instruction.range.function);
+                rangeOperand(range, aggregate);
+                stack[top++] = aggregate.GetValue();
+                stack[top++] = aggregate.GetCount();
+                break;
+            }
+            case Instruction::Op::Call: {
+                top -= 2 * instruction.call.arg_count;
+                Aggregate aggregate(instruction.call.function);
+                for (size_t i = top; i != top + 2 * instruction.call.arg_count; i += 2) {
+                    aggregate.Merge(stack[i], stack[i + 1]);
+                }
+                double result = aggregate.GetResult();
+                if (std::isnan(result) && NumberToError(result)) {
+                    return result;
+                }
+                if (!std::isfinite(result)) {
+                    return div0;
+                }
+                stack[top++] = result;
+                break;
+            }
+            case Instruction::Op::Negate:
+                stack[top - 1] = -stack[top - 1];
+                break;
+            case Instruction::Op::Add:
+                --top;
+                stack[top - 1] = stack[top - 1] + stack[top];
+                if (!std::isfinite(stack[top - 1])) {
+                    return div0;
+                }
+                break;
+            case Instruction::Op::Subtract:
+                --top;
+                stack[top - 1] = stack[top - 1] - stack[top];
+                if (!std::isfinite(stack[top - 1])) {
+                    return div0;
+                }
+                break;
+            case Instruction::Op::Multiply:
+                --top;
+                stack[top - 1] = stack[top - 1] * stack[top];
+                if (!std::isfinite(stack[top - 1])) {
+                    return div0;
+                }
+                break;
+            case Instruction::Op::Divide:
+                --top;
+                stack[top - 1] = stack[top - 1] / stack[top];
+                if (!std::isfinite(stack[top - 1])) {
+                    return div0;
+                }
+                break;
+        }
+    }
+
+    assert(top == 1);
+    return stack[0];
+}
+
+}  // namespace ASTImpl
+
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
@@ -3,13 +3,270 @@
 #include "FormulaLexer.h"
 #include "common.h"
 
-#include <forward_list>
-#include <functional>
+#include <cmath>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <new>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+class Sheet;
+
+// Non-owning reference to a callable. Unlike std::function it never
+// allocates and costs one call through a function pointer. The callable
+// must outlive the reference, which holds for a call argument.
+template <typename Signature>
+class FunctionRef;
+
+template <typename R, typename... Args>
+class FunctionRef<R(Args...)> {
+public:
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, FunctionRef>>>
+    FunctionRef(F&& f)
+        : object_(const_cast<void*>(static_cast<const void*>(std::addressof(f))))
+        , call_([](void* object, Args... args) -> R {
+            return (*static_cast<std::remove_reference_t<F>*>(object))(std::forward<Args>(args)...);
+        }) {
+    }
+
+    R operator()(Args... args) const {
+        return call_(object_, std::forward<Args>(args)...);
+    }
+
+private:
+    void* object_;
+    R (*call_)(void*, Args...);
+};
 
 namespace ASTImpl {
 class Expr;
-}
+class Arena;
+
+struct ArenaDeleter {
+    void operator()(Arena* arena) const;
+};
+
+using ArenaPtr = std::unique_ptr<Arena, ArenaDeleter>;
+
+// Memory of one formula. The tree nodes, the sorted cell list and the
+// compiled program are allocated from a single heap block sized before
+// parsing, so they lie next to each other. Allocations that do not fit
+// take more blocks from the heap. Nothing is freed one by one: nodes only
+// point into the arena and are released with it, without destructors.
+class Arena {
+public:
+    // The arena object itself lives at the start of the block.
+    static ArenaPtr Create(size_t capacity);
+
+    template <typename T, typename... Args>
+    T* New(Args&&... args) {
+        return new (resource_.allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // Uninitialized storage for count objects of a trivial type.
+    template <typename T>
+    T* Allocate(size_t count) {
+        if (count == 0) {
+            return nullptr;
+        }
+        return static_cast<T*>(resource_.allocate(sizeof(T) * count, alignof(T)));
+    }
+
+private:
+    Arena(void* buffer, size_t capacity);
+
+    std::pmr::monotonic_buffer_resource resource_;
+};
+
+// Read-only view of an array allocated from an arena.
+template <typename T>
+class ArrayView {
+public:
+    ArrayView(const T* data, size_t size)
+        : data_(data)
+        , size_(size) {
+    }
+
+    const T* begin() const {
+        return data_;
+    }
+
+    const T* end() const {
+        return data_ + size_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+private:
+    const T* data_;
+    size_t size_;
+};
+
+// Built-in aggregate functions. Numbers, text that reads as a number and
+// formula values count; empty cells, other text and errors in a range are
+// skipped. An error in a plain argument is the result of the function.
+enum class Function : unsigned char {
+    Sum,
+    Average,
+    Min,
+    Max,
+    Count,
+};
+
+// Name of the function in formulas, e.g. "SUM".
+std::string_view GetFunctionName(Function function);
+
+// Partial result of an aggregate function: how many numbers were taken and
+// a value that depends on the function (their sum, minimum or maximum).
+// Single numbers are gathered into a block that is reduced by loops
+// without dependencies between iterations, which compilers turn into SIMD
+// code; numbers that already lie contiguously are reduced in place.
+class Aggregate {
+public:
+    explicit Aggregate(Function function);
+
+    // NaN is skipped, see Cell::GetRangeNumber.
+    void Add(double number) {
+        if (!std::isnan(number)) {
+            block_[block_size_++] = number;
+            if (block_size_ == BLOCK_SIZE) {
+                Flush();
+            }
+        }
+    }
+
+    // count numbers without NaN.
+    void Add(const double* numbers, size_t count);
+
+    // Adds the partial result of another aggregate of the same function.
+    void Merge(double value, double count);
+
+    double GetValue();
+    double GetCount();
+
+    // The value of the function; for AVERAGE of no numbers an error
+    // encoded by ErrorToNumber, for MIN and MAX of no numbers 0.
+    double GetResult();
+
+private:
+    void Flush();
+
+    static constexpr size_t BLOCK_SIZE = 256;
+
+    Function function_;
+    double value_;
+    double count_ = 0;
+    size_t block_size_ = 0;
+    double block_[BLOCK_SIZE];
+};
+
+// One step of a compiled formula. Operands are stored inline, so the whole
+// formula is a single contiguous array without pointers to chase.
+struct Instruction {
+    enum class Op : unsigned char {
+        PushNumber,
+        PushCell,
+        // pushes the partial result of an aggregate over a range:
+        // the value and the count, see Aggregate
+        PushRange,
+        Negate,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        // pops arg_count partial results and pushes the value of the function
+        Call,
+    };
+
+    struct CellOperand {
+        int row;
+        int col;
+    };
+
+    // the range is kept in the list of the formula, see Program
+    struct RangeOperand {
+        Function function;
+        int index;
+    };
+
+    struct CallOperand {
+        Function function;
+        int arg_count;
+    };
+
+    Op op;
+    union {
+        double number;
+        CellOperand cell;
+        RangeOperand range;
+        CallOperand call;
+    };
+};
+
+// Formula lowered into reverse Polish notation and run by a stack machine.
+// Operations on constants are folded while the program is built, and
+// operations that cannot change their operand (unary plus, double negation,
+// x * 1, 1 * x, x / 1, x - 0) are dropped. The result is bit for bit the
+// one of the unfolded program; an operation that would fail is kept.
+class Program {
+public:
+    Program() = default;
+    // Instructions are written to storage, which has room for capacity of
+    // them and outlives the program. Ranges are the sorted offsets of the
+    // ranges of the formula, instructions refer to them by index.
+    Program(Instruction* storage, size_t capacity, const Range* ranges, size_t range_count);
+
+    void PushNumber(double value);
+    void PushCell(Position pos);
+    void PushRange(Function function, Range offsets);
+    void Negate();
+    // A binary operator; rhs_begin is the size of the program before the
+    // right operand was appended.
+    void Apply(Instruction::Op op, size_t rhs_begin);
+    void Call(Function function, size_t arg_count);
+
+    // Nothing is thrown: an error, like text that is not a number or an
+    // invalid position, is returned encoded by ErrorToNumber. Cells of
+    // ranges are read by sheetVisitor too: a number or text that reads as a
+    // number counts, anything else is skipped.
+    double Execute(FunctionRef<CellInterface::Value(Position)> sheetVisitor, Position anchor) const;
+    // Same, but cellNumber returns the operand of a referenced cell directly,
+    // an error encoded by ErrorToNumber, or throws FormulaError. Cells of
+    // ranges for which it returns NaN are skipped.
+    double ExecuteNumbers(FunctionRef<double(Position)> cellNumber, Position anchor) const;
+    // Reads operands with Sheet::GetNumber and ranges with
+    // Sheet::AggregateRange, called directly. Nothing is thrown: an error
+    // is returned encoded by ErrorToNumber.
+    double ExecuteOnSheet(const Sheet& sheet, Position anchor) const;
+
+    size_t GetSize() const {
+        return size_;
+    }
+
+private:
+    template <typename CellOperand, typename RangeOperand>
+    double Run(const CellOperand& cellOperand, const RangeOperand& rangeOperand, Position anchor) const;
+
+    Instruction* code_ = nullptr;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+    const Range* ranges_ = nullptr;
+    size_t range_count_ = 0;
+    size_t stack_depth_ = 0;
+    size_t max_stack_depth_ = 0;
+};
+}  // namespace ASTImpl
 
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
@@ -17,34 +274,96 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 public:
-    
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+    // root_expr, cells and ranges are allocated from arena,
+    // instruction_count is the size of the compiled program.
+    FormulaAST(ASTImpl::ArenaPtr arena, const ASTImpl::Expr* root_expr, Position* cells,
+               size_t cell_count, Range* ranges, size_t range_count, size_t instruction_count);
+    FormulaAST(FormulaAST&&);
+    FormulaAST& operator=(FormulaAST&&);
     ~FormulaAST();
 
-    double Execute(const std::function<CellInterface::Value(Position)>& sheetVisitor) const;
-    void PrintCells(std::ostream& out) const;
-    void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    // Cell positions are stored as offsets from an anchor cell, so one AST
+    // can be shared by all cells holding the same formula up to a shift.
+    // With the default anchor A1 the offsets are the absolute positions.
+
+    // Evaluates the compiled program. Errors are returned encoded by
+    // ErrorToNumber instead of thrown.
+    double Execute(FunctionRef<CellInterface::Value(Position)> sheetVisitor,
+                   Position anchor = {}) const;
+    // Evaluates the compiled program, reading referenced cells as operands
+    // without going through CellInterface::Value. Throws FormulaError.
+    double ExecuteNumbers(FunctionRef<double(Position)> cellNumber, Position anchor = {}) const;
+    // Same as Execute, specialized for the concrete sheet: no indirect call
+    // per referenced cell.
+    double ExecuteOnSheet(const Sheet& sheet, Position anchor = {}) const;
+    // Evaluates by walking the expression tree. Kept as a reference for the
+    // compiled program in tests and benchmarks.
+    double ExecuteTree(FunctionRef<CellInterface::Value(Position)> sheetVisitor,
+                       Position anchor = {}) const;
+    void PrintCells(std::ostream& out, Position anchor = {}) const;
+    void Print(std::ostream& out, Position anchor = {}) const;
+    void PrintFormula(std::ostream& out, Position anchor = {}) const;
 
-    std::forward_list<Position>& GetCells() {
-        return cells_;
+    // Appends the tree in postfix order: operands first, then the node.
+    // Unlike the program it keeps the formula as written, with unary pluses
+    // and unfolded constants, so the formula text can be printed from the
+    // restored tree. Numbers and cell offsets are stored in
+    // native byte order.
+    void Serialize(std::string& out) const;
+
+    // Offsets of the referenced cells in ascending order, with repeats.
+    // Cells of ranges are not listed.
+    ASTImpl::ArrayView<Position> GetCells() const {
+        return {cells_, cell_count_};
+    }
+
+    // Offsets of the corners of the ranges in ascending order, with repeats.
+    ASTImpl::ArrayView<Range> GetRanges() const {
+        return {ranges_, range_count_};
     }
 
-    const std::forward_list<Position>& GetCells() const {
-        return cells_;
+    const ASTImpl::Program& GetProgram() const {
+        return program_;
     }
 
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    // owns the memory of everything below
+    ASTImpl::ArenaPtr arena_;
+
+    const ASTImpl::Expr* root_expr_ = nullptr;
+
+    // the tree is only needed for printing, evaluation
+    // runs the program compiled from it
+    ASTImpl::Program program_;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
-    std::forward_list<Position> cells_;
+    Position* cells_ = nullptr;
+    size_t cell_count_ = 0;
+
+    // a range stays one entry however many cells it covers
+    Range* ranges_ = nullptr;
+    size_t range_count_ = 0;
 };
 
+// Hand-written recursive-descent parser working directly on the input.
+// Cells are stored relative to the anchor.
+FormulaAST ParseFormulaAST(std::string_view in, Position anchor = {});
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+
+// Rebuilds a tree written by FormulaAST::Serialize without lexing or
+// parsing any text. Throws ParsingError on malformed input.
+FormulaAST DeserializeFormulaAST(std::string_view in);
+
+// Reference parser generated by ANTLR from Formula.g4. Much slower,
+// kept to check the hand-written parser against the grammar.
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in);
+FormulaAST ParseFormulaASTWithAntlr(const std::string& in_str);
+
+// Canonical text of a formula written at the anchor: tokens separated by
+// spaces, cells, including corners of ranges, as R1C1-style offsets from
+// the anchor. Formulas filled down
+// a column ("A1*B1" at C1, "A2*B2" at C2) share the same relative form.
+// Throws on lexing errors and invalid positions.
+std::string GetRelativeForm(std::string_view in, Position anchor);
@@ -0,0 +1,47 @@
+#include "alloc_counter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+std::atomic<std::size_t> alloc_count{0};
+std::atomic<std::size_t> alloc_bytes{0};
+
+void* CountedAlloc(std::size_t size) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+}  // namespace
+
+AllocStats GetAllocStats() {
+    return {alloc_count.load(std::memory_order_relaxed), alloc_bytes.load(std::memory_order_relaxed)};
+}
+
+void* operator new(std::size_t size) {
+    return CountedAlloc(size);
+}
+
+void* operator new[](std::size_t size) {
+    return CountedAlloc(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
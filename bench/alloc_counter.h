@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstddef>
+
+// Счётчики выделений памяти. Глобальные operator new/delete подменяются в
+// alloc_counter.cpp, поэтому считается всё, что выделяет процесс бенчмарка.
+struct AllocStats {
+    std::size_t allocs = 0;
+    std::size_t bytes = 0;
+};
+
+AllocStats GetAllocStats();
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "alloc_counter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+inline volatile std::size_t bench_sink = 0;
+
+// Не даёт компилятору выбросить вычисления, результат которых не используется.
+inline void Consume(std::size_t value) {
+    bench_sink = value;
+}
+
+// Минимальный раннер микробенчмарков в духе test_runner_p.h.
+// Каждый замер печатается одной JSON-строкой, чтобы результаты можно было
+// сравнивать между сборками скриптом:
+// {"bench":"...","cells":N,"ops":N,"ns_per_op":X,"allocs_per_op":X,"bytes_per_op":X,"ops_per_sec":X}
+class BenchRunner {
+public:
+    BenchRunner(std::ostream& out, std::string filter)
+        : out_(out)
+        , filter_(std::move(filter)) {
+    }
+
+    bool Enabled(std::string_view name) const {
+        return filter_.empty() || name.find(filter_) != std::string_view::npos;
+    }
+
+    // setup() готовит состояние и не измеряется; body(state) выполняет
+    // замеряемую работу и возвращает число выполненных операций.
+    // Замер повторяется, пока суммарное время не превысит min_time_.
+    template <typename Setup, typename Body>
+    void Run(std::string_view name, std::size_t cells, Setup setup, Body body) {
+        if (!Enabled(name)) {
+            return;
+        }
+
+        std::size_t total_ops = 0;
+        std::size_t total_allocs = 0;
+        std::size_t total_bytes = 0;
+        std::chrono::nanoseconds total_time{0};
+
+        for (int rep = 0; rep < max_reps_ && (rep == 0 || total_time < min_time_); ++rep) {
+            auto state = setup();
+
+            AllocStats before = GetAllocStats();
+            auto start = std::chrono::steady_clock::now();
+            std::size_t ops = body(state);
+            auto finish = std::chrono::steady_clock::now();
+            AllocStats after = GetAllocStats();
+
+            total_time += finish - start;
+            total_ops += ops;
+            total_allocs += after.allocs - before.allocs;
+            total_bytes += after.bytes - before.bytes;
+        }
+
+        Report(name, cells, total_ops, total_time, total_allocs, total_bytes);
+    }
+
+    // Для замеров без отдельной подготовки состояния.
+    template <typename Body>
+    void Run(std::string_view name, std::size_t cells, Body body) {
+        Run(name, cells, [] { return 0; }, [&body](int) { return body(); });
+    }
+
+    // Произвольная метрика, которую нельзя выразить через время, например
+    // размер структуры в байтах.
+    void ReportValue(std::string_view name, std::string_view metric, double value) {
+        if (!Enabled(name)) {
+            return;
+        }
+        out_ << "{\"bench\":\"" << name << "\",\"" << metric << "\":" << value << "}" << std::endl;
+    }
+
+private:
+    void Report(std::string_view name, std::size_t cells, std::size_t ops,
+                std::chrono::nanoseconds time, std::size_t allocs, std::size_t bytes) {
+        double safe_ops = static_cast<double>(std::max<std::size_t>(ops, 1));
+        double ns = static_cast<double>(time.count());
+        out_ << std::fixed << std::setprecision(2)
+             << "{\"bench\":\"" << name << "\""
+             << ",\"cells\":" << cells
+             << ",\"ops\":" << ops
+             << ",\"ns_per_op\":" << ns / safe_ops
+             << ",\"allocs_per_op\":" << allocs / safe_ops
+             << ",\"bytes_per_op\":" << bytes / safe_ops
+             << ",\"ops_per_sec\":" << (ns > 0 ? safe_ops * 1e9 / ns : 0.0)
+             << "}" << std::defaultfloat << std::endl;
+    }
+
+    std::ostream& out_;
+    std::string filter_;
+    std::chrono::nanoseconds min_time_ = std::chrono::milliseconds(200);
+    int max_reps_ = 50;
+};
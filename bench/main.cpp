@@ -0,0 +1,754 @@
+#include "bench_runner.h"
+
+#include "common.h"
+#include "formula.h"
+#include "FormulaAST.h"
+#include "output_buffer.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// Ширина тестовых листов: 1M ячеек помещаются в 10000 строк.
+constexpr int GRID_WIDTH = 100;
+
+const std::vector<std::size_t> SHEET_SIZES = {1'000, 10'000, 100'000, 1'000'000};
+
+Position GridPos(std::size_t index) {
+    return {static_cast<int>(index / GRID_WIDTH), static_cast<int>(index % GRID_WIDTH)};
+}
+
+// Поток, который только считает записанные байты.
+class NullBuffer : public std::streambuf {
+protected:
+    std::streamsize xsputn(const char*, std::streamsize count) override {
+        return count;
+    }
+
+    int_type overflow(int_type ch) override {
+        return traits_type::not_eof(ch);
+    }
+};
+
+// Формула в нечётном столбце ссылается на число слева от себя, поэтому
+// вычисление не уходит в глубокую рекурсию.
+std::string FormulaFor(Position pos) {
+    Position left{pos.row, pos.col - 1};
+    return "=" + left.ToString() + "*2+1";
+}
+
+std::unique_ptr<Sheet> MakeMixedSheet(std::size_t cells) {
+    auto sheet = std::make_unique<Sheet>();
+    for (std::size_t i = 0; i < cells; ++i) {
+        Position pos = GridPos(i);
+        if (pos.col % 2 == 0) {
+            sheet->SetCell(pos, std::to_string(i));
+        } else {
+            sheet->SetCell(pos, FormulaFor(pos));
+        }
+    }
+    return sheet;
+}
+
+void WarmUp(const Sheet& sheet, std::size_t cells) {
+    for (std::size_t i = 0; i < cells; ++i) {
+        sheet.GetCell(GridPos(i))->GetValue();
+    }
+}
+
+void BenchSetCell(BenchRunner& runner, std::size_t cells) {
+    runner.Run("SetCell/text", cells, [] { return std::make_unique<Sheet>(); },
+               [cells](auto& sheet) {
+                   for (std::size_t i = 0; i < cells; ++i) {
+                       sheet->SetCell(GridPos(i), "text");
+                   }
+                   return cells;
+               });
+
+    runner.Run("SetCell/number", cells, [] { return std::make_unique<Sheet>(); },
+               [cells](auto& sheet) {
+                   for (std::size_t i = 0; i < cells; ++i) {
+                       sheet->SetCell(GridPos(i), std::to_string(i));
+                   }
+                   return cells;
+               });
+
+    runner.Run("SetCell/formula", cells,
+               [cells] {
+                   std::vector<std::string> formulas;
+                   formulas.reserve(cells);
+                   for (std::size_t i = 0; i < cells; ++i) {
+                       Position pos = GridPos(i);
+                       Position above{pos.row - 1, pos.col};
+                       formulas.push_back(pos.row == 0 ? "=1+2" : "=" + above.ToString() + "*2+1");
+                   }
+                   return std::make_pair(std::make_unique<Sheet>(), std::move(formulas));
+               },
+               [cells](auto& state) {
+                   auto& [sheet, formulas] = state;
+                   for (std::size_t i = 0; i < cells; ++i) {
+                       sheet->SetCell(GridPos(i), std::move(formulas[i]));
+                   }
+                   return cells;
+               });
+}
+
+// Вставка блока чисел поверх листа с вычисленными формулами:
+// по одной правке и одним пакетом.
+void BenchPaste(BenchRunner& runner, std::size_t cells) {
+    auto setup = [cells] {
+        auto sheet = MakeMixedSheet(cells);
+        WarmUp(*sheet, cells);
+        return sheet;
+    };
+    auto paste = [cells](Sheet& sheet) {
+        for (std::size_t i = 0; i < cells; i += 2) {
+            sheet.SetCell(GridPos(i), std::to_string(i + 1));
+        }
+        return cells / 2;
+    };
+
+    runner.Run("Paste/single", cells, setup, [&paste](auto& sheet) {
+        return paste(*sheet);
+    });
+
+    runner.Run("Paste/batch", cells, setup, [&paste](auto& sheet) {
+        sheet->BeginBatch();
+        std::size_t ops = paste(*sheet);
+        sheet->Commit();
+        return ops;
+    });
+}
+
+// Текст PrintTexts загружается обратно в пустой лист: по одной ячейке
+// через SetCell и целиком через LoadTexts из потока и из файла.
+void BenchLoad(BenchRunner& runner, std::size_t cells) {
+    std::ostringstream printed;
+    MakeMixedSheet(cells)->PrintTexts(printed);
+    const std::string texts = printed.str();
+    auto setup = [] {
+        return std::make_unique<Sheet>();
+    };
+
+    runner.Run("Load/set_cell", cells, setup, [&texts, cells](auto& sheet) {
+        Position pos{0, 0};
+        std::size_t field_start = 0;
+        for (std::size_t i = 0; i < texts.size(); ++i) {
+            if (texts[i] != '\t' && texts[i] != '\n') {
+                continue;
+            }
+            if (i > field_start) {
+                sheet->SetCell(pos, texts.substr(field_start, i - field_start));
+            }
+            pos = texts[i] == '\t' ? Position{pos.row, pos.col + 1} : Position{pos.row + 1, 0};
+            field_start = i + 1;
+        }
+        return cells;
+    });
+
+    auto path = std::filesystem::temp_directory_path() / "spreadsheet_bench_load.tsv";
+    {
+        std::ofstream file(path, std::ios::binary);
+        file << texts;
+    }
+    std::size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (std::size_t threads = 1; threads <= max_threads; threads *= 2) {
+        runner.Run("LoadTexts/stream/threads:" + std::to_string(threads), cells, setup,
+                   [&texts, cells, threads](auto& sheet) {
+                       std::istringstream input(texts);
+                       sheet->LoadTexts(input, threads);
+                       return cells;
+                   });
+        runner.Run("LoadTexts/file/threads:" + std::to_string(threads), cells, setup,
+                   [&path, cells, threads](auto& sheet) {
+                       sheet->LoadTexts(path, threads);
+                       return cells;
+                   });
+    }
+    std::filesystem::remove(path);
+}
+
+// Перезапуск процесса: лист восстанавливается из текста или из снимка,
+// затем читаются все значения.
+void BenchColdStart(BenchRunner& runner, std::size_t cells) {
+    auto sheet = MakeMixedSheet(cells);
+    WarmUp(*sheet, cells);
+    auto texts_path = std::filesystem::temp_directory_path() / "spreadsheet_bench_cold.tsv";
+    {
+        std::ofstream file(texts_path, std::ios::binary);
+        sheet->PrintTexts(file);
+    }
+    auto snapshot_path = std::filesystem::temp_directory_path() / "spreadsheet_bench_cold.snapshot";
+    sheet->SaveSnapshot(snapshot_path);
+    sheet.reset();
+
+    runner.Run("Snapshot/save", cells, [cells] {
+        auto sheet = MakeMixedSheet(cells);
+        WarmUp(*sheet, cells);
+        return sheet;
+    }, [cells](auto& sheet) {
+        sheet->SaveSnapshot(std::filesystem::temp_directory_path() / "spreadsheet_bench_save.snapshot");
+        return cells;
+    });
+    std::filesystem::remove(std::filesystem::temp_directory_path() / "spreadsheet_bench_save.snapshot");
+
+    runner.Run("ColdStart/texts", cells, [&texts_path, cells] {
+        Sheet sheet;
+        sheet.LoadTexts(texts_path);
+        WarmUp(sheet, cells);
+        return cells;
+    });
+
+    runner.Run("ColdStart/snapshot", cells, [&snapshot_path, cells] {
+        auto sheet = Sheet::LoadSnapshot(snapshot_path);
+        WarmUp(*sheet, cells);
+        return cells;
+    });
+
+    std::filesystem::remove(texts_path);
+    std::filesystem::remove(snapshot_path);
+}
+
+void BenchGetValue(BenchRunner& runner, std::size_t cells) {
+    runner.Run("GetValue/cold", cells, [cells] { return MakeMixedSheet(cells); },
+               [cells](auto& sheet) {
+                   WarmUp(*sheet, cells);
+                   return cells;
+               });
+
+    runner.Run("GetValue/warm", cells,
+               [cells] {
+                   auto sheet = MakeMixedSheet(cells);
+                   WarmUp(*sheet, cells);
+                   return sheet;
+               },
+               [cells](auto& sheet) {
+                   WarmUp(*sheet, cells);
+                   return cells;
+               });
+}
+
+// Лист, где почти все формулы дают ошибку: в каждой четвёрке столбцов
+// текст, #VALUE! от этого текста и две формулы с #DIV/0!.
+std::unique_ptr<Sheet> MakeErrorSheet(std::size_t cells) {
+    auto sheet = std::make_unique<Sheet>();
+    for (std::size_t i = 0; i < cells; ++i) {
+        Position pos = GridPos(i);
+        std::string left = Position{pos.row, pos.col - 1}.ToString();
+        switch (pos.col % 4) {
+            case 0:
+                sheet->SetCell(pos, "n/a");
+                break;
+            case 1:
+                sheet->SetCell(pos, "=" + left + "*2");
+                break;
+            case 2:
+                sheet->SetCell(pos, "=1/(" + left + "-" + left + ")");
+                break;
+            default:
+                sheet->SetCell(pos, "=" + left + "/0");
+                break;
+        }
+    }
+    return sheet;
+}
+
+void BenchErrors(BenchRunner& runner, std::size_t cells) {
+    runner.Run("GetValue/errors/cold", cells, [cells] { return MakeErrorSheet(cells); },
+               [cells](auto& sheet) {
+                   WarmUp(*sheet, cells);
+                   return cells;
+               });
+
+    runner.Run("RecalculateAll/errors", cells, [cells] { return MakeErrorSheet(cells); },
+               [cells](auto& sheet) {
+                   sheet->RecalculateAll(1);
+                   return cells;
+               });
+}
+
+// Агрегат по прямоугольнику чисел, пересчитанный после правки одной его
+// ячейки: функция от диапазона и, пока формула не слишком длинна, та же
+// сумма, записанная цепочкой сложений. Время - на ячейку диапазона.
+void BenchAggregate(BenchRunner& runner, std::size_t cells) {
+    constexpr std::size_t MAX_CHAIN_CELLS = 10'000;
+    int rows = static_cast<int>((cells + GRID_WIDTH - 1) / GRID_WIDTH);
+    Position result{rows, 0};
+    std::string range = "A1:" + Position{rows - 1, GRID_WIDTH - 1}.ToString();
+
+    auto bench = [&runner, cells, result](const std::string& name, const std::string& formula) {
+        if (!runner.Enabled(name)) {
+            return;
+        }
+        Sheet sheet;
+        for (std::size_t i = 0; i < cells; ++i) {
+            sheet.SetCell(GridPos(i), std::to_string(i % 1000));
+        }
+        sheet.SetCell(result, formula);
+        int edit = 0;
+        runner.Run(name, cells, [&sheet] { return &sheet; }, [cells, result, &edit](Sheet* sheet) {
+            sheet->SetCell(Position{0, 0}, std::to_string(++edit % 1000));
+            sheet->GetCell(result)->GetValue();
+            return cells;
+        });
+    };
+
+    for (std::string function : {"SUM", "AVERAGE", "MIN", "MAX", "COUNT"}) {
+        bench("Aggregate/" + function + "/range", "=" + function + "(" + range + ")");
+    }
+
+    // замена формулы над диапазоном: ссылки пересчитываются заново
+    if (runner.Enabled("Aggregate/set_formula")) {
+        Sheet sheet;
+        for (std::size_t i = 0; i < cells; ++i) {
+            sheet.SetCell(GridPos(i), std::to_string(i % 1000));
+        }
+        const std::string formulas[] = {"=SUM(" + range + ")", "=MAX(" + range + ")"};
+        int edit = 0;
+        runner.Run("Aggregate/set_formula", cells, [&sheet] { return &sheet; }, [&formulas, result, &edit](Sheet* sheet) {
+            constexpr std::size_t EDITS = 100;
+            for (std::size_t i = 0; i < EDITS; ++i) {
+                sheet->SetCell(result, formulas[++edit % 2]);
+            }
+            return EDITS;
+        });
+    }
+
+    if (cells <= MAX_CHAIN_CELLS) {
+        std::string chain = "=A1";
+        for (std::size_t i = 1; i < cells; ++i) {
+            chain += "+" + GridPos(i).ToString();
+        }
+        bench("Aggregate/SUM/chain", chain);
+    }
+}
+
+// Пересчёт всех формул после сброса кэша. Формула с номером i ссылается
+// на две формулы на RECALC_LEVEL_WIDTH номеров раньше, так что лист
+// состоит из уровней по RECALC_LEVEL_WIDTH независимых формул.
+void BenchRecalculate(BenchRunner& runner, std::size_t cells) {
+    constexpr std::size_t RECALC_LEVEL_WIDTH = 1000;
+    auto setup = [cells] {
+        auto sheet = std::make_unique<Sheet>();
+        for (std::size_t i = 0; i < cells; ++i) {
+            if (i < RECALC_LEVEL_WIDTH) {
+                sheet->SetCell(GridPos(i), std::to_string(i));
+                continue;
+            }
+            Position first = GridPos(i - RECALC_LEVEL_WIDTH);
+            Position second = GridPos(i - RECALC_LEVEL_WIDTH + 1);
+            sheet->SetCell(GridPos(i), "=" + first.ToString() + "*0.5+" + second.ToString() + "*0.25");
+        }
+        return sheet;
+    };
+
+    std::size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (std::size_t threads = 1; threads <= max_threads; threads *= 2) {
+        runner.Run("RecalculateAll/threads:" + std::to_string(threads), cells, setup,
+                   [cells, threads](auto& sheet) {
+                       sheet->RecalculateAll(threads);
+                       return cells;
+                   });
+    }
+}
+
+// Несколько потоков одновременно читают все ячейки одного листа: сначала
+// с заполнением кэша формул, затем из готового кэша.
+void BenchConcurrentRead(BenchRunner& runner, std::size_t cells) {
+    auto read_all = [cells](const Sheet& sheet, std::size_t threads) {
+        std::vector<std::thread> readers;
+        for (std::size_t t = 0; t < threads; ++t) {
+            readers.emplace_back([&sheet, cells, t] {
+                std::size_t errors = 0;
+                for (std::size_t k = 0; k < cells; ++k) {
+                    // потоки начинают с разных мест листа
+                    std::size_t i = (k + t * cells / 7) % cells;
+                    errors += std::holds_alternative<FormulaError>(sheet.GetCell(GridPos(i))->GetValue());
+                }
+                Consume(errors);
+            });
+        }
+        for (auto& reader : readers) {
+            reader.join();
+        }
+        return cells * threads;
+    };
+
+    std::size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (std::size_t threads = 1; threads <= max_threads; threads *= 2) {
+        std::string suffix = "/threads:" + std::to_string(threads);
+        runner.Run("ConcurrentRead/cold" + suffix, cells, [cells] { return MakeMixedSheet(cells); },
+                   [&read_all, threads](auto& sheet) {
+                       return read_all(*sheet, threads);
+                   });
+        runner.Run("ConcurrentRead/warm" + suffix, cells,
+                   [cells] {
+                       auto sheet = MakeMixedSheet(cells);
+                       WarmUp(*sheet, cells);
+                       return sheet;
+                   },
+                   [&read_all, threads](auto& sheet) {
+                       return read_all(*sheet, threads);
+                   });
+    }
+}
+
+// Сценарий "что если": ответвление от вычисленного листа, правка одного
+// входа и чтение зависящей от него формулы.
+void BenchFork(BenchRunner& runner, std::size_t cells) {
+    auto setup = [cells] {
+        auto sheet = MakeMixedSheet(cells);
+        WarmUp(*sheet, cells);
+        return sheet;
+    };
+
+    runner.Run("Fork/edit_one_input", cells, setup, [cells](auto& sheet) {
+        constexpr std::size_t FORKS = 100;
+        for (std::size_t i = 0; i < FORKS; ++i) {
+            auto fork = sheet->Fork();
+            Position input = GridPos((i * 2 * 7919) % cells);
+            fork->SetCell(input, "42");
+            Consume(std::holds_alternative<double>(fork->GetCell({input.row, input.col + 1})->GetValue()));
+        }
+        return FORKS;
+    });
+}
+
+void BenchPrint(BenchRunner& runner, std::size_t cells) {
+    runner.Run("PrintValues", cells,
+               [cells] {
+                   auto sheet = MakeMixedSheet(cells);
+                   WarmUp(*sheet, cells);
+                   return sheet;
+               },
+               [cells](auto& sheet) {
+                   NullBuffer buffer;
+                   std::ostream out(&buffer);
+                   sheet->PrintValues(out);
+                   return cells;
+               });
+
+    // те же ячейки, разбросанные по квадрату в 16 раз большей площади
+    runner.Run("PrintValues/sparse", cells,
+               [cells] {
+                   auto sheet = std::make_unique<Sheet>();
+                   int side = static_cast<int>(std::sqrt(static_cast<double>(cells)) * 4);
+                   for (std::size_t i = 0; i < cells; ++i) {
+                       int row = static_cast<int>((i * 7919) % side);
+                       int col = static_cast<int>((i * 104729 / side) % side);
+                       sheet->SetCell(Position{row, col}, std::to_string(i));
+                   }
+                   return sheet;
+               },
+               [cells](auto& sheet) {
+                   NullBuffer buffer;
+                   std::ostream out(&buffer);
+                   sheet->PrintValues(out);
+                   return cells;
+               });
+
+    runner.Run("ExportValues", cells,
+               [cells] {
+                   auto sheet = MakeMixedSheet(cells);
+                   WarmUp(*sheet, cells);
+                   return sheet;
+               },
+               [cells](auto& sheet) {
+                   NullBuffer buffer;
+                   std::ostream out(&buffer);
+                   sheet->ExportValues(out);
+                   return cells;
+               });
+
+    runner.Run("PrintTexts", cells, [cells] { return MakeMixedSheet(cells); },
+               [cells](auto& sheet) {
+                   NullBuffer buffer;
+                   std::ostream out(&buffer);
+                   sheet->PrintTexts(out);
+                   return cells;
+               });
+}
+
+// Выгрузка 10M чисел: целые, дроби с короткой и с полной записью.
+void BenchExport(BenchRunner& runner) {
+    constexpr std::size_t COUNT = 10'000'000;
+    std::vector<double> values(COUNT);
+    for (std::size_t i = 0; i < COUNT; ++i) {
+        switch (i % 3) {
+            case 0:
+                values[i] = static_cast<double>(i);
+                break;
+            case 1:
+                values[i] = static_cast<double>(i) / 8;
+                break;
+            default:
+                values[i] = static_cast<double>(i) / 7;
+        }
+    }
+
+    runner.Run("Export/ostream/10M", 0, [&] {
+        NullBuffer buffer;
+        std::ostream out(&buffer);
+        for (double value : values) {
+            out << value << '\t';
+        }
+        return COUNT;
+    });
+
+    runner.Run("Export/buffer/10M", 0, [&] {
+        NullBuffer buffer;
+        std::ostream out(&buffer);
+        OutputBuffer output(out);
+        for (double value : values) {
+            output.WriteNumber(value);
+            output.Write('\t');
+        }
+        return COUNT;
+    });
+
+    // точная выгрузка: через поток нужна точность 17 знаков
+    runner.Run("Export/exact/ostream/10M", 0, [&] {
+        NullBuffer buffer;
+        std::ostream out(&buffer);
+        out << std::setprecision(std::numeric_limits<double>::max_digits10);
+        for (double value : values) {
+            out << value << '\t';
+        }
+        return COUNT;
+    });
+
+    runner.Run("Export/exact/buffer/10M", 0, [&] {
+        NullBuffer buffer;
+        std::ostream out(&buffer);
+        OutputBuffer output(out);
+        for (double value : values) {
+            output.WriteExactNumber(value);
+            output.Write('\t');
+        }
+        return COUNT;
+    });
+}
+
+void BenchPosition(BenchRunner& runner) {
+    constexpr std::size_t COUNT = 1'000'000;
+    std::vector<Position> positions;
+    std::vector<std::string> strings;
+    positions.reserve(COUNT);
+    strings.reserve(COUNT);
+    for (std::size_t i = 0; i < COUNT; ++i) {
+        Position pos{static_cast<int>(i * 7919 % Position::MAX_ROWS),
+                     static_cast<int>(i * 104729 % Position::MAX_COLS)};
+        positions.push_back(pos);
+        strings.push_back(pos.ToString());
+    }
+
+    runner.Run("Position/ToString", 0, [&] {
+        std::size_t length = 0;
+        for (Position pos : positions) {
+            length += pos.ToString().size();
+        }
+        Consume(length);
+        return COUNT;
+    });
+
+    runner.Run("Position/FromString", 0, [&] {
+        std::size_t checksum = 0;
+        for (const std::string& str : strings) {
+            checksum += Position::FromString(str).col;
+        }
+        Consume(checksum);
+        return COUNT;
+    });
+
+    runner.Run("Position/ToChars", 0, [&] {
+        char buffer[Position::MAX_POSITION_LENGTH];
+        std::size_t length = 0;
+        for (Position pos : positions) {
+            length += pos.ToChars(buffer) - buffer;
+        }
+        Consume(length);
+        return COUNT;
+    });
+
+    runner.Run("Position/FromChars", 0, [&] {
+        std::size_t checksum = 0;
+        for (const std::string& str : strings) {
+            checksum += Position::FromChars(str.data(), str.data() + str.size()).col;
+        }
+        Consume(checksum);
+        return COUNT;
+    });
+}
+
+void BenchParseFormula(BenchRunner& runner) {
+    const std::vector<std::string> formulas = {
+        "1",
+        "A1",
+        "A1+B2*C3",
+        "(A1+A2+A3+A4+A5)/5",
+        "-(B12-C7)*2.5e3/(D4+1)",
+        "((1+2)*(3+4)-(5/6))*((ZZ100-AAA1)*XFD16384)",
+        "+A1*1-SUM(2,3)/4+B2/(60*60*24)",
+    };
+
+    constexpr std::size_t COUNT = 10'000;
+    for (const std::string& formula : formulas) {
+        runner.Run("ParseFormula/" + formula, 0, [&] {
+            for (std::size_t i = 0; i < COUNT; ++i) {
+                ParseFormula(formula);
+            }
+            return COUNT;
+        });
+
+        runner.Run("ParseFormulaAST/" + formula, 0, [&] {
+            for (std::size_t i = 0; i < COUNT; ++i) {
+                ParseFormulaAST(formula);
+            }
+            return COUNT;
+        });
+
+        // выделения памяти на одно дерево, которое остаётся жить после разбора
+        if (runner.Enabled("FormulaAST/memory/" + formula)) {
+            std::vector<FormulaAST> asts;
+            asts.reserve(COUNT);
+            AllocStats before = GetAllocStats();
+            for (std::size_t i = 0; i < COUNT; ++i) {
+                asts.push_back(ParseFormulaAST(formula));
+            }
+            AllocStats after = GetAllocStats();
+            runner.ReportValue("FormulaAST/memory/" + formula, "allocs_per_formula",
+                               static_cast<double>(after.allocs - before.allocs) / COUNT);
+            runner.ReportValue("FormulaAST/memory/" + formula, "bytes_per_formula",
+                               static_cast<double>(after.bytes - before.bytes) / COUNT);
+        }
+
+        // инструкций в программе после свёртки констант
+        runner.ReportValue("Program/size/" + formula, "instructions",
+                           static_cast<double>(ParseFormulaAST(formula).GetProgram().GetSize()));
+
+        // эталонный разбор через ANTLR для сравнения с рукописным парсером
+        runner.Run("ParseFormulaASTWithAntlr/" + formula, 0, [&] {
+            for (std::size_t i = 0; i < COUNT; ++i) {
+                ParseFormulaASTWithAntlr(formula);
+            }
+            return COUNT;
+        });
+    }
+}
+
+// Сравнение обхода дерева выражения с выполнением скомпилированной программы.
+// deep: ((A1+1)*2+1)*2... - глубокая вложенность, wide: A1+A2+...+A100,
+// constant: A1*(60*60)/1+A2*(60*60)/1+... - константы сворачиваются при
+// компиляции.
+void BenchEvaluators(BenchRunner& runner) {
+    constexpr int TERMS = 100;
+    Sheet sheet;
+    std::string deep = "A1";
+    std::string wide = "A1";
+    std::string constant = "A1*(60*60)/1";
+    for (int i = 1; i < TERMS; ++i) {
+        Position pos{i, 0};
+        sheet.SetCell(pos, std::to_string(i));
+        deep = "(" + deep + "+" + pos.ToString() + ")*0.5";
+        wide += "+" + pos.ToString();
+        constant += "+" + pos.ToString() + "*(60*60)/1";
+    }
+    sheet.SetCell({0, 0}, "1");
+
+    auto visitor = [&sheet](Position pos) {
+        return sheet.GetValue(pos);
+    };
+
+    for (const auto& [name, formula] : {std::pair{"deep", deep}, std::pair{"wide", wide}, std::pair{"constant", constant}}) {
+        FormulaAST ast = ParseFormulaAST(formula);
+        constexpr std::size_t COUNT = 10'000;
+
+        runner.Run(std::string("Evaluate/tree/") + name, TERMS, [&] {
+            double sum = 0;
+            for (std::size_t i = 0; i < COUNT; ++i) {
+                sum += ast.ExecuteTree(visitor);
+            }
+            Consume(static_cast<std::size_t>(sum));
+            return COUNT;
+        });
+
+        runner.Run(std::string("Evaluate/program/") + name, TERMS, [&] {
+            double sum = 0;
+            for (std::size_t i = 0; i < COUNT; ++i) {
+                sum += ast.Execute(visitor);
+            }
+            Consume(static_cast<std::size_t>(sum));
+            return COUNT;
+        });
+
+        // операнды через Sheet::GetNumber без косвенного вызова
+        runner.Run(std::string("Evaluate/sheet/") + name, TERMS, [&] {
+            double sum = 0;
+            for (std::size_t i = 0; i < COUNT; ++i) {
+                sum += ast.ExecuteOnSheet(sheet);
+            }
+            Consume(static_cast<std::size_t>(sum));
+            return COUNT;
+        });
+    }
+}
+
+}  // namespace
+
+// Использование: spreadsheet_bench [--max-cells N] [--filter SUBSTRING]
+int main(int argc, char** argv) {
+    std::size_t max_cells = SHEET_SIZES.back();
+    std::string filter;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string_view arg = argv[i];
+        if (arg == "--max-cells") {
+            max_cells = std::strtoull(argv[i + 1], nullptr, 10);
+        } else if (arg == "--filter") {
+            filter = argv[i + 1];
+        } else {
+            std::cerr << "unknown option " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    BenchRunner runner(std::cout, filter);
+
+    // цель - не больше 128 байт, см. cell.h
+    runner.ReportValue("Cell/size", "bytes", sizeof(Cell));
+
+    BenchPosition(runner);
+    BenchParseFormula(runner);
+    BenchEvaluators(runner);
+    BenchExport(runner);
+    for (std::size_t cells : SHEET_SIZES) {
+        if (cells > max_cells) {
+            break;
+        }
+        BenchSetCell(runner, cells);
+        BenchPaste(runner, cells);
+        BenchLoad(runner, cells);
+        BenchColdStart(runner, cells);
+        BenchGetValue(runner, cells);
+        BenchErrors(runner, cells);
+        BenchAggregate(runner, cells);
+        BenchRecalculate(runner, cells);
+        BenchConcurrentRead(runner, cells);
+        BenchFork(runner, cells);
+        BenchPrint(runner, cells);
+    }
+
+    return 0;
+}
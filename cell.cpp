@@ -1,73 +1,133 @@
 #include "cell.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <limits>
 #include <string>
+#include <string_view>
 #include <optional>
+#include <unordered_set>
 #include <utility>
 
 
 #include "sheet.h"
 
-Cell::Cell(Sheet &sheet)
+namespace {
+// ошибка хранится в кэше так же, как передаётся при вычислении,
+// см. ErrorToNumber
+std::uint64_t EncodeCache(const CellInterface::Value& value)
+{
+    double number;
+    if(const auto* error = std::get_if<FormulaError>(&value)){
+        number = ErrorToNumber(*error);
+    }
+    else{
+        number = std::get<double>(value);
+        if(std::isnan(number)){
+            number = std::numeric_limits<double>::quiet_NaN();
+        }
+    }
+    std::uint64_t bits;
+    std::memcpy(&bits, &number, sizeof(bits));
+    return bits;
+}
+
+CellInterface::Value DecodeCache(std::uint64_t bits)
+{
+    double number;
+    std::memcpy(&number, &bits, sizeof(number));
+    if(auto error = NumberToError(number)){
+        return *error;
+    }
+    return number;
+}
+}  // namespace
+
+// цель по памяти, см. cell.h
+static_assert(sizeof(Cell) <= 128);
+
+Cell::Cell(Sheet &sheet, Position pos)
 {
     sheet_ = &sheet;
-    impl_ = std::make_unique<EmptyImpl>();
+    pos_ = pos;
+    order_ = 0;
+    visited_ = false;
+    has_ranges_ = false;
 }
 
 void Cell::Set(std::string text)
 {
-    if(text == impl_->GetText()){
+    if(text == GetText()){
         return;
     }
 
+    Content new_content = MakeImpl(text);
+    DependencyGraph::Precedents precedents = sheet_->GetOrCreatePrecedents(GetReferencedCells(new_content),
+                                                                           GetReferencedRanges(new_content));
 
-    if(text.empty()){
-        RemoveThisCellFromDependentCells();
-        impl_ = std::make_unique<EmptyImpl>();
-        InvalidateCache();
-        return;
-    }
+    // бросает CircularDependencyException, не меняя ячейку
+    sheet_->GetGraph().SetPrecedents(this, std::move(precedents));
 
+    content_ = std::move(new_content);
+    InvalidateCache();
+}
 
-    if(text.at(0) == FORMULA_SIGN && text.size() > 1){
-        std::unique_ptr<Impl> temp_impl;
+Cell::Content Cell::MakeImpl(std::string_view text) const
+{
+    if(text.empty()){
+        return EmptyImpl();
+    }
+    else if(text.at(0) == FORMULA_SIGN && text.size() > 1){
         try{
-            temp_impl = std::make_unique<FormulaImpl>(text.substr(1), *sheet_);
+            return FormulaImpl(text.substr(1), pos_, *sheet_);
         }
         catch(std::exception&){
             throw FormulaException("incorrect formula syntaxis");
         }
+    }
+    else{
+        return TextImpl(std::string(text));
+    }
+}
 
-        std::vector<const Cell*> vector_cells;
-        if(dynamic_cast<FormulaImpl*>(temp_impl.get())->GetReferencedCells().size() > 0){
-            for(auto pos : dynamic_cast<FormulaImpl*>(temp_impl.get())->GetReferencedCells()){
-                vector_cells.push_back(sheet_->GetOrCreateCell(pos));
-            }
-        }
-        
-        CheckCyclicDependencies(vector_cells);
+std::vector<Position> Cell::GetReferencedCells(const Content& content)
+{
+    return std::visit([](const auto& impl){
+        return impl.GetReferencedCells();
+    }, content);
+}
 
-        RemoveThisCellFromDependentCells();
+std::vector<Range> Cell::GetReferencedRanges(const Content& content)
+{
+    return std::visit([](const auto& impl){
+        return impl.GetReferencedRanges();
+    }, content);
+}
 
-        if(dynamic_cast<FormulaImpl*>(temp_impl.get())->GetReferencedCells().size() > 0){
-            for(auto pos : dynamic_cast<FormulaImpl*>(temp_impl.get())->GetReferencedCells()){
-                sheet_->GetConcreteCell(pos)->AddReferringCell(this);
-            }
-        }
+bool Cell::NeedsEvaluation() const
+{
+    return std::visit([](const auto& impl){
+        return impl.NeedsEvaluation();
+    }, content_);
+}
 
-        InvalidateCache();
+const FormulaInterface* Cell::GetFormula() const
+{
+    const auto* formula = std::get_if<FormulaImpl>(&content_);
+    return formula ? formula->GetFormula() : nullptr;
+}
 
-        std::swap(impl_, temp_impl);
-        
-    }
-    else{
-        RemoveThisCellFromDependentCells();
-        impl_ = std::make_unique<TextImpl>(text);
-        InvalidateCache();
-        return; 
+std::optional<Cell::FormulaImpl> Cell::CopyFormula(Sheet& sheet) const
+{
+    if(const auto* formula = std::get_if<FormulaImpl>(&content_)){
+        return FormulaImpl(*formula, sheet);
     }
-
+    return std::nullopt;
 }
 
 void Cell::Clear()
@@ -77,28 +137,63 @@ void Cell::Clear()
 
 Cell::Value Cell::GetValue() const
 {
+    if(NeedsEvaluation()){
+        EvaluateReferencedCells();
+    }
+
+    return std::visit([](const auto& impl) -> Value {
+        return impl.GetValue();
+    }, content_);
+}
+
+Cell::ValueView Cell::GetValueView() const
+{
+    if(NeedsEvaluation()){
+        EvaluateReferencedCells();
+    }
+
+    return std::visit([](const auto& impl){
+        return impl.GetValueView();
+    }, content_);
+}
 
-    try{
-        return impl_->GetValue();
+double Cell::GetNumber() const
+{
+    if(NeedsEvaluation()){
+        EvaluateReferencedCells();
     }
-    catch(const FormulaError& err){
-        return err;
+
+    return std::visit([](const auto& impl){
+        return impl.GetNumber();
+    }, content_);
+}
+
+double Cell::GetRangeNumber() const
+{
+    if(NeedsEvaluation()){
+        EvaluateReferencedCells();
     }
+
+    return std::visit([](const auto& impl){
+        return impl.GetRangeNumber();
+    }, content_);
 }
 
 std::string Cell::GetText() const
 {
-    return impl_->GetText();
+    return std::visit([](const auto& impl){
+        return impl.GetText();
+    }, content_);
 }
  
 std::vector<Position> Cell::GetReferencedCells() const
 {
-    if(FormulaImpl* form = dynamic_cast<Cell::FormulaImpl*>(impl_.get())){
-        return form->GetReferencedCells();
-    }
-    else{
-        return std::vector<Position>{};
-    }
+    return GetReferencedCells(content_);
+}
+
+std::vector<Range> Cell::GetReferencedRanges() const
+{
+    return GetReferencedRanges(content_);
 }
 
 bool Cell::IsReferenced() const
@@ -108,7 +203,21 @@ bool Cell::IsReferenced() const
 
 bool Cell::IsEmpty() const
 {
-    return ( dynamic_cast<EmptyImpl*>(impl_.get()) != nullptr );
+    return std::holds_alternative<EmptyImpl>(content_);
+}
+
+bool Cell::IsBaseView() const
+{
+    return std::holds_alternative<BaseImpl>(content_);
+}
+
+const Cell* Cell::GetOrigin() const
+{
+    const Cell* cell = this;
+    while(const auto* view = std::get_if<BaseImpl>(&cell->content_)){
+        cell = &view->GetBase();
+    }
+    return cell;
 }
 
 
@@ -121,72 +230,101 @@ void Cell::AddReferringCell(Cell* cell)
 
 void Cell::DeleteReferringCell(Cell *cell)
 {
-    std::remove(referring_cells_.begin(), referring_cells_.end(), cell);
+    referring_cells_.erase(std::remove(referring_cells_.begin(), referring_cells_.end(), cell), referring_cells_.end());
 }
 
 void Cell::InvalidateCache()
 {
-    if(HasCache()){
-        impl_->DeleteCache();
-        for(auto cell : referring_cells_){
-            cell->InvalidateCache();
-        }
+    if(auto* formula = std::get_if<FormulaImpl>(&content_)){
+        formula->DeleteCache();
     }
-
+    std::vector<Cell*> dependents;
+    sheet_->GetGraph().ForEachDependent(*this, [&dependents](Cell* dependent){
+        dependents.push_back(dependent);
+    });
+    InvalidateCache(std::move(dependents));
 }
 
-void Cell::RemoveThisCellFromDependentCells()
+void Cell::InvalidateCache(std::vector<Cell*> stack)
 {
-    for(auto cell : GetReferencedCells()){ 
-        Cell* cell_ptr = sheet_->GetConcreteCell(cell); 
-        if(cell_ptr)    cell_ptr->DeleteReferringCell(this); 
-    } 
+    // формула без кэша не может быть вычислена раньше своих ссылок, поэтому
+    // за ячейкой без кэша закэшированных зависимых формул уже нет
+    while(!stack.empty()){
+        Cell* cell = stack.back();
+        stack.pop_back();
+        if(cell->HasCache()){
+            std::get<FormulaImpl>(cell->content_).DeleteCache();
+            cell->sheet_->GetGraph().ForEachDependent(*cell, [&stack](Cell* dependent){
+                stack.push_back(dependent);
+            });
+        }
+    }
 }
 
-void Cell::CheckCyclicDependenciesRecursion(const Cell* starting_cell, std::unordered_set<const Cell*>& processed_cells) const 
+void Cell::EvaluateReferencedCells() const
 {
-    if(processed_cells.count(this) != 0){
+    // формулы в диапазонах, у которых нет своих ссылок, вычисляются сразу
+    // при чтении и глубокой рекурсии не дают
+    const DependencyGraph& graph = sheet_->GetGraph();
+    std::vector<const Cell*> stack;
+    graph.ForEachPrecedent(*this, [&stack](const Cell* cell){
+        if(cell->NeedsEvaluation()){
+            stack.push_back(cell);
+        }
+    });
+    if(stack.empty()){
         return;
     }
 
-    if(starting_cell == this){
-        throw CircularDependencyException("circular dependency");
+    std::vector<const Cell*> pending;
+    std::unordered_set<const Cell*> seen;
+    while(!stack.empty()){
+        const Cell* cell = stack.back();
+        stack.pop_back();
+        if(!seen.insert(cell).second){
+            continue;
+        }
+        pending.push_back(cell);
+        graph.ForEachPrecedent(*cell, [&stack, &seen](const Cell* next){
+            if(next->NeedsEvaluation() && seen.count(next) == 0){
+                stack.push_back(next);
+            }
+        });
     }
 
-    for(auto ref_cell : GetReferencedCells()){
-        const Cell* _cell = sheet_->GetConcreteCell(ref_cell);
-        _cell->CheckCyclicDependenciesRecursion(starting_cell, processed_cells);
-        processed_cells.insert(_cell);
+    std::sort(pending.begin(), pending.end(), [](const Cell* lhs, const Cell* rhs){
+        return lhs->order_ < rhs->order_;
+    });
+    for(const Cell* cell : pending){
+        std::get<FormulaImpl>(cell->content_).GetValue();
     }
-
 }
 
-
-
-void Cell::CheckCyclicDependencies(const CellsContainer& referring_cells) const
+bool Cell::HasCache() const
 {
-    auto it = std::find(referring_cells.begin(), referring_cells.end(), this);
-    if(it != referring_cells.end()){
-        throw CircularDependencyException("circular dependency");
-    }
-
-    std::unordered_set<const Cell*> empty_processed_cell;
-
-    for(auto ref_cell : referring_cells){
-        ref_cell->CheckCyclicDependenciesRecursion(this, empty_processed_cell);
-    }
+    return std::visit([](const auto& impl){
+        return impl.HasCache();
+    }, content_);
 }
 
+CellInterface::Value Cell::EmptyImpl::GetValue() const
+{
+    return FormulaError(FormulaError::Category::Value);
+}
 
+Cell::ValueView Cell::EmptyImpl::GetValueView() const
+{
+    return FormulaError(FormulaError::Category::Value);
+}
 
-bool Cell::HasCache() const
+double Cell::EmptyImpl::GetNumber() const
 {
-    return impl_->HasCache();
+    return 0;
 }
 
-CellInterface::Value Cell::EmptyImpl::GetValue() const
+double Cell::EmptyImpl::GetRangeNumber() const
 {
-    return FormulaError(FormulaError::Category::Value);
+    return std::numeric_limits<double>::quiet_NaN();
 }
 
 std::string Cell::EmptyImpl::GetText() const
@@ -201,18 +339,52 @@ void Cell::EmptyImpl::Clear()
 Cell::TextImpl::TextImpl(std::string text)
 {
     text_ = std::move(text);
+    number_ = std::numeric_limits<double>::quiet_NaN();
+
+    // формула читает текст как число, только если его значение состоит из
+    // одних цифр; слишком большое число считается не числом
+    std::string_view value = text_;
+    if(!value.empty() && value.front() == ESCAPE_SIGN){
+        value.remove_prefix(1);
+    }
+    if(!value.empty() && std::all_of(value.begin(), value.end(), [](char c){
+        return std::isdigit(static_cast<unsigned char>(c));
+    })){
+        double number = 0;
+        auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), number);
+        if(error == std::errc()){
+            number_ = number;
+        }
+    }
+}
+
+CellInterface::Value Cell::TextImpl::GetValue() const
+{
+    return std::string(std::get<std::string_view>(GetValueView()));
 }
 
+Cell::ValueView Cell::TextImpl::GetValueView() const
+{
+    std::string_view value = text_;
+    if(!value.empty() && value.front() == ESCAPE_SIGN){
+        value.remove_prefix(1);
+    }
 
+    return value;
+}
 
-CellInterface::Value Cell::TextImpl::GetValue() const
+double Cell::TextImpl::GetNumber() const
 {
-    std::string res = text_;
-    if(text_.find(ESCAPE_SIGN) == 0){
-        res = text_.substr(1);
+    if(std::isnan(number_)){
+        return ErrorToNumber(FormulaError::Category::Value);
     }
 
-    return res;
+    return number_;
+}
+
+double Cell::TextImpl::GetRangeNumber() const
+{
+    return number_;
 }
 
 std::string Cell::TextImpl::GetText() const
@@ -223,11 +395,85 @@ std::string Cell::TextImpl::GetText() const
 void Cell::TextImpl::Clear()
 {
     text_ = "";
+    number_ = std::numeric_limits<double>::quiet_NaN();
 }
 
-Cell::FormulaImpl::FormulaImpl(std::string text, const Sheet& sheet) : sheet_(sheet)
+Cell::BaseImpl::BaseImpl(const Cell& base) : base_(&base)
 {
-    formula_ = ParseFormula(text);
+}
+
+CellInterface::Value Cell::BaseImpl::GetValue() const
+{
+    return base_->GetValue();
+}
+
+Cell::ValueView Cell::BaseImpl::GetValueView() const
+{
+    return base_->GetValueView();
+}
+
+double Cell::BaseImpl::GetNumber() const
+{
+    return base_->GetNumber();
+}
+
+double Cell::BaseImpl::GetRangeNumber() const
+{
+    return base_->GetRangeNumber();
+}
+
+std::string Cell::BaseImpl::GetText() const
+{
+    return base_->GetText();
+}
+
+std::vector<Position> Cell::BaseImpl::GetReferencedCells() const
+{
+    return base_->GetReferencedCells();
+}
+
+std::vector<Range> Cell::BaseImpl::GetReferencedRanges() const
+{
+    return base_->GetReferencedRanges();
+}
+
+void Cell::BaseImpl::Clear()
+{
+}
+
+Cell::FormulaImpl::FormulaImpl(std::string_view text, Position pos, Sheet& sheet) : sheet_(&sheet)
+{
+    formula_ = sheet.GetFormulaCache().ParseFormula(text, pos);
+}
+
+Cell::FormulaImpl::FormulaImpl(const FormulaImpl& other, Sheet& sheet)
+    : formula_(other.formula_)
+    , sheet_(&sheet)
+{
+}
+
+Cell::FormulaImpl::FormulaImpl(std::unique_ptr<FormulaInterface> formula, Sheet& sheet, std::optional<Value> cache)
+    : formula_(std::move(formula))
+    , sheet_(&sheet)
+{
+    if(cache){
+        cache_.store(EncodeCache(*cache), std::memory_order_relaxed);
+    }
+}
+
+Cell::FormulaImpl::FormulaImpl(FormulaImpl&& other) noexcept
+    : formula_(std::move(other.formula_))
+    , sheet_(other.sheet_)
+    , cache_(other.cache_.load(std::memory_order_relaxed))
+{
+}
+
+Cell::FormulaImpl& Cell::FormulaImpl::operator=(FormulaImpl&& other) noexcept
+{
+    formula_ = std::move(other.formula_);
+    sheet_ = other.sheet_;
+    cache_.store(other.cache_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    return *this;
 }
 
 std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const
@@ -235,6 +481,11 @@ std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const
     return formula_->GetReferencedCells();
 }
 
+std::vector<Range> Cell::FormulaImpl::GetReferencedRanges() const
+{
+    return formula_->GetReferencedRanges();
+}
+
 CellInterface::Value Cell::FormulaImpl::GetValue() const
 {
     if(HasCache()){
@@ -242,7 +493,7 @@ CellInterface::Value Cell::FormulaImpl::GetValue() const
     }
     else{
         CellInterface::Value value;
-        auto result = formula_->Evaluate(sheet_);
+        auto result = FormulaCache::Evaluate(*formula_, *sheet_);
         if(std::holds_alternative<double>(result)){
             value = std::get<double>(result);
             SetCacheValue(value);
@@ -256,6 +507,49 @@ CellInterface::Value Cell::FormulaImpl::GetValue() const
     }
 }
 
+Cell::ValueView Cell::FormulaImpl::GetValueView() const
+{
+    CellInterface::Value value = GetValue();
+    if(const double* number = std::get_if<double>(&value)){
+        return *number;
+    }
+
+    return std::get<FormulaError>(value);
+}
+
+double Cell::FormulaImpl::GetNumber() const
+{
+    // ошибка в ячейке, на которую ссылается формула, читается как 0
+    CellInterface::Value value = GetValue();
+    if(const double* number = std::get_if<double>(&value)){
+        return *number;
+    }
+
+    return 0;
+}
+
+double Cell::FormulaImpl::GetRangeNumber() const
+{
+    // в отличие от ссылки, ошибка в диапазоне пропускается
+    CellInterface::Value value = GetValue();
+    if(const double* number = std::get_if<double>(&value)){
+        return *number;
+    }
+
+    return std::numeric_limits<double>::quiet_NaN();
+}
+
+CellInterface::Value Cell::FormulaImpl::GetCacheValue() const
+{
+    return DecodeCache(cache_.load(std::memory_order_acquire));
+}
+
+void Cell::FormulaImpl::SetCacheValue(Value value) const
+{
+    std::uint64_t expected = EMPTY_CACHE;
+    cache_.compare_exchange_strong(expected, EncodeCache(value), std::memory_order_acq_rel);
+}
+
 std::string Cell::FormulaImpl::GetText() const
 {
     return std::string(1, FORMULA_SIGN) + formula_->GetExpression();
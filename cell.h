@@ -1,142 +1,298 @@
 #pragma once
 
 #include "common.h"
+#include "dependency_graph.h"
 #include "formula.h"
 
+#include <atomic>
+#include <cstdint>
 #include <functional>
-#include <unordered_set>
 #include <optional>
+#include <string_view>
+#include <variant>
+#include <vector>
 
 
 class Sheet;
 
+// Содержимое ячейки хранится в ней самой, без отдельного выделения памяти
+// и без RTTI. Цель по памяти - не больше 128 байт на ячейку на 64-битной
+// платформе, не считая текста длиннее встроенного буфера std::string,
+// списков рёбер графа и разобранных формул, общих для ячеек одной формы.
 class Cell : public CellInterface {
 public:
-    explicit Cell(Sheet& sheet);
+    Cell(Sheet& sheet, Position pos);
     ~Cell() = default;
 
     void Set(std::string text);
     void Clear();
 
+    // Значение без копирования текста. Строка смотрит в текст ячейки и
+    // действительна до следующего изменения ячейки.
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
+
     Value GetValue() const override;
+    ValueView GetValueView() const;
     std::string GetText() const override;
+    // Значение как операнд формулы, без копирования текста: число, число
+    // из текста или 0 для пустой ячейки и ошибки. Для текста, который не
+    // является числом, - ошибка #VALUE!, закодированная ErrorToNumber.
+    double GetNumber() const;
+    // Значение как элемент диапазона в агрегатной функции: число, число из
+    // текста или NaN для ячейки, которая пропускается, - пустой, с прочим
+    // текстом или с ошибкой.
+    double GetRangeNumber() const;
     std::vector<Position> GetReferencedCells() const override;
+    // Диапазоны формулы ячейки, см. FormulaInterface::GetReferencedRanges.
+    std::vector<Range> GetReferencedRanges() const;
 
     bool IsReferenced() const;
 
     bool IsEmpty() const ;
 
 private:
-    class Impl;
+    friend class DependencyGraph;
+    friend class Sheet;
 
-    std::unique_ptr<Impl> impl_;
-    Sheet* sheet_ = nullptr;
-    std::vector<Cell*> referring_cells_;
+    // Общее поведение видов ячеек. Виды хранятся в std::variant прямо в
+    // ячейке и вызываются через std::visit, без виртуальных функций: вид
+    // переопределяет только нужные ему методы, остальные берутся отсюда.
+    class Impl{
+    public:
 
-    void AddReferringCell(Cell* cell);
+        void DeleteCache() {}
 
-    void DeleteReferringCell(Cell* cell);
+        bool HasCache() const {return false;}
 
-    void InvalidateCache();
+        bool NeedsEvaluation() const {return false;}
 
-    void RemoveThisCellFromDependentCells();
+        std::vector<Position> GetReferencedCells() const {return {};}
 
-    using CellsContainer = std::vector<const Cell*>;
-    void CheckCyclicDependenciesRecursion(const Cell* starting_cell, std::unordered_set<const Cell*>& processed_cells) const ;
+        std::vector<Range> GetReferencedRanges() const {return {};}
 
-    void CheckCyclicDependencies(const CellsContainer& referring_cells) const ;
+        // Разобранная формула ячейки; у остальных ячеек nullptr.
+        const FormulaInterface* GetFormula() const {return nullptr;}
+    };
 
-    bool HasCache() const ;
 
-    class Impl{
+    class EmptyImpl final: public Impl{
     public:
 
-        virtual ~Impl() = default;
-
-        virtual void DeleteCache() {}
+        EmptyImpl() = default;
 
-        virtual bool HasCache() const {return false;}
+        CellInterface::Value GetValue() const;
 
-        virtual CellInterface::Value GetValue() const = 0 ;
+        ValueView GetValueView() const;
 
-        virtual std::string GetText() const = 0 ;
+        double GetNumber() const;
 
-        virtual void Clear() = 0 ;
+        double GetRangeNumber() const;
 
-    protected:
-        virtual Value GetCacheValue() const {return Value{};}
+        std::string GetText() const;
 
-        virtual void SetCacheValue(Value value) const {}
+        void Clear();
     };
 
 
-    class EmptyImpl final: public Impl{
+    class TextImpl final: public Impl{
     public:
+        TextImpl(std::string text);
 
-        EmptyImpl() = default;
+        CellInterface::Value GetValue() const;
+
+        ValueView GetValueView() const;
+
+        double GetNumber() const;
 
-        CellInterface::Value GetValue() const override;
+        double GetRangeNumber() const;
 
-        std::string GetText() const override;
+        std::string GetText() const;
 
-        void Clear() override;
+        void Clear();
+    private:
+        std::string text_;
+        // число, если значение текста состоит из одних цифр, иначе NaN;
+        // разбирается один раз при создании
+        double number_;
     };
 
 
-    class TextImpl final: public Impl{
+    // Ячейка основы, которую ответвление видит как есть, пока не изменит:
+    // текст, ссылки и значение вместе с кэшем берутся у ячейки основы.
+    class BaseImpl final: public Impl{
     public:
-        TextImpl(std::string text);
+        explicit BaseImpl(const Cell& base);
+
+        CellInterface::Value GetValue() const;
+
+        ValueView GetValueView() const;
 
-        CellInterface::Value GetValue() const override;
+        double GetNumber() const;
 
-        std::string GetText() const override;
+        double GetRangeNumber() const;
+
+        std::string GetText() const;
+
+        std::vector<Position> GetReferencedCells() const;
+
+        std::vector<Range> GetReferencedRanges() const;
+
+        void Clear();
+
+        const Cell& GetBase() const {
+            return *base_;
+        }
 
-        void Clear() override;
     private:
-        std::string text_;
+        const Cell* base_;
     };
 
 
     class FormulaImpl final : public Impl{
     public:
 
-        FormulaImpl(std::string, const Sheet& sheet);
+        FormulaImpl(std::string_view text, Position pos, Sheet& sheet);
+
+        // Копия для ответвления: разобранная формула общая, кэш пустой.
+        FormulaImpl(const FormulaImpl& other, Sheet& sheet);
+
+        // Формула из снимка таблицы: уже разобрана, кэш восстановлен.
+        FormulaImpl(std::unique_ptr<FormulaInterface> formula, Sheet& sheet, std::optional<Value> cache);
+
+        // Перемещение меняет ячейку, поэтому читателей у неё нет.
+        FormulaImpl(FormulaImpl&& other) noexcept;
+        FormulaImpl& operator=(FormulaImpl&& other) noexcept;
+
+        const FormulaInterface* GetFormula() const {
+            return formula_.get();
+        }
 
         std::vector<Position> GetReferencedCells() const;
 
-        CellInterface::Value GetValue() const override;
+        std::vector<Range> GetReferencedRanges() const;
+
+        CellInterface::Value GetValue() const;
+
+        ValueView GetValueView() const;
+
+        double GetNumber() const;
+
+        double GetRangeNumber() const;
 
-        std::string GetText() const override ;
+        std::string GetText() const;
 
-        void Clear() override;
+        void Clear();
 
-        void DeleteCache() override {
-            cache_.reset();
+        void DeleteCache() {
+            cache_.store(EMPTY_CACHE, std::memory_order_relaxed);
         }
 
-        bool HasCache() const override {
-            return cache_.has_value();
+        bool HasCache() const {
+            return cache_.load(std::memory_order_acquire) != EMPTY_CACHE;
+        }
+
+        bool NeedsEvaluation() const {
+            return !HasCache();
         }
 
     private:
 
-        Value GetCacheValue() const override{
-            return cache_.value();
-        }
+        Value GetCacheValue() const;
 
-        void SetCacheValue(Value value) const override {
-            cache_ = value;
-        }
+        void SetCacheValue(Value value) const;
 
+        // Кэш заполняется читателями без блокировок: значение формулы
+        // зависит только от уже вычисленных ссылок, поэтому потоки, вычислившие
+        // её одновременно, публикуют одно и то же, и остаётся первое.
+        // Число хранится своими битами, ошибка и отсутствие кэша - как NaN
+        // с метками, которые не даёт ни одна арифметическая операция.
+        static constexpr std::uint64_t EMPTY_CACHE = ~std::uint64_t{0};
 
-        std::unique_ptr<FormulaInterface> formula_;
-        const Sheet& sheet_;
-        mutable std::optional<Value> cache_ ;
+        std::shared_ptr<const FormulaInterface> formula_;
+        const Sheet* sheet_;
+        mutable std::atomic<std::uint64_t> cache_{EMPTY_CACHE};
     };
 
+    using Content = std::variant<EmptyImpl, TextImpl, BaseImpl, FormulaImpl>;
 
-    
+    Content content_;
+    Sheet* sheet_ = nullptr;
+    Position pos_;
+    // формулы, которые ссылаются на эту ячейку
+    std::vector<Cell*> referring_cells_;
+    // ячейки, на которые ссылается формула этой ячейки
+    std::vector<Cell*> referenced_cells_;
+    // номер в топологическом порядке, который поддерживает DependencyGraph;
+    // флаги делят с ним одно слово, чтобы ячейка уложилась в 128 байт.
+    // 62 бит номера хватает: за операцию он сдвигается на единицу
+    DependencyGraph::Order order_ : 62;
+    std::uint64_t visited_ : 1;
+    // у формулы ячейки есть диапазоны, см. DependencyGraph::GetRanges
+    std::uint64_t has_ranges_ : 1;
+
+    void AddReferringCell(Cell* cell);
+
+    void DeleteReferringCell(Cell* cell);
+
+    // Разбирает текст в новое содержимое, не меняя ячейку.
+    // Бросает FormulaException.
+    Content MakeImpl(std::string_view text) const;
+
+    static std::vector<Position> GetReferencedCells(const Content& content);
+    static std::vector<Range> GetReferencedRanges(const Content& content);
+
+    // Формула ячейки, которая ещё не вычислена.
+    bool NeedsEvaluation() const;
+
+    // Разобранная формула ячейки или nullptr.
+    const FormulaInterface* GetFormula() const;
+
+    // Копия формулы ячейки для ответвления sheet, если ячейка - формула.
+    std::optional<FormulaImpl> CopyFormula(Sheet& sheet) const;
+
+    // Сбрасывает кэш зависящих от ячейки формул. Обход идёт явным стеком,
+    // поэтому глубина цепочки ссылок не ограничена размером стека вызовов.
+    void InvalidateCache();
+
+    // Сбрасывает кэш формул из cells и всех формул, зависящих от них.
+    static void InvalidateCache(std::vector<Cell*> cells);
+
+    bool HasCache() const ;
+
+    // Ячейка, значение которой берётся у ячейки основы ответвления.
+    bool IsBaseView() const;
+
+    // Ячейка, на которую в итоге смотрит цепочка ответвлений.
+    const Cell* GetOrigin() const;
+
+    // Вычисляет ещё не вычисленные формулы, от которых зависит ячейка, в
+    // топологическом порядке: к вычислению каждой из них все её ссылки
+    // уже закэшированы, и рекурсии через Sheet::GetValue не возникает.
+    void EvaluateReferencedCells() const;
 };
 
+// Обходы DependencyGraph, которым нужно устройство Cell.
+template <typename Visit>
+void DependencyGraph::ForEachDependent(const Cell& cell, Visit visit) const {
+    for (Cell* dependent : cell.referring_cells_) {
+        visit(dependent);
+    }
+    ForEachRangeDependent(cell.pos_, [&visit](Cell* dependent) {
+        visit(dependent);
+    });
+}
+
+template <typename Visit>
+void DependencyGraph::ForEachPrecedent(const Cell& cell, Visit visit) const {
+    for (Cell* precedent : cell.referenced_cells_) {
+        visit(precedent);
+    }
+    for (const Range& range : GetRanges(cell)) {
+        ForEachLinkedCell(range, [&visit](Cell* precedent) {
+            visit(precedent);
+        });
+    }
+}
+
 
 
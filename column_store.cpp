@@ -0,0 +1,59 @@
+#include "column_store.h"
+
+void ColumnStore::SetNumber(Position pos, double number) {
+    Chunk& chunk = GetMutableChunk(pos);
+    int row = pos.row % CHUNK_ROWS;
+    std::uint64_t bit = std::uint64_t{1} << row;
+    chunk.values[row] = number;
+    chunk.numbers |= bit;
+    chunk.formulas &= ~bit;
+}
+
+void ColumnStore::SetFormula(Position pos) {
+    Chunk& chunk = GetMutableChunk(pos);
+    std::uint64_t bit = std::uint64_t{1} << (pos.row % CHUNK_ROWS);
+    chunk.numbers &= ~bit;
+    chunk.formulas |= bit;
+}
+
+void ColumnStore::Clear(Position pos) {
+    if (pos.col >= static_cast<int>(columns_.size())) {
+        return;
+    }
+    auto& chunks = columns_[pos.col];
+    int index = pos.row / CHUNK_ROWS;
+    if (index >= static_cast<int>(chunks.size()) || !chunks[index]) {
+        return;
+    }
+
+    std::uint64_t bit = std::uint64_t{1} << (pos.row % CHUNK_ROWS);
+    if (!((chunks[index]->numbers | chunks[index]->formulas) & bit)) {
+        return;
+    }
+    Chunk& chunk = GetMutableChunk(pos);
+    chunk.numbers &= ~bit;
+    chunk.formulas &= ~bit;
+    // пустой блок не хранится
+    if (!(chunk.numbers | chunk.formulas)) {
+        chunks[index].reset();
+    }
+}
+
+ColumnStore::Chunk& ColumnStore::GetMutableChunk(Position pos) {
+    if (pos.col >= static_cast<int>(columns_.size())) {
+        columns_.resize(pos.col + 1);
+    }
+    auto& chunks = columns_[pos.col];
+    size_t index = pos.row / CHUNK_ROWS;
+    if (index >= chunks.size()) {
+        chunks.resize(index + 1);
+    }
+
+    auto& chunk = chunks[index];
+    if (!chunk) {
+        chunk = std::make_shared<Chunk>();
+    } else if (chunk.use_count() > 1) {
+        chunk = std::make_shared<Chunk>(*chunk);
+    }
+    return *chunk;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Числовые значения таблицы по столбцам: для обхода диапазонов, которым не
+// нужны сами ячейки. Столбец делится на блоки по CHUNK_ROWS строк; в блоке
+// числа лежат подряд, а битовые маски говорят, в каких строках число и в
+// каких формула. Число здесь - значение текста, который читается как
+// число (см. Cell::GetRangeNumber); значения формул меняются при чтении
+// таблицы и берутся из ячеек. Пустые ячейки и прочий текст ни в одной маске
+// не отмечены. Блоки неизменяемы, пока их разделяют несколько хранилищ:
+// копия хранилища для ответвления делит блоки с основой, а изменяемый блок
+// копируется.
+class ColumnStore {
+public:
+    static constexpr int CHUNK_ROWS = 64;
+
+    struct Chunk {
+        // строки с числом из текста
+        std::uint64_t numbers = 0;
+        // строки с формулой
+        std::uint64_t formulas = 0;
+        // число строки, если она отмечена в numbers
+        double values[CHUNK_ROWS];
+    };
+
+    void SetNumber(Position pos, double number);
+    void SetFormula(Position pos);
+    void Clear(Position pos);
+
+    // Вызывает visit(chunk, столбец, первая строка блока, маска строк
+    // блока внутри range) для каждого блока, который пересекается с range,
+    // по столбцам, а в столбце - по строкам.
+    template <typename Visit>
+    void ForEachChunk(Range range, Visit visit) const {
+        int last_col = std::min(range.last.col, static_cast<int>(columns_.size()) - 1);
+        for (int col = range.first.col; col <= last_col; ++col) {
+            const auto& chunks = columns_[col];
+            int last_chunk = std::min(range.last.row / CHUNK_ROWS, static_cast<int>(chunks.size()) - 1);
+            for (int index = range.first.row / CHUNK_ROWS; index <= last_chunk; ++index) {
+                if (!chunks[index]) {
+                    continue;
+                }
+                int first_row = index * CHUNK_ROWS;
+                std::uint64_t mask = ~std::uint64_t{0};
+                if (range.first.row > first_row) {
+                    mask &= ~std::uint64_t{0} << (range.first.row - first_row);
+                }
+                if (range.last.row < first_row + CHUNK_ROWS - 1) {
+                    mask &= ~std::uint64_t{0} >> (CHUNK_ROWS - 1 - (range.last.row - first_row));
+                }
+                visit(*chunks[index], col, first_row, mask);
+            }
+        }
+    }
+
+private:
+    // Блок строки pos, который можно менять; создаётся при необходимости.
+    Chunk& GetMutableChunk(Position pos);
+
+    std::vector<std::vector<std::shared_ptr<Chunk>>> columns_;
+};
+
+// Номер младшего установленного бита mask, mask != 0.
+inline int LowestBit(std::uint64_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(mask);
+#else
+    int bit = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        ++bit;
+    }
+    return bit;
+#endif
+}
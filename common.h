@@ -21,11 +21,36 @@ struct Position {
 
     static Position FromString(std::string_view str);
 
+    // То же без выделения памяти. ToChars пишет позицию в buffer длиной не
+    // меньше MAX_POSITION_LENGTH и возвращает конец записи; недопустимая
+    // позиция даёт пустую запись. FromChars разбирает [first, last).
+    char* ToChars(char* buffer) const;
+    static Position FromChars(const char* first, const char* last);
+
     static const int MAX_ROWS = 16384;
     static const int MAX_COLS = 16384;
+    static const int MAX_POSITION_LENGTH = 17;
     static const Position NONE;
 };
 
+// Прямоугольная область ячеек от левого верхнего угла first до правого
+// нижнего угла last включительно.
+struct Range {
+    Position first;
+    Position last;
+
+    bool operator==(Range rhs) const;
+    bool operator<(Range rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    // Запись вида "A1:B2"; для недопустимой области - пустая строка.
+    std::string ToString() const;
+
+    // Область с углами в произвольном порядке, например "B2:A1".
+    static Range FromCorners(Position lhs, Position rhs);
+};
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -85,11 +110,13 @@ public:
 };
 
 struct PositionHash{
+    // номер ячейки при обходе по строкам: разные допустимые позиции
+    // не дают коллизий, даже когда таблица вытянута в один столбец
     size_t operator()(const Position& pos) const {
-        size_t row = std::hash<int>()(pos.row);
-        size_t col = std::hash<int>()(pos.col);
+        size_t row = static_cast<size_t>(pos.row);
+        size_t col = static_cast<size_t>(pos.col);
 
-        return row * 37 + col * 37 * 37;
+        return row * Position::MAX_COLS + col;
     }
 };  
 
@@ -0,0 +1,269 @@
+#include "dependency_graph.h"
+
+#include "cell.h"
+#include "common.h"
+
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+
+void DependencyGraph::AddCell(Cell* cell, bool is_precedent) {
+    cell->order_ = is_precedent ? next_low_-- : next_high_++;
+}
+
+void DependencyGraph::AppendCell(Cell* cell, Precedents precedents) {
+    cell->order_ = next_high_++;
+    Relink(cell, precedents);
+}
+
+bool DependencyGraph::IsOrdered() const {
+    for (const auto& [pos, cell] : linked_) {
+        bool is_ordered = true;
+        ForEachRangeDependent(pos, [cell = cell, &is_ordered](const Cell* dependent) {
+            is_ordered = is_ordered && dependent->order_ > cell->order_;
+        });
+        if (!is_ordered) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void DependencyGraph::SetPrecedents(Cell* cell, Precedents precedents) {
+    // ячейка без ссылок могла стоять позже формул, диапазоны которых её
+    // покрывают; в неё не ведут рёбра, поэтому её можно поставить в начало
+    if (!IsLinked(cell) && !precedents.IsEmpty()) {
+        bool is_late = false;
+        ForEachRangeDependent(cell->pos_, [cell, &is_late](const Cell* dependent) {
+            is_late = is_late || dependent->order_ < cell->order_;
+        });
+        if (is_late) {
+            cell->order_ = next_low_--;
+        }
+    }
+
+    CheckCycles(cell, precedents);
+    Relink(cell, precedents);
+
+    for (Cell* precedent : cell->referenced_cells_) {
+        if (precedent->order_ > cell->order_) {
+            Reorder(precedent, cell);
+        }
+    }
+    for (const Range& range : GetRanges(*cell)) {
+        ForEachLinkedCell(range, [this, cell](Cell* linked) {
+            if (linked->order_ > cell->order_) {
+                Reorder(linked, cell);
+            }
+        });
+    }
+}
+
+void DependencyGraph::SetPrecedents(std::vector<std::pair<Cell*, Precedents>> edits) {
+    for (auto& [cell, precedents] : edits) {
+        Relink(cell, precedents);
+    }
+
+    // новые рёбра ведут только в изменённые ячейки, поэтому любой цикл
+    // проходит через изменённую ячейку со ссылками и через ячейки,
+    // достижимые из неё
+    constexpr Order lower = std::numeric_limits<Order>::min();
+    constexpr Order upper = std::numeric_limits<Order>::max();
+    forward_.clear();
+    for (auto& [cell, precedents] : edits) {
+        if (!cell->visited_ && IsLinked(cell)) {
+            Collect(cell, /* forward = */ true, lower, upper, forward_);
+        }
+    }
+    Unmark(forward_);
+
+    if (!SortForward()) {
+        for (auto it = edits.rbegin(); it != edits.rend(); ++it) {
+            Relink(it->first, it->second);
+        }
+        throw CircularDependencyException("circular dependency");
+    }
+
+    // от собранных ячеек ничего вне их не зависит, поэтому их можно
+    // поставить в конец порядка
+    for (Cell* cell : backward_) {
+        cell->order_ = next_high_++;
+    }
+}
+
+void DependencyGraph::CheckCycles(Cell* cell, const Precedents& precedents) {
+    Order upper = std::numeric_limits<Order>::min();
+    for (Cell* precedent : precedents.cells) {
+        if (precedent == cell) {
+            throw CircularDependencyException("circular dependency");
+        }
+        upper = std::max(upper, precedent->order_);
+    }
+    // из cell достижимы только ячейки, у которых есть свои ссылки
+    for (const Range& range : precedents.ranges) {
+        if (range.Contains(cell->pos_)) {
+            throw CircularDependencyException("circular dependency");
+        }
+        ForEachLinkedCell(range, [&upper](const Cell* linked) {
+            upper = std::max(upper, linked->order_);
+        });
+    }
+
+    // всё, что достижимо из cell, стоит после неё, поэтому цикл могут
+    // замкнуть только ячейки между cell и самой поздней из её ссылок
+    if (upper < cell->order_) {
+        return;
+    }
+
+    forward_.clear();
+    Collect(cell, /* forward = */ true, cell->order_ - 1, upper + 1, forward_);
+    bool has_cycle = std::any_of(precedents.cells.begin(), precedents.cells.end(), [](const Cell* precedent) {
+        return precedent->visited_;
+    });
+    for (size_t i = 1; i < forward_.size() && !has_cycle; ++i) {
+        Position pos = forward_[i]->pos_;
+        has_cycle = std::any_of(precedents.ranges.begin(), precedents.ranges.end(), [pos](const Range& range) {
+            return range.Contains(pos);
+        });
+    }
+    Unmark(forward_);
+
+    if (has_cycle) {
+        throw CircularDependencyException("circular dependency");
+    }
+}
+
+void DependencyGraph::Reorder(Cell* from, Cell* to) {
+    Order lower = to->order_;
+    Order upper = from->order_;
+
+    // зависимые от to, стоящие раньше from, и ссылки from, стоящие позже
+    // to; известно, что ребро не замыкает цикл
+    forward_.clear();
+    backward_.clear();
+    Collect(to, /* forward = */ true, lower - 1, upper, forward_);
+    Collect(from, /* forward = */ false, lower, upper + 1, backward_);
+    Unmark(forward_);
+    Unmark(backward_);
+
+    auto by_order = [](const Cell* lhs, const Cell* rhs) {
+        return lhs->order_ < rhs->order_;
+    };
+    std::sort(forward_.begin(), forward_.end(), by_order);
+    std::sort(backward_.begin(), backward_.end(), by_order);
+
+    // номера те же самые: сначала получают ссылки from, затем зависимые
+    // от to, каждая группа в прежнем относительном порядке
+    orders_.clear();
+    for (const Cell* cell : backward_) {
+        orders_.push_back(cell->order_);
+    }
+    for (const Cell* cell : forward_) {
+        orders_.push_back(cell->order_);
+    }
+    std::sort(orders_.begin(), orders_.end());
+
+    size_t i = 0;
+    for (Cell* cell : backward_) {
+        cell->order_ = orders_[i++];
+    }
+    for (Cell* cell : forward_) {
+        cell->order_ = orders_[i++];
+    }
+}
+
+void DependencyGraph::Collect(Cell* start, bool forward, Order lower, Order upper,
+                              std::vector<Cell*>& result) {
+    stack_.clear();
+    stack_.push_back(start);
+    start->visited_ = true;
+
+    while (!stack_.empty()) {
+        Cell* cell = stack_.back();
+        stack_.pop_back();
+        result.push_back(cell);
+
+        auto visit = [this, lower, upper](Cell* next) {
+            if (!next->visited_ && next->order_ > lower && next->order_ < upper) {
+                next->visited_ = true;
+                stack_.push_back(next);
+            }
+        };
+        if (forward) {
+            ForEachDependent(*cell, visit);
+        } else {
+            ForEachPrecedent(*cell, visit);
+        }
+    }
+}
+
+void DependencyGraph::Unmark(const std::vector<Cell*>& cells) {
+    for (Cell* cell : cells) {
+        cell->visited_ = false;
+    }
+}
+
+void DependencyGraph::Relink(Cell* cell, Precedents& precedents) {
+    for (Cell* old : cell->referenced_cells_) {
+        old->DeleteReferringCell(cell);
+    }
+    std::swap(cell->referenced_cells_, precedents.cells);
+    for (Cell* precedent : cell->referenced_cells_) {
+        precedent->AddReferringCell(cell);
+    }
+
+    std::vector<Range> old_ranges;
+    if (cell->has_ranges_) {
+        old_ranges = std::move(cell_ranges_.extract(cell).mapped());
+        for (const Range& range : old_ranges) {
+            ranges_.Remove(cell, range);
+        }
+    }
+    cell->has_ranges_ = !precedents.ranges.empty();
+    if (cell->has_ranges_) {
+        for (const Range& range : precedents.ranges) {
+            ranges_.Add(cell, range);
+        }
+        cell_ranges_.emplace(cell, std::move(precedents.ranges));
+    }
+    precedents.ranges = std::move(old_ranges);
+
+    if (IsLinked(cell)) {
+        linked_.emplace(cell->pos_, cell);
+    } else {
+        linked_.erase(cell->pos_);
+    }
+}
+
+bool DependencyGraph::IsLinked(const Cell* cell) {
+    return !cell->referenced_cells_.empty() || cell->has_ranges_;
+}
+
+const std::vector<Range>& DependencyGraph::GetRanges(const Cell& cell) const {
+    static const std::vector<Range> no_ranges;
+    return cell.has_ranges_ ? cell_ranges_.at(&cell) : no_ranges;
+}
+
+bool DependencyGraph::SortForward() {
+    std::unordered_map<const Cell*, size_t> in_degree;
+    for (const Cell* cell : forward_) {
+        ForEachDependent(*cell, [&in_degree](const Cell* next) {
+            ++in_degree[next];
+        });
+    }
+
+    backward_.clear();
+    for (Cell* cell : forward_) {
+        if (in_degree.count(cell) == 0) {
+            backward_.push_back(cell);
+        }
+    }
+    for (size_t i = 0; i < backward_.size(); ++i) {
+        ForEachDependent(*backward_[i], [this, &in_degree](Cell* next) {
+            if (--in_degree[next] == 0) {
+                backward_.push_back(next);
+            }
+        });
+    }
+    return backward_.size() == forward_.size();
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "common.h"
+#include "range_index.h"
+
+#include <cstdint>
+#include <map>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class Cell;
+
+// Граф зависимостей между ячейками таблицы. Ребро ведёт от ячейки к формуле,
+// которая на неё ссылается. Граф поддерживает топологический порядок: у каждой
+// ячейки есть номер, меньший номеров всех зависящих от неё формул.
+// Порядок обновляется инкрементально алгоритмом Пирса-Келли: если новое
+// ребро нарушает порядок, просматриваются и переставляются только ячейки с
+// номерами между концами ребра, а не весь граф.
+// Ссылка на диапазон не превращается в рёбра от каждой его ячейки: формулы
+// с диапазонами записаны в RangeIndex, который по позиции находит зависящие
+// от неё формулы, а ячейки диапазона, у которых есть свои ссылки, граф
+// находит по позициям. Только такие ячейки могут лежать на цикле, поэтому
+// порядок через диапазоны гарантирован лишь для них: ячейка без ссылок может
+// стоять позже формулы, диапазон которой её покрывает, и встаёт на место,
+// когда получает ссылки.
+class DependencyGraph {
+public:
+    using Order = std::int64_t;
+
+    // Ссылки формулы: ячейки, на которые она ссылается напрямую, и диапазоны.
+    struct Precedents {
+        std::vector<Cell*> cells;
+        std::vector<Range> ranges;
+
+        bool IsEmpty() const {
+            return cells.empty() && ranges.empty();
+        }
+    };
+
+    // Присваивает номер новой ячейке. Ячейку, которую создаёт ссылка из
+    // формулы, выгодно поставить в начало порядка, остальные - в конец.
+    void AddCell(Cell* cell, bool is_precedent);
+
+    // Заменяет ссылки cell. Если новые ссылки замыкают цикл, бросает
+    // CircularDependencyException и граф не меняет.
+    void SetPrecedents(Cell* cell, Precedents precedents);
+
+    // То же для пакета правок: рёбра меняются у всех ячеек сразу, а циклы
+    // ищутся одним проходом по всем ячейкам, зависящим от изменённых.
+    // Если цикл есть, бросает CircularDependencyException и граф не меняет.
+    // Порядок в пакете не важен: правки, которые по отдельности замкнули бы
+    // цикл, допустимы, если вместе цикла не дают.
+    void SetPrecedents(std::vector<std::pair<Cell*, Precedents>> edits);
+
+    // Добавляет новую ячейку в конец порядка вместе с её ссылками, не ища
+    // циклы: все precedents уже должны быть в графе. Так восстанавливается
+    // снимок таблицы, в котором ячейки записаны в топологическом порядке.
+    void AppendCell(Cell* cell, Precedents precedents);
+
+    // Проверяет порядок, восстановленный AppendCell, для ссылок через
+    // диапазоны: каждая ячейка со ссылками стоит раньше формул, диапазоны
+    // которых её покрывают.
+    bool IsOrdered() const;
+
+    // Вызывает visit для каждой формулы, которая зависит от cell: по прямой
+    // ссылке или через диапазон, покрывающий её позицию. Формула может
+    // встретиться несколько раз. Определён в cell.h.
+    template <typename Visit>
+    void ForEachDependent(const Cell& cell, Visit visit) const;
+
+    // Вызывает visit для каждой ячейки, от которой зависит cell и которая
+    // сама может от чего-то зависеть: прямых ссылок и ячеек со ссылками в
+    // её диапазонах. Определён в cell.h.
+    template <typename Visit>
+    void ForEachPrecedent(const Cell& cell, Visit visit) const;
+
+    // Формулы, диапазоны которых покрывают pos.
+    template <typename Visit>
+    void ForEachRangeDependent(Position pos, Visit visit) const {
+        ranges_.ForEachCovering(pos, visit);
+    }
+
+    // Ячейки со ссылками, которые лежат в range, по строкам.
+    template <typename Visit>
+    void ForEachLinkedCell(Range range, Visit visit) const {
+        auto it = linked_.lower_bound(range.first);
+        while (it != linked_.end() && it->first.row <= range.last.row) {
+            Position pos = it->first;
+            if (pos.col < range.first.col) {
+                it = linked_.lower_bound(Position{pos.row, range.first.col});
+            } else if (pos.col > range.last.col) {
+                it = linked_.lower_bound(Position{pos.row + 1, range.first.col});
+            } else {
+                visit(it->second);
+                ++it;
+            }
+        }
+    }
+
+    // Диапазоны формулы cell.
+    const std::vector<Range>& GetRanges(const Cell& cell) const;
+
+private:
+    // Бросает CircularDependencyException, если из cell по рёбрам
+    // достижима одна из precedents или ячейка в её диапазонах.
+    void CheckCycles(Cell* cell, const Precedents& precedents);
+
+    // Восстанавливает порядок после добавления ребра from -> to,
+    // для которого номер from больше номера to.
+    void Reorder(Cell* from, Cell* to);
+
+    // Обходит граф от start в заданном направлении, заходя только в ячейки,
+    // номера которых лежат в (lower, upper). Посещённые ячейки помечаются и
+    // добавляются в result.
+    void Collect(Cell* start, bool forward, Order lower, Order upper, std::vector<Cell*>& result);
+
+    static void Unmark(const std::vector<Cell*>& cells);
+
+    // Заменяет ссылки cell на precedents; старые ссылки остаются в precedents.
+    void Relink(Cell* cell, Precedents& precedents);
+
+    static bool IsLinked(const Cell* cell);
+
+    // Упорядочивает forward_ алгоритмом Кана и записывает результат в
+    // backward_. Возвращает false, если среди ячеек есть цикл.
+    bool SortForward();
+
+    Order next_low_ = -1;
+    Order next_high_ = 0;
+
+    std::vector<Cell*> stack_;
+    std::vector<Cell*> forward_;
+    std::vector<Cell*> backward_;
+    std::vector<Order> orders_;
+
+    RangeIndex ranges_;
+    // диапазоны формул, у которых они есть
+    std::unordered_map<const Cell*, std::vector<Range>> cell_ranges_;
+    // ячейки со ссылками по позициям
+    std::map<Position, Cell*> linked_;
+};
@@ -5,6 +5,8 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <cstdint>
+#include <cstring>
 #include <sstream>
 
 #include "sheet.h"
@@ -16,59 +18,218 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe) {
 }
 
 
+namespace {
+// NaN с единицами во всех битах порядка и в старших битах мантиссы,
+// категория - в младших битах
+constexpr std::uint64_t ERROR_NUMBER_TAG = 0xFFFF'0000'0000'0000;
+}  // namespace
+
+double ErrorToNumber(FormulaError error) {
+    std::uint64_t bits = ERROR_NUMBER_TAG | static_cast<std::uint64_t>(error.GetCategory());
+    double number;
+    std::memcpy(&number, &bits, sizeof(number));
+    return number;
+}
+
+std::optional<FormulaError> NumberToError(double number) {
+    std::uint64_t bits;
+    std::memcpy(&bits, &number, sizeof(bits));
+    if((bits & ERROR_NUMBER_TAG) != ERROR_NUMBER_TAG){
+        return std::nullopt;
+    }
+    return FormulaError(static_cast<FormulaError::Category>(bits & ~ERROR_NUMBER_TAG));
+}
+
+
 namespace {
 class Formula : public FormulaInterface {
 public:
-// Реализуйте следующие методы:
-    explicit Formula(std::string expression): ast_(ParseFormulaAST(expression)) {
+    Formula(std::shared_ptr<const FormulaAST> ast, Position anchor)
+        : ast_(std::move(ast))
+        , anchor_(anchor) {
     }
 
     Value Evaluate(const SheetInterface& sheet) const override {
 
-        const Sheet* _sheet = dynamic_cast<const Sheet*>(&sheet);
+        if(const Sheet* _sheet = dynamic_cast<const Sheet*>(&sheet)){
+            return Evaluate(*_sheet);
+        }
 
-        auto lambda = [&_sheet](Position pos){
-            return _sheet->GetValue(pos);
+        // отсутствующая ячейка читается как пустая: в выражении это 0,
+        // в диапазоне она пропускается
+        auto lambda = [&sheet](Position pos) -> CellInterface::Value {
+            const CellInterface* cell = sheet.GetCell(pos);
+            return cell ? cell->GetValue() : CellInterface::Value(FormulaError(FormulaError::Category::Value));
         };
 
+        return ToValue(ast_->Execute(lambda, anchor_));
+    }
 
-        try{
-            return ast_.Execute(lambda);
-        }
-        catch(const FormulaError& error){
-            return error;
-        }
+    Value Evaluate(const Sheet& sheet) const {
+        return ToValue(ast_->ExecuteOnSheet(sheet, anchor_));
     }
 
     std::string GetExpression() const override {
         std::stringstream str;
-        ast_.PrintFormula(str);
+        ast_->PrintFormula(str, anchor_);
 
         return str.str();
     }
 
     std::vector<Position> GetReferencedCells() const override{
-        std::set<Position> temp;
-
-        for(const auto& cell : ast_.GetCells()){
-            temp.insert(cell);
+        // cells are already sorted, a shift keeps them sorted
+        std::vector<Position> res;
+
+        for(const auto& cell : ast_->GetCells()){
+            Position pos{anchor_.row + cell.row, anchor_.col + cell.col};
+            if(res.empty() || !(res.back() == pos)){
+                res.push_back(pos);
+            }
         }
 
-        std::vector<Position> res(temp.begin(), temp.end());
+        return res;
+    }
+
+    std::vector<Range> GetReferencedRanges() const override{
+        std::vector<Range> res;
+
+        for(const auto& range : ast_->GetRanges()){
+            Range translated{{anchor_.row + range.first.row, anchor_.col + range.first.col},
+                             {anchor_.row + range.last.row, anchor_.col + range.last.col}};
+            if(res.empty() || !(res.back() == translated)){
+                res.push_back(translated);
+            }
+        }
 
         return res;
     }
 
+    const FormulaAST& GetAST() const {
+        return *ast_;
+    }
+
 private:
-    FormulaAST ast_;
+    // результат вычисления хранит ошибку внутри NaN
+    static Value ToValue(double result) {
+        if(auto error = NumberToError(result)){
+            return *error;
+        }
+        return result;
+    }
+
+    std::shared_ptr<const FormulaAST> ast_;
+    Position anchor_;
 };
 }  // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     try{
-        return std::make_unique<Formula>(std::move(expression));
+        return std::make_unique<Formula>(std::make_shared<FormulaAST>(ParseFormulaAST(expression)), Position{});
     }
     catch(...){
         throw FormulaException("ошибка в выражении" + expression);
     }
-}
\ No newline at end of file
+}
+
+std::unique_ptr<FormulaInterface> FormulaCache::ParseFormula(std::string_view expression, Position anchor) {
+    try{
+        std::string key = GetRelativeForm(expression, anchor);
+        bool has_loaded = false;
+        {
+            std::lock_guard lock(mutex_);
+            auto it = shapes_.find(key);
+            if(it != shapes_.end()){
+                return std::make_unique<Formula>(it->second, anchor);
+            }
+            has_loaded = !loaded_shapes_.empty();
+        }
+
+        // если ту же форму одновременно разобрал другой поток, остаётся его дерево
+        auto ast = std::make_shared<const FormulaAST>(ParseFormulaAST(expression, anchor));
+        std::string tree;
+        if(has_loaded){
+            ast->Serialize(tree);
+        }
+        std::lock_guard lock(mutex_);
+        if(CountShapes() >= cleanup_size_){
+            RemoveUnused();
+        }
+        // форма из снимка с тем же деревом становится общей и находится по ключу
+        auto loaded = has_loaded ? loaded_shapes_.find(tree) : loaded_shapes_.end();
+        bool is_loaded = loaded != loaded_shapes_.end();
+        auto [it, inserted] = shapes_.emplace(std::move(key), is_loaded ? loaded->second.ast : std::move(ast));
+        if(inserted && is_loaded){
+            loaded_shapes_.erase(loaded);
+        }
+        return std::make_unique<Formula>(it->second, anchor);
+    }
+    catch(...){
+        throw FormulaException("ошибка в выражении" + std::string(expression));
+    }
+}
+
+size_t FormulaCache::GetSize() const {
+    std::lock_guard lock(mutex_);
+    return CountShapes();
+}
+
+FormulaInterface::Value FormulaCache::Evaluate(const FormulaInterface& formula, const Sheet& sheet) {
+    return static_cast<const Formula&>(formula).Evaluate(sheet);
+}
+
+std::unordered_map<const FormulaAST*, std::string_view> FormulaCache::GetShapeKeys() const {
+    std::lock_guard lock(mutex_);
+    std::unordered_map<const FormulaAST*, std::string_view> keys;
+    keys.reserve(CountShapes());
+    for(const auto& [key, ast] : shapes_){
+        keys.emplace(ast.get(), key);
+    }
+    for(const auto& [tree, shape] : loaded_shapes_){
+        // ключ уже у другого дерева - значит, в снимке он был неверным
+        keys.emplace(shape.ast.get(), shapes_.count(shape.key) ? std::string_view() : std::string_view(shape.key));
+    }
+    return keys;
+}
+
+const FormulaAST& FormulaCache::GetShape(const FormulaInterface& formula) {
+    return dynamic_cast<const Formula&>(formula).GetAST();
+}
+
+std::shared_ptr<const FormulaAST> FormulaCache::AddShape(std::string key, std::string tree, FormulaAST ast) {
+    std::lock_guard lock(mutex_);
+    auto it = loaded_shapes_.find(tree);
+    if(it == loaded_shapes_.end()){
+        if(CountShapes() >= cleanup_size_){
+            RemoveUnused();
+        }
+        LoadedShape shape{std::make_shared<const FormulaAST>(std::move(ast)), std::move(key)};
+        it = loaded_shapes_.emplace(std::move(tree), std::move(shape)).first;
+    }
+    return it->second.ast;
+}
+
+std::unique_ptr<FormulaInterface> FormulaCache::MakeFormula(std::shared_ptr<const FormulaAST> shape,
+                                                            Position anchor) {
+    return std::make_unique<Formula>(std::move(shape), anchor);
+}
+
+void FormulaCache::RemoveUnused() {
+    for(auto it = shapes_.begin(); it != shapes_.end();){
+        if(it->second.use_count() == 1){
+            it = shapes_.erase(it);
+        }
+        else{
+            ++it;
+        }
+    }
+    for(auto it = loaded_shapes_.begin(); it != loaded_shapes_.end();){
+        if(it->second.ast.use_count() == 1){
+            it = loaded_shapes_.erase(it);
+        }
+        else{
+            ++it;
+        }
+    }
+
+    cleanup_size_ = std::max(MIN_CLEANUP_SIZE, CountShapes() * 2);
+}
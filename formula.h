@@ -3,12 +3,21 @@
 #include "common.h"
 
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Агрегатные функции SUM, AVERAGE, MIN, MAX, COUNT от выражений и
+//   диапазонов ячеек: SUM(A1:A100), MAX(A1:B2,C3*2). В диапазоне учитываются
+//   числа и текст, который является числом; пустые ячейки, прочий текст и
+//   ошибки пропускаются. AVERAGE без чисел даёт #DIV/0!, MIN и MAX - 0.
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -32,10 +41,82 @@ public:
 
     // Возвращает список ячеек, которые непосредственно задействованы в вычислении
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек.
+    // ячеек. Ячейки диапазонов в него не входят, см. GetReferencedRanges.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает диапазоны формулы, каждый одной записью, сколько бы ячеек
+    // он ни покрывал. Список отсортирован по возрастанию и не содержит
+    // повторов.
+    virtual std::vector<Range> GetReferencedRanges() const = 0;
 };
 
+// Ошибка формулы, закодированная в NaN с меткой, которую не даёт ни одна
+// арифметическая операция. Так операнды и результаты вычисления передают
+// ошибку значением, без исключений.
+double ErrorToNumber(FormulaError error);
+// Ошибка, закодированная в number, или nullopt для обычного числа.
+std::optional<FormulaError> NumberToError(double number);
+
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+class FormulaAST;
+class Sheet;
+
+// Кэш разобранных формул таблицы. Формулы, совпадающие с точностью до сдвига
+// (=A1*B1 в ячейке C1 и =A2*B2 в ячейке C2), разбираются один раз и
+// разделяют одно неизменяемое дерево, записанное в относительных координатах.
+// Каждая формула хранит только ссылку на общее дерево и свою позицию, поэтому
+// GetExpression() и GetReferencedCells() возвращают абсолютные значения.
+class FormulaCache {
+public:
+    // Парсит выражение формулы из ячейки anchor. Можно вызывать из
+    // нескольких потоков: новые формы разбираются без блокировки.
+    // Бросает FormulaException в случае, если формула синтаксически некорректна.
+    std::unique_ptr<FormulaInterface> ParseFormula(std::string_view expression, Position anchor);
+
+    // Количество различных разобранных формул.
+    size_t GetSize() const;
+
+    // Формы формул для снимка таблицы: ключ каждого разобранного дерева и
+    // дерево формулы, созданной кэшем. Ключ пуст, если он неизвестен.
+    std::unordered_map<const FormulaAST*, std::string_view> GetShapeKeys() const;
+    static const FormulaAST& GetShape(const FormulaInterface& formula);
+
+    // Значение формулы, созданной кэшем, на таблице sheet: ссылки читаются
+    // прямо через Sheet::GetNumber, без dynamic_cast и косвенных вызовов.
+    static FormulaInterface::Value Evaluate(const FormulaInterface& formula, const Sheet& sheet);
+
+    // Добавляет форму из снимка таблицы, восстановленную без разбора текста,
+    // и возвращает её. Ключ из файла не проверить без разбора, поэтому по
+    // нему формулы не ищутся: форма хранится по своему дереву tree
+    // (FormulaAST::Serialize), и ParseFormula отдаёт её, только разобрав
+    // выражение с тем же деревом. Ключ лишь записывается в следующий снимок.
+    // Если форма с таким деревом уже есть, возвращается она.
+    std::shared_ptr<const FormulaAST> AddShape(std::string key, std::string tree, FormulaAST ast);
+    // Формула формы shape в ячейке anchor.
+    static std::unique_ptr<FormulaInterface> MakeFormula(std::shared_ptr<const FormulaAST> shape,
+                                                         Position anchor);
+
+private:
+    // вызываются под mutex_
+    size_t CountShapes() const {
+        return shapes_.size() + loaded_shapes_.size();
+    }
+    void RemoveUnused();
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, std::shared_ptr<const FormulaAST>> shapes_;
+
+    struct LoadedShape {
+        std::shared_ptr<const FormulaAST> ast;
+        // ключ из снимка, см. AddShape
+        std::string key;
+    };
+    // формы из снимка по их деревьям, которые ещё не встретились в ParseFormula
+    std::unordered_map<std::string, LoadedShape> loaded_shapes_;
+    size_t cleanup_size_ = MIN_CLEANUP_SIZE;
+
+    static constexpr size_t MIN_CLEANUP_SIZE = 1024;
+};
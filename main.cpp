@@ -1,6 +1,19 @@
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include <limits>
+#include <optional>
+#include <random>
+#include <thread>
 #include "common.h"
 #include "formula.h"
+#include "FormulaAST.h"
+#include "output_buffer.h"
+#include "sheet.h"
 #include "test_runner_p.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
@@ -52,6 +65,51 @@ void TestPositionAndStringConversion() {
     testSingle(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "XFD16384");
 }
 
+void TestPositionCharsRoundTrip() {
+    // названия столбцов перебором: A..Z, AA..ZZ, AAA..
+    std::vector<std::string> columns;
+    for (std::string letters = "A"; columns.size() < static_cast<size_t>(Position::MAX_COLS);) {
+        columns.push_back(letters);
+        auto it = letters.rbegin();
+        while (it != letters.rend() && *it == 'Z') {
+            *it++ = 'A';
+        }
+        if (it == letters.rend()) {
+            letters.insert(letters.begin(), 'A');
+        } else {
+            ++*it;
+        }
+    }
+
+    char buffer[Position::MAX_POSITION_LENGTH];
+    for (int row = 0; row < Position::MAX_ROWS; ++row) {
+        const std::string digits = std::to_string(row + 1);
+        for (int col = 0; col < Position::MAX_COLS; ++col) {
+            Position pos{row, col};
+            char* end = pos.ToChars(buffer);
+            const std::string& letters = columns[col];
+            // сравнение без временных строк, иначе перебор идёт слишком долго
+            if (static_cast<size_t>(end - buffer) != letters.size() + digits.size()
+                || std::memcmp(buffer, letters.data(), letters.size()) != 0
+                || std::memcmp(buffer + letters.size(), digits.data(), digits.size()) != 0) {
+                ASSERT_EQUAL(std::string(buffer, end), letters + digits);
+            }
+            Position parsed = Position::FromChars(buffer, end);
+            if (parsed.row != row || parsed.col != col) {
+                ASSERT_EQUAL(parsed, pos);
+            }
+        }
+    }
+
+    ASSERT((Position{-1, 0}).ToChars(buffer) == buffer);
+    ASSERT((Position{0, Position::MAX_COLS}).ToChars(buffer) == buffer);
+    for (std::string_view str : {"", "A", "1", "a1", "A0", "A01", "AAAA1", "A1 ", "A2147483648", "XFD16385"}) {
+        ASSERT_EQUAL(Position::FromChars(str.data(), str.data() + str.size()), Position::FromString(str));
+    }
+    ASSERT_EQUAL(Position::FromString("A01"), (Position{0, 0}));
+    ASSERT_EQUAL(Position::FromString("A2147483648"), Position::NONE);
+}
+
 void TestPositionToStringInvalid() {
     ASSERT_EQUAL((Position{-1, -1}).ToString(), "");
     ASSERT_EQUAL((Position{-10, 0}).ToString(), "");
@@ -193,6 +251,403 @@ void TestFormulaReferencedCells() {
     ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
 }
 
+void TestFormulaProgramMatchesTree() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "3");
+    sheet->SetCell("B2"_pos, "=A1*2");
+    sheet->SetCell("C3"_pos, "text");
+
+    // отсутствующая ячейка - как пустая: в выражении 0, в диапазоне пропуск
+    auto visitor = [&](Position pos) {
+        const CellInterface* cell = sheet->GetCell(pos);
+        return cell ? cell->GetValue() : CellInterface::Value(FormulaError::Category::Value);
+    };
+    // программа возвращает ошибку внутри NaN, дерево её бросает
+    auto evaluate = [](auto execute) -> CellInterface::Value {
+        try {
+            double result = execute();
+            if (auto error = NumberToError(result)) {
+                return *error;
+            }
+            return result;
+        } catch (const FormulaError& error) {
+            return error;
+        }
+    };
+
+    for (std::string expr : {"1", "-A1", "+A1", "A1+B2*3", "(A1-B2)/(A1+1)", "-(-(A1))", "1/0",
+                             "A1/(B2-6)", "C3+1", "D4*2", "1e300*1e300", "A1-B2-A1*(2+B2/A1)",
+                             "SUM(A1:C3)", "COUNT(A1:C3)", "AVERAGE(A1:C3,B2)", "MIN(C3:A1)",
+                             "MAX(A1,-B2)", "AVERAGE(D4:E5)", "MIN(D4:E5)", "SUM(A1:B2)/COUNT(D4)",
+                             "SUM(1/0,A1:B2)", "MAX(1e300*10,1)", "SUM(A1:A2,A1:A2,A1)"}) {
+        FormulaAST ast = ParseFormulaAST(expr);
+        ASSERT_EQUAL(evaluate([&] { return ast.Execute(visitor); }),
+                     evaluate([&] { return ast.ExecuteTree(visitor); }));
+        ASSERT_EQUAL(evaluate([&] { return ast.ExecuteOnSheet(static_cast<const Sheet&>(*sheet)); }),
+                     evaluate([&] { return ast.ExecuteTree(visitor); }));
+    }
+
+    for (auto category : {FormulaError::Category::Ref, FormulaError::Category::Value,
+                          FormulaError::Category::Div0}) {
+        double number = ErrorToNumber(category);
+        ASSERT(std::isnan(number));
+        ASSERT(NumberToError(number) == std::optional<FormulaError>(category));
+    }
+    for (double number : {0.0, -0.0, 1.5, std::numeric_limits<double>::infinity(),
+                          std::numeric_limits<double>::quiet_NaN()}) {
+        ASSERT(!NumberToError(number));
+    }
+}
+
+// Случайное выражение по грамматике Formula.g4 со случайными пробелами.
+std::string RandomFormula(std::mt19937& rng, int depth) {
+    auto pick = [&rng](int n) {
+        return static_cast<int>(rng() % n);
+    };
+    auto space = [&] {
+        return pick(4) == 0 ? std::string(" ") : std::string();
+    };
+
+    switch (depth > 0 ? pick(7) : pick(2)) {
+        case 0: {
+            static const std::vector<std::string> numbers = {
+                "0", "1", "42", "3.5", ".25", "1e3", "2E-2", "7.5e+1", "1e400", "1e-400", "00012"};
+            return space() + numbers[pick(numbers.size())] + space();
+        }
+        case 1:
+            return space() + Position{pick(30), pick(800)}.ToString() + space();
+        case 2:
+            return std::string(pick(2) ? "-" : "+") + RandomFormula(rng, depth - 1);
+        case 3:
+            return "(" + RandomFormula(rng, depth - 1) + ")";
+        case 4: {
+            static const std::vector<std::string> functions = {"SUM", "AVERAGE", "MIN", "MAX", "COUNT"};
+            std::string call = functions[pick(functions.size())] + "(";
+            for (int arg = pick(3); arg >= 0; --arg) {
+                if (pick(2)) {
+                    Position first{pick(30), pick(800)};
+                    Position last{std::max(first.row + pick(7) - 3, 0), std::max(first.col + pick(7) - 3, 0)};
+                    call += space() + first.ToString() + ":" + last.ToString() + space();
+                } else {
+                    call += RandomFormula(rng, depth - 1);
+                }
+                call += arg > 0 ? "," : ")";
+            }
+            return call;
+        }
+        default:
+            return RandomFormula(rng, depth - 1) + "+-*/"[pick(4)] + RandomFormula(rng, depth - 1);
+    }
+}
+
+void TestFormulaParserMatchesAntlr() {
+    auto describe = [](auto parse, const std::string& expr) -> std::string {
+        try {
+            FormulaAST ast = parse(expr);
+            std::ostringstream out;
+            ast.Print(out);
+            out << " | ";
+            ast.PrintCells(out);
+            out << "| ";
+            double result = ast.Execute([](Position pos) -> CellInterface::Value {
+                return pos.row * 1.5 + pos.col;
+            });
+            if (auto error = NumberToError(result)) {
+                out << *error;
+            } else {
+                out << result;
+            }
+            return out.str();
+        } catch (const std::exception&) {
+            return "rejected";
+        }
+    };
+    auto check = [&](const std::string& expr) {
+        ASSERT_EQUAL(describe([](const std::string& in) { return ParseFormulaAST(in); }, expr),
+                     describe([](const std::string& in) { return ParseFormulaASTWithAntlr(in); }, expr));
+    };
+
+    for (std::string expr : {"1", " 1 ", "1+2*3", "-1*2", "-(1+2)", "+-+1", "2*-3", "1-2-3", "8/4/2",
+                             "A1", "ZZ99*AB3", "1e", "1.", ".", "1.2.3", "1e+", "1E5", "A", "1A",
+                             "A1B", "a1", "X0", "A123456", "()", "(1", "1)", "", " ", "1 2",
+                             "A1.5", "1..2", "--1", "1+", "*1", "1\t+\n2", "XFD16384", "XFE1",
+                             "SUM(A1:B2)", "SUM( B2 : A1 )", "MAX(A1:B2,-C3,2)", "SUM()", "SUM(1,)",
+                             "SUM(,1)", "SUM(1", "SUM A1", "SUM", "SUM1", "SUMX(1)", "sum(1)", "A1:B2",
+                             "1+A1:B2", "SUM((A1:B2))", "SUM(-A1:B2)", "SUM(A1:B2:C3)", "SUM(A1:1)",
+                             "COUNT(A1:XFE1)", "AVERAGE(MIN(A1:A3),MAX(B1:B3)*2)"}) {
+        check(expr);
+    }
+
+    std::mt19937 rng(2024);
+    for (int i = 0; i < 2000; ++i) {
+        std::string expr = RandomFormula(rng, 5);
+        check(expr);
+
+        // испорченная копия: удалить или вставить случайный символ
+        if (!expr.empty()) {
+            std::string broken = expr;
+            size_t at = rng() % broken.size();
+            if (rng() % 2) {
+                broken.erase(at, 1);
+            } else {
+                broken.insert(at, 1, "+-*/().e5A "[rng() % 11]);
+            }
+            check(broken);
+        }
+    }
+}
+
+// Дерево, список ячеек и программа формулы лежат в её арене: проверяем, что
+// они переживают перемещение формулы и восстановление из снимка.
+void TestFormulaArena() {
+    auto describe = [](const FormulaAST& ast) {
+        std::ostringstream out;
+        ast.PrintFormula(out);
+        out << " | ";
+        ast.PrintCells(out);
+        out << "| " << ast.GetProgram().GetSize();
+        return out.str();
+    };
+
+    std::mt19937 rng(7);
+    std::vector<FormulaAST> asts;
+    std::vector<std::string> expected;
+    for (int i = 0; i < 500; ++i) {
+        std::string expr = RandomFormula(rng, 6);
+        std::optional<FormulaAST> parsed;
+        try {
+            parsed.emplace(ParseFormulaAST(expr));
+        } catch (const std::exception&) {
+            continue;
+        }
+        FormulaAST& ast = *parsed;
+
+        ASSERT(std::is_sorted(ast.GetCells().begin(), ast.GetCells().end()));
+
+        std::string tree;
+        ast.Serialize(tree);
+        FormulaAST restored = DeserializeFormulaAST(tree);
+        ASSERT_EQUAL(describe(restored), describe(ast));
+
+        expected.push_back(describe(ast));
+        asts.push_back(std::move(ast));
+    }
+
+    // длинная формула с повторяющимися ячейками
+    std::string wide = "A1";
+    for (int i = 0; i < 1000; ++i) {
+        wide += (i % 2 ? "+-" : "*") + Position{i % 7, i % 3}.ToString();
+    }
+    FormulaAST ast = ParseFormulaAST(wide);
+    ASSERT_EQUAL(ast.GetCells().size(), 1001u);
+    ASSERT(std::is_sorted(ast.GetCells().begin(), ast.GetCells().end()));
+    expected.push_back(describe(ast));
+    asts.push_back(std::move(ast));
+
+    ast = ParseFormulaAST("B2+1");
+    ASSERT_EQUAL(describe(ast), std::string("B2+1 | B2 | 3"));
+
+    for (size_t i = 0; i < asts.size(); ++i) {
+        ASSERT_EQUAL(describe(asts[i]), expected[i]);
+    }
+}
+
+// Свёртка констант и упрощения меняют только программу: результат совпадает
+// с обходом дерева до знака нуля, а текст формулы остаётся как написан.
+void TestFormulaConstantFolding() {
+    // ячейки - нули обоих знаков, единицы, числа, текст и ошибки
+    auto visitor = [](Position pos) -> CellInterface::Value {
+        switch ((pos.row + pos.col) % 6) {
+            case 0:
+                return 0.0;
+            case 1:
+                return -0.0;
+            case 2:
+                return 1.0;
+            case 3:
+                return pos.row * 1.5 - pos.col;
+            case 4:
+                return std::string("7");
+            default:
+                return FormulaError(FormulaError::Category::Value);
+        }
+    };
+    auto describe = [](auto execute, bool sign) -> std::string {
+        std::ostringstream out;
+        try {
+            double result = execute();
+            if (auto error = NumberToError(result)) {
+                out << *error;
+            } else {
+                out << (sign || result != 0 ? result : 0.0);
+            }
+        } catch (const FormulaError& error) {
+            out << error;
+        }
+        return out.str();
+    };
+    // MIN и MAX из 0 и -0 зависят от порядка, в котором собраны части
+    // диапазона, и без свёртки: знак нуля у них не сравниваем
+    auto check = [&](const FormulaAST& ast, bool sign = true) {
+        ASSERT_EQUAL(describe([&] { return ast.Execute(visitor); }, sign),
+                     describe([&] { return ast.ExecuteTree(visitor); }, sign));
+    };
+
+    struct Case {
+        std::string expr;
+        size_t size;
+    };
+    // B1 = -0, C1 = 1
+    for (const auto& [expr, size] : std::vector<Case>{
+             {"2*3+A1", 3u}, {"+A1", 1u}, {"A1*1", 1u}, {"1*A1", 1u}, {"A1/1", 1u}, {"B1-0", 1u},
+             {"--B1", 1u}, {"--+B1", 1u}, {"-2", 1u}, {"-(2+3)/4", 1u}, {"SUM(1,2)*A1", 3u},
+             {"MAX(1,-C1*1)+MIN(2)", 8u}, {"B1+0", 3u}, {"0+B1", 3u}, {"B1--0", 3u}, {"0-B1", 3u},
+             {"B1*0", 3u}, {"1/0", 3u}, {"A1+1/0", 5u}, {"1e+300*1e+300", 3u}, {"AVERAGE(1,A1:B2)", 4u},
+             {"SUM(A1:B2)*1", 2u}, {"1*(C1+2)*1/1-0", 3u}}) {
+        FormulaAST ast = ParseFormulaAST(expr);
+        ASSERT_EQUAL(ast.GetProgram().GetSize(), size);
+        check(ast);
+
+        std::ostringstream text;
+        ast.PrintFormula(text);
+        ASSERT_EQUAL(text.str(), expr);
+    }
+
+    std::mt19937 rng(25);
+    for (int i = 0; i < 3000; ++i) {
+        std::string expr = RandomFormula(rng, 5);
+        std::optional<FormulaAST> ast;
+        try {
+            ast.emplace(ParseFormulaAST(expr));
+        } catch (const std::exception&) {
+            continue;
+        }
+        check(*ast, expr.find("MIN") == std::string::npos && expr.find("MAX") == std::string::npos);
+    }
+}
+
+void TestAggregateFunctions() {
+    using Value = CellInterface::Value;
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1*4");
+    sheet.SetCell("A3"_pos, "'7");
+    sheet.SetCell("A4"_pos, "text");
+    sheet.SetCell("A5"_pos, "=1/0");
+    sheet.SetCell("A7"_pos, "-2");
+    sheet.SetCell("B1"_pos, "=SUM(A1:A10)");
+    sheet.SetCell("B2"_pos, "=AVERAGE(A1:A10)");
+    sheet.SetCell("B3"_pos, "=MIN(A10:A1)");
+    sheet.SetCell("B4"_pos, "=MAX(A1:A10,10)");
+    sheet.SetCell("B5"_pos, "=COUNT(A1:A10,A6)");
+    sheet.SetCell("B6"_pos, "=AVERAGE(C1:C5)");
+    sheet.SetCell("B7"_pos, "=MAX(C1:C5)+SUM(A1,A1)");
+
+    // "-2" - текст, который не читается как число, ошибка пропускается
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), Value(12.0));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), Value(4.0));
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), Value(1.0));
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), Value(10.0));
+    ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetValue(), Value(4.0));
+    ASSERT_EQUAL(sheet.GetCell("B6"_pos)->GetValue(), Value(FormulaError::Category::Div0));
+    ASSERT_EQUAL(sheet.GetCell("B7"_pos)->GetValue(), Value(2.0));
+
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), std::string("=MIN(A1:A10)"));
+    ASSERT_EQUAL(sheet.GetCell("B7"_pos)->GetText(), std::string("=MAX(C1:C5)+SUM(A1,A1)"));
+    ASSERT_EQUAL(ParseFormula("SUM((1+2)*3,-(A1-B1),A1:B2)")->GetExpression(),
+                 std::string("SUM((1+2)*3,-(A1-B1),A1:B2)"));
+
+    // диапазон - одна запись, а не список ячеек
+    const Cell* b5 = static_cast<const Cell*>(sheet.GetCell("B5"_pos));
+    ASSERT_EQUAL(b5->GetReferencedCells(), std::vector{"A6"_pos});
+    ASSERT((b5->GetReferencedRanges() == std::vector{Range{"A1"_pos, "A10"_pos}}));
+    auto formula = ParseFormula("SUM(B2:C3,A1:A9,C3:B2)+A1");
+    ASSERT(formula->GetReferencedRanges() == (std::vector{Range{"A1"_pos, "A9"_pos}, Range{"B2"_pos, "C3"_pos}}));
+    ASSERT_EQUAL(formula->GetReferencedCells(), std::vector{"A1"_pos});
+
+    // ячейки, покрытые только диапазонами, не расширяют печатную область
+    ASSERT(sheet.GetPrintableSize() == (Size{7, 2}));
+
+    // изменение ячейки диапазона, в том числе ранее пустой, сбрасывает кэш
+    sheet.SetCell("A9"_pos, "=A1+99");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), Value(112.0));
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), Value(100.0));
+    sheet.ClearCell("A2"_pos);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), Value(108.0));
+    ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetValue(), Value(4.0));
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), Value(110.0));
+    ASSERT_EQUAL(sheet.GetCell("B7"_pos)->GetValue(), Value(4.0));
+
+    auto set_cell = [&sheet](Position pos, const std::string& text) -> std::string {
+        try {
+            sheet.SetCell(pos, text);
+        } catch (const CircularDependencyException&) {
+            return "cycle";
+        } catch (const FormulaException&) {
+            return "syntax";
+        }
+        return "ok";
+    };
+
+    // циклы через диапазоны
+    ASSERT_EQUAL(set_cell("A6"_pos, "=SUM(A5:B5)"), std::string("cycle"));
+    ASSERT_EQUAL(set_cell("C1"_pos, "=COUNT(C1:C2)"), std::string("cycle"));
+    ASSERT_EQUAL(sheet.GetCell("A6"_pos)->GetText(), std::string());
+
+    ASSERT_EQUAL(set_cell("C1"_pos, "=SUM(A1:)"), std::string("syntax"));
+    ASSERT_EQUAL(set_cell("C1"_pos, "=A1:A2"), std::string("syntax"));
+    ASSERT_EQUAL(set_cell("C1"_pos, "=SUM()"), std::string("syntax"));
+
+    // формулы, совпадающие со сдвигом, делят одно дерево
+    size_t shapes = sheet.GetFormulaCache().GetSize();
+    for (int row = 0; row < 5; ++row) {
+        sheet.SetCell({row, 4}, "=SUM(" + Position{row, 0}.ToString() + ":" + Position{row + 1, 0}.ToString() + ")");
+    }
+    ASSERT_EQUAL(sheet.GetFormulaCache().GetSize(), shapes + 1);
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), Value(2.0));
+
+    auto path = std::filesystem::temp_directory_path() / "spreadsheet_ranges_test.bin";
+    sheet.SaveSnapshot(path);
+    auto loaded = Sheet::LoadSnapshot(path);
+    std::filesystem::remove(path);
+    std::ostringstream expected;
+    std::ostringstream actual;
+    sheet.PrintValues(expected);
+    loaded->PrintValues(actual);
+    ASSERT_EQUAL(actual.str(), expected.str());
+    loaded->SetCell("A10"_pos, "1000");
+    ASSERT_EQUAL(loaded->GetCell("B1"_pos)->GetValue(), Value(1110.0));
+
+    auto fork = sheet.Fork();
+    fork->SetCell("A8"_pos, "5");
+    ASSERT_EQUAL(fork->GetCell("B1"_pos)->GetValue(), Value(115.0));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), Value(110.0));
+    fork.reset();
+
+    // столбец из многих блоков
+    Sheet column;
+    for (int row = 0; row < 1000; ++row) {
+        column.SetCell({row, 0}, std::to_string(row % 10 == 3 ? 1000 - row : row));
+    }
+    column.SetCell("B1"_pos, "=SUM(A1:A1000)");
+    column.SetCell("B2"_pos, "=MIN(A1:A1000)");
+    column.SetCell("B3"_pos, "=MAX(A1:A1000)");
+    column.SetCell("B4"_pos, "=COUNT(A1:A2000)");
+    double sum = 0;
+    double max = 0;
+    for (int row = 0; row < 1000; ++row) {
+        double value = row % 10 == 3 ? 1000 - row : row;
+        sum += value;
+        max = std::max(max, value);
+    }
+    ASSERT_EQUAL(column.GetCell("B1"_pos)->GetValue(), Value(sum));
+    ASSERT_EQUAL(column.GetCell("B2"_pos)->GetValue(), Value(0.0));
+    ASSERT_EQUAL(column.GetCell("B3"_pos)->GetValue(), Value(max));
+    ASSERT_EQUAL(column.GetCell("B4"_pos)->GetValue(), Value(1000.0));
+}
+
 void TestErrorValue() {
     auto sheet = CreateSheet();
     sheet->SetCell("E2"_pos, "A1");
@@ -330,6 +785,1108 @@ void TestFormulaIncorrect() {
     ASSERT(isIncorrect("2+4-"));
 }
 
+// Сравнивает обнаружение циклов с полным перебором на случайных правках.
+void TestCircularReferencesRandomized() {
+    constexpr int SIZE = 6;
+    std::mt19937 rng(7);
+    auto sheet = CreateSheet();
+
+    auto random_pos = [&] {
+        return Position{static_cast<int>(rng() % SIZE), static_cast<int>(rng() % SIZE)};
+    };
+    // достижима ли target из start по ссылкам формул
+    auto reaches = [&](Position start, Position target) {
+        std::vector<Position> stack{start};
+        std::set<Position> seen;
+        while (!stack.empty()) {
+            Position pos = stack.back();
+            stack.pop_back();
+            if (pos == target) {
+                return true;
+            }
+            const CellInterface* cell = sheet->GetCell(pos);
+            if (!cell || !seen.insert(pos).second) {
+                continue;
+            }
+            for (Position next : cell->GetReferencedCells()) {
+                stack.push_back(next);
+            }
+        }
+        return false;
+    };
+
+    for (int step = 0; step < 3000; ++step) {
+        Position pos = random_pos();
+        std::string text;
+        std::vector<Position> refs;
+        switch (rng() % 4) {
+            case 0:
+                text = std::to_string(rng() % 100);
+                break;
+            case 1:
+                sheet->ClearCell(pos);
+                continue;
+            default:
+                text = "=1";
+                for (int i = 0, count = 1 + rng() % 3; i < count; ++i) {
+                    refs.push_back(random_pos());
+                    text += "+" + refs.back().ToString();
+                }
+        }
+
+        bool expect_cycle = std::any_of(refs.begin(), refs.end(), [&](Position ref) {
+            return reaches(ref, pos);
+        });
+        std::string old_text = sheet->GetCell(pos) ? sheet->GetCell(pos)->GetText() : "";
+
+        bool caught = false;
+        try {
+            sheet->SetCell(pos, text);
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+
+        ASSERT_EQUAL(caught, expect_cycle);
+        ASSERT_EQUAL(sheet->GetCell(pos)->GetText(), caught ? old_text : text);
+    }
+}
+
+// Циклы и значения формул с диапазонами на случайных правках: циклы
+// сравниваются с полным перебором, значения - с таблицей, заново
+// собранной из текстов, без кэша и графа, накопленных правками.
+void TestRangeDependenciesRandomized() {
+    constexpr int SIZE = 6;
+    std::mt19937 rng(13);
+    Sheet sheet;
+
+    auto random_pos = [&] {
+        return Position{static_cast<int>(rng() % SIZE), static_cast<int>(rng() % SIZE)};
+    };
+    auto reaches = [&](Position start, Position target) {
+        std::vector<Position> stack{start};
+        std::set<Position> seen;
+        while (!stack.empty()) {
+            Position pos = stack.back();
+            stack.pop_back();
+            if (pos == target) {
+                return true;
+            }
+            const Cell* cell = static_cast<const Cell*>(sheet.GetCell(pos));
+            if (!cell || !seen.insert(pos).second) {
+                continue;
+            }
+            for (Position next : cell->GetReferencedCells()) {
+                stack.push_back(next);
+            }
+            for (const Range& range : cell->GetReferencedRanges()) {
+                for (int row = range.first.row; row <= range.last.row; ++row) {
+                    for (int col = range.first.col; col <= range.last.col; ++col) {
+                        stack.push_back(Position{row, col});
+                    }
+                }
+            }
+        }
+        return false;
+    };
+
+    for (int step = 0; step < 3000; ++step) {
+        Position pos = random_pos();
+        std::string text;
+        std::vector<Position> refs;
+        switch (rng() % 5) {
+            case 0:
+                text = std::to_string(rng() % 100);
+                break;
+            case 1:
+                sheet.ClearCell(pos);
+                continue;
+            case 2:
+                text = "=1+" + random_pos().ToString();
+                refs.push_back(Position::FromString(text.substr(3)));
+                break;
+            default: {
+                Range range = Range::FromCorners(random_pos(), random_pos());
+                text = "=SUM(" + range.ToString() + ")";
+                for (int row = range.first.row; row <= range.last.row; ++row) {
+                    for (int col = range.first.col; col <= range.last.col; ++col) {
+                        refs.push_back(Position{row, col});
+                    }
+                }
+            }
+        }
+
+        bool expect_cycle = std::any_of(refs.begin(), refs.end(), [&](Position ref) {
+            return reaches(ref, pos);
+        });
+        bool caught = false;
+        try {
+            sheet.SetCell(pos, text);
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT_EQUAL(caught, expect_cycle);
+
+        if (step % 10 == 0) {
+            std::ostringstream texts;
+            sheet.PrintTexts(texts);
+            std::istringstream input(texts.str());
+            Sheet fresh;
+            fresh.LoadTexts(input, 1);
+            for (int row = 0; row < SIZE; ++row) {
+                for (int col = 0; col < SIZE; ++col) {
+                    const CellInterface* cell = sheet.GetCell(Position{row, col});
+                    if (cell && !cell->GetText().empty() && cell->GetText()[0] == FORMULA_SIGN) {
+                        ASSERT_EQUAL(cell->GetValue(), fresh.GetCell(Position{row, col})->GetValue());
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Ячейки диапазона не создаются, а цепочка формул через диапазоны
+// вычисляется без рекурсии.
+void TestRangeDependencyIndex() {
+    using Value = CellInterface::Value;
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=SUM(B1:ZZ16000)");
+    ASSERT(sheet.GetCell("C100"_pos) == nullptr);
+    ASSERT(sheet.GetPrintableSize() == (Size{1, 1}));
+    sheet.SetCell("X5000"_pos, "7");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), Value(7.0));
+    sheet.ClearCell("X5000"_pos);
+    ASSERT(sheet.GetCell("X5000"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), Value(0.0));
+
+    constexpr int LENGTH = 16'000;
+    Sheet chain;
+    chain.SetCell(Position{0, 1}, "1");
+    for (int row = 1; row < LENGTH; ++row) {
+        chain.SetCell(Position{row, 1}, "=SUM(" + Position{row - 1, 0}.ToString() + ":" + Position{row - 1, 1}.ToString() + ")");
+    }
+    const CellInterface* last = chain.GetCell(Position{LENGTH - 1, 1});
+    ASSERT_EQUAL(last->GetValue(), Value(1.0));
+    chain.SetCell(Position{LENGTH / 2, 0}, "2");
+    ASSERT_EQUAL(last->GetValue(), Value(3.0));
+
+    // формула выше по листу, которая получает ссылки, встаёт в порядке
+    // перед формулами, диапазоны которых её покрывают
+    chain.SetCell(Position{0, 0}, "=" + Position{LENGTH - 1, 0}.ToString() + "+1");
+    ASSERT_EQUAL(last->GetValue(), Value(4.0));
+    bool caught = false;
+    try {
+        chain.SetCell(Position{0, 0}, "=" + Position{LENGTH - 1, 1}.ToString());
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    chain.RecalculateAll(2);
+    ASSERT_EQUAL(last->GetValue(), Value(4.0));
+}
+
+// Обход диапазона через ColumnStore сравнивается с перебором ячеек после
+// случайных правок, пакетов, ответвления и загрузки снимка. Строк больше,
+// чем в одном блоке хранилища.
+void TestColumnStore() {
+    constexpr int ROWS = 150;
+    constexpr int COLS = 4;
+    std::mt19937 rng(17);
+    auto random_pos = [&] {
+        return Position{static_cast<int>(rng() % ROWS), static_cast<int>(rng() % COLS)};
+    };
+    auto random_text = [&]() -> std::string {
+        switch (rng() % 6) {
+            case 0:
+                return "text";
+            case 1:
+                return "'" + std::to_string(rng() % 100);
+            case 2:
+                return "=" + random_pos().ToString() + "+1";
+            case 3:
+                return "=1/0";
+            default:
+                return std::to_string(rng() % 100);
+        }
+    };
+    auto edit = [&](Sheet& sheet) {
+        Position pos = random_pos();
+        try {
+            if (rng() % 4 == 0) {
+                sheet.ClearCell(pos);
+            } else {
+                sheet.SetCell(pos, random_text());
+            }
+        } catch (const CircularDependencyException&) {
+        }
+    };
+    auto check = [&](const Sheet& sheet) {
+        for (int i = 0; i < 20; ++i) {
+            Range range = Range::FromCorners(random_pos(), random_pos());
+            ASTImpl::Aggregate sum(ASTImpl::Function::Sum);
+            ASTImpl::Aggregate count(ASTImpl::Function::Count);
+            sheet.AggregateRange(range, sum);
+            sheet.AggregateRange(range, count);
+
+            double expected_sum = 0;
+            double expected_count = 0;
+            for (int row = range.first.row; row <= range.last.row; ++row) {
+                for (int col = range.first.col; col <= range.last.col; ++col) {
+                    const Cell* cell = static_cast<const Cell*>(sheet.GetCell(Position{row, col}));
+                    double number = cell ? cell->GetRangeNumber() : std::nan("");
+                    if (!std::isnan(number)) {
+                        expected_sum += number;
+                        ++expected_count;
+                    }
+                }
+            }
+            ASSERT_EQUAL(sum.GetResult(), expected_sum);
+            ASSERT_EQUAL(count.GetResult(), expected_count);
+        }
+    };
+
+    Sheet sheet;
+    for (int step = 0; step < 2000; ++step) {
+        edit(sheet);
+        if (step % 100 == 0) {
+            check(sheet);
+        }
+    }
+    check(sheet);
+
+    {
+        SheetBatch batch(sheet);
+        for (int i = 0; i < 100; ++i) {
+            edit(sheet);
+        }
+        batch.Commit();
+    }
+    check(sheet);
+
+    auto path = std::filesystem::temp_directory_path() / "spreadsheet_columns_test.bin";
+    sheet.SaveSnapshot(path);
+    auto loaded = Sheet::LoadSnapshot(path);
+    std::filesystem::remove(path);
+    check(*loaded);
+
+    auto fork = sheet.Fork();
+    for (int step = 0; step < 500; ++step) {
+        edit(*fork);
+        if (step % 50 == 0) {
+            check(*fork);
+        }
+    }
+    check(sheet);
+    fork.reset();
+}
+
+void TestSharedFormulas() {
+    Sheet sheet;
+    for (int row = 0; row < 100; ++row) {
+        std::string n = std::to_string(row + 1);
+        sheet.SetCell(Position{row, 0}, n);
+        sheet.SetCell(Position{row, 1}, "2");
+        sheet.SetCell(Position{row, 2}, "=A" + n + " * B" + n);
+        sheet.SetCell(Position{row, 3}, "=(C" + n + "+1)");
+    }
+    ASSERT_EQUAL(sheet.GetFormulaCache().GetSize(), 2u);
+
+    const CellInterface* c7 = sheet.GetCell("C7"_pos);
+    ASSERT_EQUAL(c7->GetText(), "=A7*B7");
+    ASSERT_EQUAL(c7->GetReferencedCells(), (std::vector{"A7"_pos, "B7"_pos}));
+    ASSERT_EQUAL(c7->GetValue(), CellInterface::Value(14.0));
+    ASSERT_EQUAL(sheet.GetCell("D100"_pos)->GetText(), "=C100+1");
+    ASSERT_EQUAL(sheet.GetCell("D100"_pos)->GetValue(), CellInterface::Value(201.0));
+
+    // та же форма, записанная иначе, и другая форма
+    sheet.SetCell("C7"_pos, "=A7*B7");
+    sheet.SetCell("D7"_pos, "=C6+1");
+    ASSERT_EQUAL(sheet.GetCell("D7"_pos)->GetReferencedCells(), std::vector{"C6"_pos});
+    ASSERT_EQUAL(sheet.GetFormulaCache().GetSize(), 3u);
+}
+
+void TestTextEditInvalidatesFormulas() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+1");
+    sheet.SetCell("C1"_pos, "=B1*2");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(6.0));
+    sheet.ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+}
+
+// Цепочка из миллиона формул, каждая ссылается на предыдущую. Ячейки идут
+// змейкой по столбцам, так как столбец короче цепочки.
+void TestLongDependencyChain() {
+    constexpr int LENGTH = 1'000'000;
+    auto chain_pos = [](int i) {
+        return Position{i % Position::MAX_ROWS, i / Position::MAX_ROWS};
+    };
+
+    Sheet sheet;
+    sheet.SetCell(chain_pos(0), "1");
+    for (int i = 1; i < LENGTH; ++i) {
+        sheet.SetCell(chain_pos(i), "=" + chain_pos(i - 1).ToString() + "+1");
+    }
+
+    const CellInterface* last = sheet.GetCell(chain_pos(LENGTH - 1));
+    ASSERT_EQUAL(last->GetValue(), CellInterface::Value(static_cast<double>(LENGTH)));
+
+    // правка в начале цепочки сбрасывает кэш всех формул
+    sheet.SetCell(chain_pos(0), "10");
+    ASSERT_EQUAL(last->GetValue(), CellInterface::Value(static_cast<double>(LENGTH + 9)));
+    ASSERT_EQUAL(sheet.GetCell(chain_pos(LENGTH / 2))->GetValue(),
+                 CellInterface::Value(static_cast<double>(LENGTH / 2 + 10)));
+}
+
+void TestBatchEdits() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*10");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+
+    sheet.BeginBatch();
+    for (int row = 0; row < 100; ++row) {
+        std::string n = std::to_string(row + 1);
+        sheet.SetCell(Position{row, 2}, "=B" + n + "+A1");
+    }
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("A1"_pos, "3");
+    sheet.ClearCell("B2"_pos);
+    // до Commit правки не видны
+    ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+    sheet.Commit();
+
+    ASSERT(!sheet.InBatch());
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "3");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(30.0));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(33.0));
+    ASSERT_EQUAL(sheet.GetCell("C100"_pos)->GetValue(), CellInterface::Value(3.0));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{100, 3}));
+
+    // по отдельности первая правка замкнула бы цикл A1 -> B1 -> A1
+    sheet.BeginBatch();
+    sheet.SetCell("A1"_pos, "=B1");
+    sheet.SetCell("B1"_pos, "7");
+    sheet.Commit();
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(14.0));
+}
+
+void TestBatchRollback() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+1");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    auto check_unchanged = [&sheet] {
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1+1");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT(sheet.GetCell("D4"_pos) == nullptr);
+        ASSERT(sheet.GetCell("E5"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 2}));
+    };
+
+    bool caught = false;
+    try {
+        SheetBatch batch(sheet);
+        sheet.SetCell("D4"_pos, "=E5");
+        sheet.SetCell("A1"_pos, "=B1+D4");
+        batch.Commit();
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    check_unchanged();
+
+    caught = false;
+    try {
+        SheetBatch batch(sheet);
+        sheet.SetCell("A1"_pos, "5");
+        sheet.SetCell("D4"_pos, "=E5+");
+        batch.Commit();
+    } catch (const FormulaException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    check_unchanged();
+
+    {
+        SheetBatch batch(sheet);
+        sheet.SetCell("A1"_pos, "5");
+    }
+    ASSERT(!sheet.InBatch());
+    check_unchanged();
+
+    // после отката граф цел: прежний цикл всё ещё отлавливается
+    caught = false;
+    try {
+        sheet.SetCell("A1"_pos, "=B1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+}
+
+// Несколько уровней формул: каждая строка ссылается на две ячейки
+// предыдущей строки. Параллельный пересчёт сравнивается с ленивым.
+void TestRecalculateAll() {
+    constexpr int ROWS = 20;
+    constexpr int COLS = 1000;
+    auto fill = [](Sheet& sheet, int seed) {
+        for (int col = 0; col < COLS; ++col) {
+            sheet.SetCell(Position{0, col}, std::to_string((col * 7 + seed) % 13));
+        }
+        for (int row = 1; row < ROWS; ++row) {
+            for (int col = 0; col < COLS; ++col) {
+                Position left{row - 1, col};
+                Position right{row - 1, (col + 1) % COLS};
+                sheet.SetCell(Position{row, col},
+                              "=(" + left.ToString() + "+" + right.ToString() + ")/2-" + std::to_string(col % 3));
+            }
+        }
+    };
+
+    Sheet lazy;
+    Sheet parallel;
+    fill(lazy, 1);
+    fill(parallel, 1);
+    parallel.RecalculateAll(4);
+    for (int row = 0; row < ROWS; ++row) {
+        for (int col = 0; col < COLS; ++col) {
+            Position pos{row, col};
+            ASSERT_EQUAL(parallel.GetCell(pos)->GetValue(), lazy.GetCell(pos)->GetValue());
+        }
+    }
+
+    // после правки пересчитываются только зависимые формулы
+    lazy.SetCell("A1"_pos, "100");
+    parallel.SetCell("A1"_pos, "100");
+    parallel.SetCell("B2"_pos, "=1/0");
+    lazy.SetCell("B2"_pos, "=1/0");
+    parallel.RecalculateAll(3);
+    for (int row = 0; row < ROWS; ++row) {
+        for (int col = 0; col < COLS; ++col) {
+            Position pos{row, col};
+            ASSERT_EQUAL(parallel.GetCell(pos)->GetValue(), lazy.GetCell(pos)->GetValue());
+        }
+    }
+}
+
+// Несколько потоков читают лист с невычисленными формулами: цепочкой,
+// ошибками и общими ссылками. Значения совпадают с вычисленными в одном потоке.
+void TestConcurrentReaders() {
+    constexpr int ROWS = 2000;
+    auto fill = [](Sheet& sheet) {
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1*3");
+        sheet.SetCell("C1"_pos, "=B1-C2");
+        for (int row = 1; row < ROWS; ++row) {
+            std::string prev = std::to_string(row);
+            sheet.SetCell(Position{row, 0}, "=A" + prev + "+1");
+            sheet.SetCell(Position{row, 1}, "=A" + prev + "/(A" + prev + "-" + std::to_string(row % 50) + ")");
+            sheet.SetCell(Position{row, 2}, "=B" + std::to_string(row + 1) + "*A1+D1");
+        }
+        sheet.SetCell("D1"_pos, "text");
+    };
+
+    Sheet expected;
+    fill(expected);
+    Sheet shared;
+    fill(shared);
+
+    std::vector<std::thread> readers;
+    std::vector<std::vector<CellInterface::Value>> seen(4);
+    for (size_t i = 0; i < seen.size(); ++i) {
+        readers.emplace_back([&shared, &values = seen[i], i] {
+            // потоки обходят лист с разных концов
+            for (int k = 0; k < ROWS * 3; ++k) {
+                int index = i % 2 == 0 ? k : ROWS * 3 - 1 - k;
+                values.push_back(shared.GetCell(Position{index % ROWS, index / ROWS})->GetValue());
+            }
+        });
+    }
+    for (auto& reader : readers) {
+        reader.join();
+    }
+
+    for (size_t i = 0; i < seen.size(); ++i) {
+        for (int k = 0; k < ROWS * 3; ++k) {
+            int index = i % 2 == 0 ? k : ROWS * 3 - 1 - k;
+            ASSERT_EQUAL(seen[i][k], expected.GetCell(Position{index % ROWS, index / ROWS})->GetValue());
+        }
+    }
+}
+
+void TestFork() {
+    Sheet base;
+    base.SetCell("A1"_pos, "1");
+    base.SetCell("A2"_pos, "2");
+    base.SetCell("B1"_pos, "=A1+A2");
+    base.SetCell("C1"_pos, "=B1*2");
+    base.SetCell("D1"_pos, "=C1+A2");
+    base.SetCell("E1"_pos, "note");
+    ASSERT_EQUAL(base.GetCell("D1"_pos)->GetValue(), CellInterface::Value(8.0));
+
+    auto fork = base.Fork();
+    ASSERT_EQUAL(fork->GetCell("D1"_pos)->GetValue(), CellInterface::Value(8.0));
+    fork->SetCell("A1"_pos, "10");
+    fork->ClearCell("E1"_pos);
+    ASSERT_EQUAL(fork->GetCell("C1"_pos)->GetValue(), CellInterface::Value(24.0));
+    ASSERT_EQUAL(fork->GetCell("D1"_pos)->GetValue(), CellInterface::Value(26.0));
+    ASSERT(fork->GetCell("E1"_pos) == nullptr);
+    ASSERT_EQUAL(base.GetCell("C1"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT_EQUAL(base.GetCell("E1"_pos)->GetText(), "note");
+
+    // пока живы ответвления, основа не меняется
+    bool caught = false;
+    try {
+        base.SetCell("A1"_pos, "5");
+    } catch (const std::logic_error&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    // цикл через формулы основы
+    caught = false;
+    try {
+        fork->SetCell("A2"_pos, "=D1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(fork->GetCell("A2"_pos)->GetText(), "2");
+
+    auto other = base.Fork();
+    other->SetCell("A2"_pos, "=A1*5");
+    ASSERT_EQUAL(other->GetCell("D1"_pos)->GetValue(), CellInterface::Value(17.0));
+
+    auto nested = fork->Fork();
+    nested->SetCell("A2"_pos, "0");
+    ASSERT_EQUAL(nested->GetCell("D1"_pos)->GetValue(), CellInterface::Value(20.0));
+    ASSERT_EQUAL(fork->GetCell("D1"_pos)->GetValue(), CellInterface::Value(26.0));
+
+    std::ostringstream texts;
+    nested->PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "10\t=A1+A2\t=B1*2\t=C1+A2\n0\t\t\t\n");
+
+    nested.reset();
+    other.reset();
+    fork.reset();
+    base.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(base.GetCell("D1"_pos)->GetValue(), CellInterface::Value(16.0));
+}
+
+// Ответвление после случайных правок совпадает с таблицей, в которой
+// те же правки повторены поверх правок основы.
+void TestForkRandomized() {
+    constexpr int SIZE = 6;
+    std::mt19937 rng(11);
+    auto random_pos = [&] {
+        return Position{static_cast<int>(rng() % SIZE), static_cast<int>(rng() % SIZE)};
+    };
+    // правка: позиция и текст, nullopt - очистка
+    using Edit = std::pair<Position, std::optional<std::string>>;
+    auto random_edit = [&]() -> Edit {
+        Position pos = random_pos();
+        switch (rng() % 4) {
+            case 0:
+                return {pos, std::to_string(rng() % 100)};
+            case 1:
+                return {pos, std::nullopt};
+            default:
+                std::string text = "=1";
+                for (int i = 0, count = 1 + rng() % 3; i < count; ++i) {
+                    text += "+" + random_pos().ToString();
+                }
+                return {pos, text};
+        }
+    };
+    auto apply = [](Sheet& sheet, const Edit& edit) {
+        try {
+            if (edit.second) {
+                sheet.SetCell(edit.first, *edit.second);
+            } else {
+                sheet.ClearCell(edit.first);
+            }
+        } catch (const CircularDependencyException&) {
+        }
+    };
+    auto check_same = [](const Sheet& expected, const Sheet& actual) {
+        ASSERT_EQUAL(actual.GetPrintableSize(), expected.GetPrintableSize());
+        for (int row = 0; row < SIZE; ++row) {
+            for (int col = 0; col < SIZE; ++col) {
+                Position pos{row, col};
+                const CellInterface* lhs = expected.GetCell(pos);
+                const CellInterface* rhs = actual.GetCell(pos);
+                ASSERT_EQUAL(lhs == nullptr, rhs == nullptr);
+                if (lhs) {
+                    ASSERT_EQUAL(rhs->GetText(), lhs->GetText());
+                    ASSERT_EQUAL(rhs->GetValue(), lhs->GetValue());
+                }
+            }
+        }
+    };
+
+    for (int round = 0; round < 50; ++round) {
+        std::vector<Edit> base_edits(30);
+        std::generate(base_edits.begin(), base_edits.end(), random_edit);
+        Sheet base;
+        for (const auto& edit : base_edits) {
+            apply(base, edit);
+        }
+        // часть кэша основы заполнена до ответвления
+        for (int i = 0; i < 5; ++i) {
+            if (const CellInterface* cell = base.GetCell(random_pos())) {
+                cell->GetValue();
+            }
+        }
+
+        auto fork = base.Fork();
+        Sheet expected;
+        for (const auto& edit : base_edits) {
+            apply(expected, edit);
+        }
+        for (int step = 0; step < 20; ++step) {
+            Edit edit = random_edit();
+            apply(*fork, edit);
+            apply(expected, edit);
+            check_same(expected, *fork);
+        }
+    }
+}
+
+// Печать редкого листа сравнивается с обходом всех позиций области.
+// Очищенная ячейка, на которую ссылаются формулы, не печатается.
+void TestPrintSparse() {
+    std::mt19937 rng(5);
+    Sheet sheet;
+    std::set<Position> cleared;
+    for (int i = 0; i < 300; ++i) {
+        Position pos{static_cast<int>(rng() % 200), static_cast<int>(rng() % 50)};
+        switch (rng() % 3) {
+            case 0:
+                sheet.SetCell(pos, std::to_string(rng() % 1000));
+                cleared.erase(pos);
+                break;
+            case 1:
+                sheet.SetCell(pos, "=" + Position{static_cast<int>(rng() % 200), 0}.ToString() + "/3");
+                cleared.erase(pos);
+                break;
+            default:
+                sheet.ClearCell(pos);
+                cleared.insert(pos);
+        }
+    }
+
+    auto reference = [&sheet, &cleared](auto print_cell) {
+        std::ostringstream out;
+        Size size = sheet.GetPrintableSize();
+        for (int row = 0; row < size.rows; ++row) {
+            for (int col = 0; col < size.cols; ++col) {
+                if (col > 0) {
+                    out << '\t';
+                }
+                const CellInterface* cell = sheet.GetCell(Position{row, col});
+                if (cell && cleared.count(Position{row, col}) == 0) {
+                    print_cell(out, *cell);
+                }
+            }
+            out << '\n';
+        }
+        return out.str();
+    };
+
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), reference([](std::ostream& out, const CellInterface& cell) {
+        out << cell.GetText();
+    }));
+
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    ASSERT_EQUAL(values.str(), reference([](std::ostream& out, const CellInterface& cell) {
+        std::visit([&out](const auto& value) {
+            out << value;
+        }, cell.GetValue());
+    }));
+}
+
+void TestExportValues() {
+    auto format_exact = [](double value) {
+        char buffer[MAX_NUMBER_CHARS];
+        return std::string(buffer, FormatNumberExact(value, buffer, buffer + sizeof(buffer)));
+    };
+    ASSERT_EQUAL(format_exact(0.5), "0.5");
+    ASSERT_EQUAL(format_exact(-2), "-2");
+    ASSERT_EQUAL(format_exact(1e+20), "1e+20");
+    ASSERT_EQUAL(format_exact(0.0001), "0.0001");
+    ASSERT_EQUAL(format_exact(1234567), "1234567");
+    ASSERT_EQUAL(format_exact(1.0 / 3), "0.3333333333333333");
+
+    std::mt19937_64 rng(12);
+    for (int i = 0; i < 100000; ++i) {
+        double value = 0;
+        do {
+            std::uint64_t bits = rng();
+            std::memcpy(&value, &bits, sizeof(value));
+        } while (!std::isfinite(value));
+        std::string text = format_exact(value);
+        double parsed = 0;
+        std::from_chars(text.data(), text.data() + text.size(), parsed);
+        ASSERT_EQUAL(parsed, value);
+    }
+
+    // числа, которые PrintValues печатает точно, выгружаются так же
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=1/4");
+    sheet.SetCell("B1"_pos, "text");
+    sheet.SetCell("C1"_pos, "=1/0");
+    sheet.SetCell("B2"_pos, "123456");
+    sheet.SetCell("D3"_pos, "=-100000*100000");
+    std::ostringstream printed;
+    sheet.PrintValues(printed);
+    std::ostringstream exported;
+    sheet.ExportValues(exported);
+    ASSERT_EQUAL(exported.str(), printed.str());
+
+    sheet.SetCell("A1"_pos, "=1/3");
+    sheet.SetCell("B2"_pos, "=1234567");
+    exported.str("");
+    sheet.ExportValues(exported);
+    ASSERT_EQUAL(exported.str(), "0.3333333333333333\ttext\t#DIV/0!\t\n\t1234567\t\t\n\t\t\t-1e+10\n");
+
+    // PrintValues соблюдает настройки формата потока
+    printed.str("");
+    sheet.PrintValues(printed);
+    ASSERT_EQUAL(printed.str(), "0.333333\ttext\t#DIV/0!\t\n\t1.23457e+06\t\t\n\t\t\t-1e+10\n");
+    printed.str("");
+    printed << std::setprecision(3);
+    sheet.PrintValues(printed);
+    ASSERT_EQUAL(printed.str(), "0.333\ttext\t#DIV/0!\t\n\t1.23e+06\t\t\n\t\t\t-1e+10\n");
+    printed.str("");
+    printed << std::fixed;
+    sheet.PrintValues(printed);
+    ASSERT_EQUAL(printed.str(),
+                 "0.333\ttext\t#DIV/0!\t\n\t1234567.000\t\t\n\t\t\t-10000000000.000\n");
+}
+
+void TestLoadTexts() {
+    std::mt19937 rng(13);
+    Sheet sheet;
+    for (int i = 0; i < 3000; ++i) {
+        Position pos{static_cast<int>(rng() % 100), static_cast<int>(rng() % 40)};
+        Position ref{static_cast<int>(rng() % 100), static_cast<int>(rng() % 40)};
+        std::string text;
+        switch (rng() % 4) {
+            case 0:
+                text = std::to_string(rng() % 1000);
+                break;
+            case 1:
+                text = "'=text " + std::to_string(i);
+                break;
+            default:
+                // ссылки только на строки выше, чтобы не было циклов
+                ref.row = static_cast<int>(rng() % (pos.row + 1));
+                text = "=" + ref.ToString() + (ref.row < pos.row ? "*2+1" : "+0") + (rng() % 2 ? "" : "/A1");
+                if (ref.row == pos.row) {
+                    text = "=" + std::to_string(i % 7) + "/3";
+                }
+        }
+        sheet.SetCell(pos, text);
+    }
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+
+    // та же таблица, заполненная по одной ячейке
+    Sheet replayed;
+    {
+        std::istringstream input(texts.str());
+        std::string line;
+        for (int row = 0; std::getline(input, line); ++row) {
+            std::istringstream fields(line);
+            std::string field;
+            for (int col = 0; std::getline(fields, field, '\t'); ++col) {
+                if (!field.empty()) {
+                    replayed.SetCell(Position{row, col}, field);
+                }
+            }
+        }
+    }
+    std::ostringstream values;
+    replayed.PrintValues(values);
+
+    for (size_t threads : {1, 4}) {
+        Sheet loaded;
+        std::istringstream input(texts.str());
+        loaded.LoadTexts(input, threads);
+        std::ostringstream loaded_texts;
+        loaded.PrintTexts(loaded_texts);
+        ASSERT_EQUAL(loaded_texts.str(), texts.str());
+        std::ostringstream loaded_values;
+        loaded.PrintValues(loaded_values);
+        ASSERT_EQUAL(loaded_values.str(), values.str());
+    }
+
+    auto path = std::filesystem::temp_directory_path() / "spreadsheet_load_texts_test.tsv";
+    {
+        std::ofstream file(path, std::ios::binary);
+        file << "1\t\t=A1+1\n\n\tabc\t=C1*2";
+    }
+    Sheet loaded;
+    loaded.SetCell("B1"_pos, "kept");
+    loaded.LoadTexts(path);
+    std::filesystem::remove(path);
+    ASSERT_EQUAL(loaded.GetPrintableSize(), (Size{3, 3}));
+    ASSERT_EQUAL(loaded.GetCell("B1"_pos)->GetText(), "kept");
+    ASSERT_EQUAL(loaded.GetCell("B3"_pos)->GetText(), "abc");
+    ASSERT_EQUAL(loaded.GetCell("C3"_pos)->GetValue(), CellInterface::Value(4.0));
+
+    // при ошибке таблица не меняется
+    auto expect_unchanged = [&loaded](const std::string& text) {
+        std::ostringstream before;
+        loaded.PrintTexts(before);
+        std::istringstream input(text);
+        try {
+            loaded.LoadTexts(input, 4);
+            ASSERT(false);
+        } catch (const InvalidPositionException&) {
+        } catch (const FormulaException&) {
+        } catch (const CircularDependencyException&) {
+        }
+        std::ostringstream after;
+        loaded.PrintTexts(after);
+        ASSERT_EQUAL(after.str(), before.str());
+    };
+    expect_unchanged("=B2\tx\n\t=A1");
+    expect_unchanged("1\t=1+\t2");
+    expect_unchanged("1" + std::string(Position::MAX_COLS, '\t') + "2");
+}
+
+void TestSnapshot() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("A2"_pos, "'=escaped");
+    sheet.SetCell("B1"_pos, "=A1+C1");
+    for (int row = 0; row < 50; ++row) {
+        if (row > 0) {
+            sheet.SetCell({row, 1}, "=" + Position{row - 1, 1}.ToString() + "+" + Position{row, 2}.ToString());
+        }
+        sheet.SetCell({row, 2}, std::to_string(row));
+    }
+    sheet.SetCell("D1"_pos, "=+(A1)/(B2-B2)");
+    sheet.SetCell("D2"_pos, "=E1+A2");
+    sheet.SetCell("D3"_pos, "=E7");
+    sheet.SetCell("E7"_pos, "x");
+    sheet.ClearCell("E7"_pos);
+    sheet.SetCell("D5"_pos, "=D4+1");
+    for (int row = 0; row < 40; ++row) {
+        sheet.GetCell({row, 1})->GetValue();
+    }
+    sheet.GetCell("D1"_pos)->GetValue();
+
+    auto path = std::filesystem::temp_directory_path() / "spreadsheet_snapshot_test.bin";
+    sheet.SaveSnapshot(path);
+    auto loaded = Sheet::LoadSnapshot(path);
+
+    auto print = [](const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintTexts(out);
+        out << "--\n";
+        sheet.PrintValues(out);
+        return out.str();
+    };
+    ASSERT_EQUAL(loaded->GetPrintableSize(), sheet.GetPrintableSize());
+    ASSERT_EQUAL(print(*loaded), print(sheet));
+    ASSERT_EQUAL(loaded->GetCell("D1"_pos)->GetText(), "=+A1/(B2-B2)");
+    ASSERT_EQUAL(loaded->GetFormulaCache().GetSize(), 6u);
+
+    // рёбра восстановлены: правка сбрасывает кэш зависимых, циклы ловятся
+    loaded->SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(loaded->GetCell("B11"_pos)->GetValue(), CellInterface::Value(3.0 + 55));
+    try {
+        loaded->SetCell("A1"_pos, "=B2");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    sheet.SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(print(*loaded), print(sheet));
+
+    // формулы из снимка разделяют формы с новыми
+    size_t shapes = loaded->GetFormulaCache().GetSize();
+    loaded->SetCell("B60"_pos, "=B59+C60");
+    ASSERT_EQUAL(loaded->GetFormulaCache().GetSize(), shapes);
+
+    auto write = [&path](const std::string& data) {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file << data;
+    };
+    auto expect_rejected = [&](const std::string& data) {
+        write(data);
+        bool rejected = false;
+        try {
+            Sheet::LoadSnapshot(path);
+        } catch (const std::runtime_error&) {
+            rejected = true;
+        }
+        ASSERT(rejected);
+    };
+    std::string data;
+    {
+        std::ifstream file(path, std::ios::binary);
+        data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    expect_rejected("");
+    expect_rejected(data.substr(0, data.size() - 1));
+    expect_rejected(data + "x");
+    std::string other_version = data;
+    ++other_version[8];
+    expect_rejected(other_version);
+
+    // ключ формы, который не соответствует её дереву (=A1+C1 записан как
+    // =A1*C1), не отдаёт это дерево формулам, введённым после загрузки
+    const std::string key = "R[0]C[-1] + R[0]C[1]";
+    size_t key_at = data.find(key);
+    ASSERT(key_at != std::string::npos);
+    std::string wrong_key = data;
+    wrong_key[key_at + key.find('+')] = '*';
+    write(wrong_key);
+    auto forged = Sheet::LoadSnapshot(path);
+    ASSERT_EQUAL(forged->GetCell("B1"_pos)->GetText(), "=A1+C1");
+    forged->SetCell("E20"_pos, "2");
+    forged->SetCell("G20"_pos, "5");
+    forged->SetCell("F20"_pos, "=E20*G20");
+    ASSERT_EQUAL(forged->GetCell("F20"_pos)->GetValue(), CellInterface::Value(10.0));
+    // неверный ключ не попадает в следующий снимок рядом с верным
+    forged->SaveSnapshot(path);
+    auto reloaded = Sheet::LoadSnapshot(path);
+    ASSERT_EQUAL(print(*reloaded), print(*forged));
+
+    // повтор формы: запись =B1+C2 на месте записи =A1+C1, ключи одной длины
+    size_t other_at = data.find("R[-1]C[0] + R[0]C[1]");
+    ASSERT(other_at != std::string::npos);
+    // длина ключа, ключ, длина дерева, дерево
+    auto record = [&](size_t key_at) {
+        std::uint32_t tree_size = 0;
+        std::memcpy(&tree_size, data.data() + key_at + key.size(), sizeof(tree_size));
+        return data.substr(key_at - sizeof(std::uint32_t),
+                           sizeof(std::uint32_t) + key.size() + sizeof(tree_size) + tree_size);
+    };
+    std::string first = record(key_at);
+    std::string other = record(other_at);
+    ASSERT_EQUAL(first.size(), other.size());
+    std::string repeated = data;
+    repeated.replace(key_at - sizeof(std::uint32_t), first.size(), other);
+    expect_rejected(repeated);
+    std::filesystem::remove(path);
+}
+
+void TestValueView() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "text");
+    sheet.SetCell("A2"_pos, "'=escaped");
+    sheet.SetCell("A3"_pos, "=1/0");
+    sheet.SetCell("A4"_pos, "=A1");
+    sheet.SetCell("A5"_pos, "=2*3");
+    sheet.SetCell("A6"_pos, "");
+
+    using ValueView = Cell::ValueView;
+    ASSERT(sheet.GetValueView("A1"_pos) == ValueView(std::string_view("text")));
+    ASSERT(sheet.GetValueView("A2"_pos) == ValueView(std::string_view("=escaped")));
+    ASSERT(sheet.GetValueView("A3"_pos) == ValueView(FormulaError(FormulaError::Category::Div0)));
+    ASSERT(sheet.GetValueView("A4"_pos) == ValueView(FormulaError(FormulaError::Category::Value)));
+    ASSERT(sheet.GetValueView("A5"_pos) == ValueView(6.0));
+    ASSERT(sheet.GetValueView("B1"_pos) == ValueView(0.0));
+
+    // строка смотрит в текст ячейки, а не в копию
+    auto first = std::get<std::string_view>(sheet.GetValueView("A2"_pos));
+    auto second = std::get<std::string_view>(sheet.GetValueView("A2"_pos));
+    ASSERT(first.data() == second.data());
+
+    for (int row = 0; row < 6; ++row) {
+        Position pos{row, 0};
+        std::visit([&sheet, pos](const auto& value) {
+            CellInterface::Value expected = sheet.GetValue(pos);
+            using T = std::decay_t<decltype(value)>;
+            if constexpr (std::is_same_v<T, std::string_view>) {
+                ASSERT_EQUAL(std::get<std::string>(expected), std::string(value));
+            } else {
+                ASSERT(std::get<T>(expected) == value);
+            }
+        }, sheet.GetValueView(pos));
+    }
+
+    auto fork = sheet.Fork();
+    ASSERT(fork->GetValueView("A1"_pos) == ValueView(std::string_view("text")));
+    fork->SetCell("A5"_pos, "=3*3");
+    ASSERT(fork->GetValueView("A5"_pos) == ValueView(9.0));
+    ASSERT(sheet.GetValueView("A5"_pos) == ValueView(6.0));
+
+    try {
+        sheet.GetValueView(Position::NONE);
+        ASSERT(false);
+    } catch (const FormulaError& error) {
+        ASSERT(error.GetCategory() == FormulaError::Category::Ref);
+    }
+}
+
+void TestTextOperands() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "123");
+    sheet.SetCell("A2"_pos, "'45");
+    sheet.SetCell("A3"_pos, "12a");
+    sheet.SetCell("A4"_pos, "'");
+    sheet.SetCell("A5"_pos, "1e3");
+    sheet.SetCell("A6"_pos, std::string(400, '9'));
+    sheet.SetCell("A7"_pos, "007");
+    sheet.SetCell("B1"_pos, "=A1+A2");
+    sheet.SetCell("B2"_pos, "=A3");
+    sheet.SetCell("B3"_pos, "=A4");
+    sheet.SetCell("B4"_pos, "=A5");
+    sheet.SetCell("B5"_pos, "=A6");
+    sheet.SetCell("B6"_pos, "=A7*2");
+    sheet.SetCell("B7"_pos, "=B2+A8");
+
+    using Value = CellInterface::Value;
+    const Value value_error = FormulaError(FormulaError::Category::Value);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), Value(168.0));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), value_error);
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), value_error);
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), value_error);
+    // слишком большое для double число - не число
+    ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetValue(), value_error);
+    ASSERT_EQUAL(sheet.GetCell("B6"_pos)->GetValue(), Value(14.0));
+    // ошибка в ячейке, на которую ссылается формула, читается как 0
+    ASSERT_EQUAL(sheet.GetCell("B7"_pos)->GetValue(), Value(0.0));
+
+    // то же, что и при вычислении через значения ячеек
+    for (Position pos : {"B1"_pos, "B2"_pos, "B3"_pos, "B4"_pos, "B6"_pos, "B7"_pos}) {
+        std::string expression = sheet.GetCell(pos)->GetText().substr(1);
+        Value expected;
+        try {
+            expected = ParseFormulaAST(expression).ExecuteTree([&sheet](Position pos) {
+                return sheet.GetValue(pos);
+            });
+        } catch (const FormulaError& error) {
+            expected = error;
+        }
+        ASSERT_EQUAL(sheet.GetCell(pos)->GetValue(), expected);
+    }
+
+    sheet.SetCell("A1"_pos, "abc");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), value_error);
+    sheet.SetCell("A1"_pos, "'1");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), Value(46.0));
+
+    auto fork = sheet.Fork();
+    fork->SetCell("C1"_pos, "=A7+A2");
+    ASSERT_EQUAL(fork->GetCell("C1"_pos)->GetValue(), Value(52.0));
+}
+
 void TestCellCircularReferences() {
     auto sheet = CreateSheet();
     sheet->SetCell("E2"_pos, "=E4");
@@ -367,6 +1924,7 @@ void FullTest(){
     TestRunner tr;
     RUN_TEST(tr, TestPositionAndStringConversion);
     RUN_TEST(tr, TestPositionToStringInvalid);
+    RUN_TEST(tr, TestPositionCharsRoundTrip);
     RUN_TEST(tr, TestStringToPositionInvalid);
     RUN_TEST(tr, TestEmpty);
     RUN_TEST(tr, TestInvalidPosition);
@@ -376,14 +1934,38 @@ void FullTest(){
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
     RUN_TEST(tr, TestFormulaReferencedCells);
+    RUN_TEST(tr, TestFormulaProgramMatchesTree);
+    RUN_TEST(tr, TestFormulaParserMatchesAntlr);
+    RUN_TEST(tr, TestFormulaArena);
+    RUN_TEST(tr, TestFormulaConstantFolding);
+    RUN_TEST(tr, TestAggregateFunctions);
     RUN_TEST(tr, TestErrorValue);
     RUN_TEST(tr, TestErrorDiv0);
     RUN_TEST(tr, TestEmptyCellTreatedAsZero);
     RUN_TEST(tr, TestFormulaInvalidPosition);
     RUN_TEST(tr, TestPrint);
+    RUN_TEST(tr, TestPrintSparse);
+    RUN_TEST(tr, TestExportValues);
+    RUN_TEST(tr, TestLoadTexts);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestTextOperands);
+    RUN_TEST(tr, TestValueView);
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestCircularReferencesRandomized);
+    RUN_TEST(tr, TestRangeDependenciesRandomized);
+    RUN_TEST(tr, TestRangeDependencyIndex);
+    RUN_TEST(tr, TestColumnStore);
+    RUN_TEST(tr, TestSharedFormulas);
+    RUN_TEST(tr, TestTextEditInvalidatesFormulas);
+    RUN_TEST(tr, TestLongDependencyChain);
+    RUN_TEST(tr, TestBatchEdits);
+    RUN_TEST(tr, TestBatchRollback);
+    RUN_TEST(tr, TestRecalculateAll);
+    RUN_TEST(tr, TestConcurrentReaders);
+    RUN_TEST(tr, TestFork);
+    RUN_TEST(tr, TestForkRandomized);
 
     RUN_TEST(tr, Test1);
 }
@@ -0,0 +1,87 @@
+#include "output_buffer.h"
+
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <locale>
+
+char* FormatNumber(double value, char* first, char* last, int precision) {
+    auto [end, ec] = std::to_chars(first, last, value, std::chars_format::general, precision);
+    return ec == std::errc() ? end : nullptr;
+}
+
+char* FormatNumberExact(double value, char* first, char* last) {
+    char* end = FormatNumber(value, first, last);
+    if (end == nullptr || std::isnan(value)) {
+        return end;
+    }
+    double parsed = 0;
+    auto [parsed_end, ec] = std::from_chars(first, end, parsed);
+    if (ec == std::errc() && parsed_end == end && parsed == value) {
+        return end;
+    }
+    auto [shortest_end, shortest_ec] = std::to_chars(first, last, value);
+    return shortest_ec == std::errc() ? shortest_end : nullptr;
+}
+
+OutputBuffer::OutputBuffer(std::ostream& output)
+    : output_(output)
+    , buffer_(CAPACITY)
+    , precision_(static_cast<int>(output.precision())) {
+    constexpr auto format_flags = std::ios_base::floatfield | std::ios_base::showpoint
+                                  | std::ios_base::showpos | std::ios_base::uppercase;
+    default_format_ = (output.flags() & format_flags) == 0 && output.width() == 0
+                      && output.getloc() == std::locale::classic();
+}
+
+OutputBuffer::~OutputBuffer() {
+    Flush();
+}
+
+void OutputBuffer::Write(std::string_view text) {
+    if (text.empty()) {
+        return;
+    }
+    if (text.size() > CAPACITY) {
+        Flush();
+        output_.write(text.data(), static_cast<std::streamsize>(text.size()));
+        return;
+    }
+    std::memcpy(Reserve(text.size()), text.data(), text.size());
+    size_ += text.size();
+}
+
+void OutputBuffer::Write(char c) {
+    *Reserve(1) = c;
+    ++size_;
+}
+
+void OutputBuffer::WriteNumber(double value) {
+    if (default_format_) {
+        char* first = Reserve(MAX_NUMBER_CHARS);
+        if (char* end = FormatNumber(value, first, first + MAX_NUMBER_CHARS, precision_)) {
+            size_ += end - first;
+            return;
+        }
+    }
+    WriteStreamed(value);
+}
+
+void OutputBuffer::WriteExactNumber(double value) {
+    char* first = Reserve(MAX_NUMBER_CHARS);
+    size_ += FormatNumberExact(value, first, first + MAX_NUMBER_CHARS) - first;
+}
+
+void OutputBuffer::Flush() {
+    if (size_ > 0) {
+        output_.write(buffer_.data(), static_cast<std::streamsize>(size_));
+        size_ = 0;
+    }
+}
+
+char* OutputBuffer::Reserve(std::size_t size) {
+    if (buffer_.size() - size_ < size) {
+        Flush();
+    }
+    return buffer_.data() + size_;
+}
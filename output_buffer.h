@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <string_view>
+#include <vector>
+
+// Наибольшая длина записи числа функциями ниже.
+inline constexpr std::size_t MAX_NUMBER_CHARS = 64;
+
+// Записывает число в [first, last) так же, как operator<< в поток с
+// точностью precision и флагами по умолчанию (printf "%.<precision>g").
+// Возвращает конец записи или nullptr, если места не хватило.
+char* FormatNumber(double value, char* first, char* last, int precision = 6);
+
+// Кратчайшая запись, из которой читается то же самое число. Если запись
+// "%.6g" уже точна, возвращается она, поэтому такие числа выглядят так же,
+// как при обычном выводе в поток.
+char* FormatNumberExact(double value, char* first, char* last);
+
+// Буфер вывода: мелкие записи копируются в один большой буфер, который
+// уходит в поток кусками по CAPACITY байт. Числа форматируются через
+// std::to_chars, без iostream и локалей.
+class OutputBuffer {
+public:
+    explicit OutputBuffer(std::ostream& output);
+
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+    ~OutputBuffer();
+
+    void Write(std::string_view text);
+    void Write(char c);
+
+    // Число так, как его вывел бы operator<< в исходный поток.
+    void WriteNumber(double value);
+
+    // Кратчайшая точная запись числа, см. FormatNumberExact.
+    void WriteExactNumber(double value);
+
+    // Произвольное значение через operator<< с настройками исходного потока.
+    template <typename T>
+    void WriteStreamed(const T& value) {
+        if (!formatter_) {
+            formatter_.emplace();
+            formatter_->copyfmt(output_);
+        }
+        formatter_->str(std::string());
+        *formatter_ << value;
+        Write(formatter_->str());
+    }
+
+    void Flush();
+
+private:
+    static constexpr std::size_t CAPACITY = 1 << 16;
+
+    // Свободное место под size байт в конце буфера.
+    char* Reserve(std::size_t size);
+
+    std::ostream& output_;
+    std::vector<char> buffer_;
+    std::size_t size_ = 0;
+
+    // поток выводит числа как printf "%g": флаги формата по умолчанию,
+    // без ширины поля и в классической локали
+    bool default_format_ = false;
+    int precision_ = 6;
+
+    std::optional<std::ostringstream> formatter_;
+};
@@ -0,0 +1,65 @@
+#include "range_index.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace {
+
+// Делит отрезок [first, last] на выровненные отрезки, начиная с самого
+// длинного, который помещается с текущей позиции, и вызывает
+// visit(уровень, номер отрезка на уровне).
+template <typename Visit>
+void ForEachSpan(int first, int last, int levels, Visit visit) {
+    while (first <= last) {
+        int level = 0;
+        while (level + 1 < levels && (first & ((1 << (level + 1)) - 1)) == 0
+               && first + (1 << (level + 1)) - 1 <= last) {
+            ++level;
+        }
+        visit(level, first >> level);
+        first += 1 << level;
+    }
+}
+
+}  // namespace
+
+template <typename Visit>
+void RangeIndex::ForEachBlock(Range range, Visit visit) {
+    ForEachSpan(range.first.row, range.last.row, LEVELS, [&](int row_level, int row_block) {
+        ForEachSpan(range.first.col, range.last.col, LEVELS, [&](int col_level, int col_block) {
+            visit(MakeKey(row_level, row_block, col_level, col_block), row_level * LEVELS + col_level);
+        });
+    });
+}
+
+void RangeIndex::Add(Cell* cell, Range range) {
+    ForEachBlock(range, [this, cell](Key key, int levels) {
+        blocks_[key].push_back(cell);
+        if (level_counts_[levels]++ == 0) {
+            used_levels_.push_back(levels);
+        }
+    });
+}
+
+void RangeIndex::Remove(Cell* cell, Range range) {
+    ForEachBlock(range, [this, cell](Key key, int levels) {
+        auto it = blocks_.find(key);
+        if (it == blocks_.end()) {
+            return;
+        }
+        auto& cells = it->second;
+        auto found = std::find(cells.begin(), cells.end(), cell);
+        if (found == cells.end()) {
+            return;
+        }
+        // порядок формул в блоке не важен
+        std::swap(*found, cells.back());
+        cells.pop_back();
+        if (cells.empty()) {
+            blocks_.erase(it);
+        }
+        if (--level_counts_[levels] == 0) {
+            used_levels_.erase(std::find(used_levels_.begin(), used_levels_.end(), levels));
+        }
+    });
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+class Cell;
+
+// Пространственный индекс диапазонов, на которые ссылаются формулы: по
+// позиции находит формулы, диапазоны которых её покрывают.
+// Строки и столбцы диапазона по отдельности делятся на выровненные отрезки:
+// отрезок уровня k имеет длину 2^k и начинается с позиции, кратной 2^k;
+// любой отрезок таблицы складывается не больше чем из 2 log N таких.
+// Диапазон записывается в каждый блок - произведение отрезка строк на
+// отрезок столбцов. Позиция лежит ровно в одном блоке каждой пары уровней,
+// поэтому поиск - одно обращение к хеш-таблице на пару уровней, которая
+// встречается в индексе: не больше log² N, а на практике одно-два.
+class RangeIndex {
+public:
+    void Add(Cell* cell, Range range);
+    // Убирает одну запись, добавленную Add(cell, range).
+    void Remove(Cell* cell, Range range);
+
+    // Вызывает visit для формулы каждого диапазона, который покрывает pos.
+    // Формула с пересекающимися диапазонами встречается несколько раз.
+    template <typename Visit>
+    void ForEachCovering(Position pos, Visit visit) const {
+        for (int levels : used_levels_) {
+            int row_level = levels / LEVELS;
+            int col_level = levels % LEVELS;
+            auto it = blocks_.find(MakeKey(row_level, pos.row >> row_level, col_level, pos.col >> col_level));
+            if (it == blocks_.end()) {
+                continue;
+            }
+            for (Cell* cell : it->second) {
+                visit(cell);
+            }
+        }
+    }
+
+    bool IsEmpty() const {
+        return used_levels_.empty();
+    }
+
+private:
+    // 2^(LEVELS - 1) - наибольшее из Position::MAX_ROWS и Position::MAX_COLS
+    static constexpr int LEVELS = 15;
+    static constexpr int BLOCK_BITS = 16;
+
+    using Key = std::uint64_t;
+
+    static Key MakeKey(int row_level, int row_block, int col_level, int col_block) {
+        Key key = static_cast<Key>(row_level);
+        key = key << BLOCK_BITS | static_cast<Key>(row_block);
+        key = key << 8 | static_cast<Key>(col_level);
+        return key << BLOCK_BITS | static_cast<Key>(col_block);
+    }
+
+    // Вызывает visit(ключ, номер пары уровней) для каждого блока range.
+    template <typename Visit>
+    static void ForEachBlock(Range range, Visit visit);
+
+    std::unordered_map<Key, std::vector<Cell*>> blocks_;
+    // число записей в блоках каждой пары уровней row_level * LEVELS + col_level
+    std::array<std::uint32_t, LEVELS * LEVELS> level_counts_{};
+    // пары уровней, у которых есть записи
+    std::vector<int> used_levels_;
+};
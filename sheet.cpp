@@ -2,174 +2,373 @@
 
 #include "cell.h"
 #include "common.h"
+#include "FormulaAST.h"
+#include "output_buffer.h"
+#include "thread_pool.h"
 
 #include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
 #include <functional>
 #include <iostream>
+#include <iterator>
 #include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 
 using namespace std::literals;
 
+#if defined(__unix__) || defined(__APPLE__)
+namespace {
 
-void Sheet::SetCell(Position pos, std::string text) {
-    if(!pos.IsValid()){
-        throw InvalidPositionException("позиция ошибочна");
+// Файл, отображённый в память только для чтения.
+class MappedFile {
+public:
+    explicit MappedFile(const std::filesystem::path& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0){
+            throw std::system_error(errno, std::generic_category(), "не удалось открыть " + path.string());
+        }
+        struct stat info;
+        if(::fstat(fd, &info) != 0){
+            int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "не удалось прочитать " + path.string());
+        }
+
+        size_ = static_cast<size_t>(info.st_size);
+        void* data = size_ > 0 ? ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+        int error = errno;
+        ::close(fd);
+        if(data == MAP_FAILED){
+            throw std::system_error(error, std::generic_category(), "не удалось прочитать " + path.string());
+        }
+        if(data){
+            ::madvise(data, size_, MADV_SEQUENTIAL);
+        }
+        data_ = static_cast<const char*>(data);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if(data_){
+            ::munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    std::string_view GetView() const {
+        return std::string_view(data_, size_);
     }
 
-    // if(IsCellDeleted(pos)){
-    //     SaveCell(std::move(deleted_cells_.at(pos)), pos);
-    //     deleted_cells_.erase(pos);
-    // }
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+}  // namespace
+#endif
+
+namespace {
+
+// Снимок таблицы: заголовок, формы формул, ячейки в топологическом порядке.
+//   заголовок: SNAPSHOT_MAGIC, u32 версия, u32 0, u64 число форм, u64 число ячеек
+//   форма: u32 длина и ключ в FormulaCache (пустой, если неизвестен), u32 длина
+//     и дерево (FormulaAST::Serialize)
+//   ячейка: i32 строка, i32 столбец, u8 SnapshotCell, u8 флаги SNAPSHOT_*, затем
+//     текст: u32 длина и текст;
+//     формула: u32 номер формы, u32 число ссылок и номера ячеек, на которые
+//       она ссылается (меньше номера самой ячейки), затем кэш: double для
+//       SNAPSHOT_NUMBER_CACHE или u8 категория для SNAPSHOT_ERROR_CACHE.
+// Ссылками формулы записаны только прямые ссылки, без ячеек диапазонов.
+constexpr char SNAPSHOT_MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P'};
+constexpr std::uint32_t SNAPSHOT_VERSION = 1;
+
+enum class SnapshotCell : std::uint8_t {
+    Empty,
+    Text,
+    Formula,
+};
+
+constexpr std::uint8_t SNAPSHOT_PRINTABLE = 1;
+constexpr std::uint8_t SNAPSHOT_NUMBER_CACHE = 2;
+constexpr std::uint8_t SNAPSHOT_ERROR_CACHE = 4;
 
-    if(position_cell_.count(pos) == 0){
-        std::unique_ptr<Cell> cell = std::make_unique<Cell>(*this);
+template <typename T>
+void WriteRaw(OutputBuffer& output, T value)
+{
+    output.Write(std::string_view(reinterpret_cast<const char*>(&value), sizeof(value)));
+}
+
+void WriteBytes(OutputBuffer& output, std::string_view bytes)
+{
+    WriteRaw(output, static_cast<std::uint32_t>(bytes.size()));
+    output.Write(bytes);
+}
 
-        SaveCell(std::move(cell), pos);
+[[noreturn]] void ThrowCorruptedSnapshot()
+{
+    throw std::runtime_error("снимок таблицы повреждён");
+}
 
-        position_cell_[pos]->Set(text);
+// Последовательное чтение снимка с проверкой границ.
+class SnapshotReader {
+public:
+    explicit SnapshotReader(std::string_view data)
+        : data_(data) {
     }
-    else if(GetConcreteCell(pos)->IsEmpty()){
-        std::unique_ptr<Cell> cell = std::make_unique<Cell>(*this);
 
-        SaveCell(std::move(cell), pos);
+    template <typename T>
+    T Read() {
+        T value;
+        std::memcpy(&value, Take(sizeof(value)).data(), sizeof(value));
+        return value;
+    }
 
-        position_cell_[pos]->Set(text);
+    std::string_view ReadBytes() {
+        return Take(Read<std::uint32_t>());
     }
-    else{
-        position_cell_.at(pos)->Set(text);
+
+    std::string_view Take(size_t size) {
+        if(data_.size() < size){
+            ThrowCorruptedSnapshot();
+        }
+        std::string_view bytes = data_.substr(0, size);
+        data_.remove_prefix(size);
+        return bytes;
     }
 
-}
+    bool AtEnd() const {
+        return data_.empty();
+    }
 
-const CellInterface* Sheet::GetCell(Position pos) const {
+private:
+    std::string_view data_;
+};
+
+}  // namespace
+
+
+void Sheet::SetCell(Position pos, std::string text) {
     if(!pos.IsValid()){
         throw InvalidPositionException("позиция ошибочна");
     }
-    if(position_cell_.count(pos) == 0 ){
-        return nullptr;
+    CheckNoForks();
+    if(in_batch_){
+        AddBatchEdit(pos, std::move(text), /* clear = */ false);
+        return;
+    }
+
+    if(base_){
+        CopyDependentFormulas(pos);
     }
+    Cell* cell = GetOwnCell(pos, /* is_precedent = */ false);
 
-    return position_cell_.at(pos).get();
+    cell->Set(std::move(text));
+    UpdateColumns(pos, *cell);
+    AddToPrintable(pos);
 }
 
-CellInterface* Sheet::GetCell(Position pos) {
+const CellInterface* Sheet::GetCell(Position pos) const {
     if(!pos.IsValid()){
         throw InvalidPositionException("позиция ошибочна");
     }
-    if(position_cell_.count(pos) == 0 ){
-        return nullptr;
-    }
 
-    return position_cell_.at(pos).get();
+    return GetConcreteCell(pos);
+}
+
+CellInterface* Sheet::GetCell(Position pos) {
+    // у CellInterface нет изменяющих методов, поэтому ячейку основы
+    // ответвления можно вернуть и через неконстантный интерфейс
+    return const_cast<CellInterface*>(std::as_const(*this).GetCell(pos));
 }
 
 void Sheet::ClearCell(Position pos) {
     if(!pos.IsValid()){
         throw InvalidPositionException("позиция ошибочна");
     }
-    if(GetCell(pos)){
-        if(!GetConcreteCell(pos)->IsReferenced()){
-            position_cell_.erase(pos);
-        }
-        else{
-            GetConcreteCell(pos)->Clear();
-        }
-        
-        row_cell_.at(pos.row).erase(pos.col);
-        if(row_cell_.at(pos.row).size() == 0){
-            row_cell_.erase(pos.row);
-        }
-        col_cell_.at(pos.col).erase(pos.row);
-        if(col_cell_.at(pos.col).size() == 0){
-            col_cell_.erase(pos.col);
-        }
+
+    CheckNoForks();
+    if(in_batch_){
+        AddBatchEdit(pos, std::string(), /* clear = */ true);
+        return;
+    }
+
+    if(!std::as_const(*this).GetConcreteCell(pos)){
+        return;
+    }
+    if(base_){
+        CopyDependentFormulas(pos);
+    }
+
+    Cell* cell = GetOwnCell(pos, /* is_precedent = */ false);
+    cell->Clear();
+    UpdateColumns(pos, *cell);
+    if(!cell->IsReferenced()){
+        RemoveOwnCell(pos);
+    }
+
+    RemoveFromPrintable(pos);
+}
+
+void Sheet::RemoveFromPrintable(Position pos)
+{
+    auto row = printable_->row_cell.find(pos.row);
+    if(row == printable_->row_cell.end() || row->second.count(pos.col) == 0){
+        return;
+    }
+
+    PrintableIndex& index = GetMutablePrintable();
+    auto& cols = index.row_cell.at(pos.row);
+    cols.erase(pos.col);
+    if(cols.empty()){
+        index.row_cell.erase(pos.row);
+    }
+    if(--index.col_count.at(pos.col) == 0){
+        index.col_count.erase(pos.col);
     }
 }
 
 Size Sheet::GetPrintableSize() const {
     Size size{0, 0};
 
-    if(row_cell_.size() > 0){
-        int row_max = row_cell_.rbegin()->first + 1;
+    const auto& row_cell = printable_->row_cell;
+    const auto& col_count = printable_->col_count;
+    if(row_cell.size() > 0){
+        int row_max = row_cell.rbegin()->first + 1;
         size.rows = row_max  ;
     }
-    if(col_cell_.size() > 0){
-        int col_max = col_cell_.rbegin()->first + 1;
+    if(col_count.size() > 0){
+        int col_max = col_count.rbegin()->first + 1;
         size.cols = col_max  ;
     }
     
     return size;
 }
 
-void PrintValue(std::ostream& output, double value){
-    output << value;
+void PrintValue(OutputBuffer& output, double value){
+    output.WriteNumber(value);
 }
 
-void PrintValue(std::ostream& output, const std::string& value){
-    output << value;
+void PrintValue(OutputBuffer& output, std::string_view value){
+    output.Write(value);
 }
 
-void PrintValue(std::ostream& output, FormulaError value){
-    output << value;
+void PrintValue(OutputBuffer& output, FormulaError value){
+    output.WriteStreamed(value);
 }
 
-void Sheet::PrintValues(std::ostream& output) const {
+template <typename PrintCell>
+void Sheet::PrintArea(std::ostream& output, PrintCell print_cell) const {
     Size size = GetPrintableSize();
+    // пропуск до любого столбца укладывается в одну запись
+    const std::string tabs(std::max(size.cols - 1, 0), '\t');
 
+    OutputBuffer buffer(output);
+    auto row_it = printable_->row_cell.begin();
     for(int row = 0; row < size.rows; row++){
-        for(int col = 0; col < size.cols; col++){
-            Position pos{row, col};
-            auto cell = GetCell(pos);
-            if(cell){
-                auto value = cell->GetValue();
-                std::visit([&output](auto value){
-                    PrintValue(output, value);
-                }, value);
+        // перед полем col в строке стоит col табуляций
+        int col = 0;
+        if(row_it != printable_->row_cell.end() && row_it->first == row){
+            for(int cell_col : row_it->second){
+                buffer.Write(std::string_view(tabs.data(), cell_col - col));
+                col = cell_col;
+                if(const Cell* cell = GetConcreteCell(Position{row, cell_col})){
+                    print_cell(buffer, *cell);
+                }
             }
-            if(col != size.cols - 1)
-                output << '\t';
+            ++row_it;
         }
 
-        output << '\n';
+        buffer.Write(std::string_view(tabs.data(), size.cols - 1 - col));
+        buffer.Write('\n');
     }
 }
 
+void Sheet::PrintValues(std::ostream& output) const {
+    PrintArea(output, [](OutputBuffer& buffer, const Cell& cell){
+        std::visit([&buffer](const auto& value){
+            PrintValue(buffer, value);
+        }, cell.GetValueView());
+    });
+}
+
 void Sheet::PrintTexts(std::ostream& output) const {
-    Size size = GetPrintableSize();
-    for(int row = 0; row < size.rows; row++){
-        for(int col = 0; col < size.cols; col++){
-            Position pos{row, col};
-            auto cell = GetCell(pos);
-            if(cell){
-                output << cell->GetText();
-            }
-            if(col != size.cols - 1)
-                output << '\t';
-        }
+    PrintArea(output, [](OutputBuffer& buffer, const Cell& cell){
+        buffer.Write(cell.GetText());
+    });
+}
 
-        output << '\n';
-    }
+void Sheet::ExportValues(std::ostream& output) const {
+    PrintArea(output, [](OutputBuffer& buffer, const Cell& cell){
+        Cell::ValueView value = cell.GetValueView();
+        if(const double* number = std::get_if<double>(&value)){
+            buffer.WriteExactNumber(*number);
+        } else {
+            std::visit([&buffer](const auto& value){
+                PrintValue(buffer, value);
+            }, value);
+        }
+    });
 }
 
 const Cell *Sheet::GetConcreteCell(Position pos) const
 {
-    return position_cell_.at(pos).get();
+    auto it = position_cell_.find(pos);
+    if(it != position_cell_.end()){
+        return it->second.get();
+    }
+
+    return base_ ? base_->GetConcreteCell(pos) : nullptr;
 }
 
 Cell *Sheet::GetConcreteCell(Position pos)
 {
-    return position_cell_.at(pos).get();
+    auto it = position_cell_.find(pos);
+    return it != position_cell_.end() ? it->second.get() : nullptr;
 }
 
 Cell *Sheet::GetOrCreateCell(Position pos)
 {
-    if(position_cell_.count(pos) == 0 ){
-        SetCell(pos, "");
+    auto it = position_cell_.find(pos);
+    if(it != position_cell_.end() && it->second){
+        return it->second.get();
     }
 
-    return GetConcreteCell(pos);
+    // ячейка основы остаётся в печатной области, только если была в ней
+    bool is_new = !std::as_const(*this).GetConcreteCell(pos);
+    Cell* cell = GetOwnCell(pos, /* is_precedent = */ true);
+    if(is_new){
+        AddToPrintable(pos);
+    }
+    return cell;
+}
+
+DependencyGraph::Precedents Sheet::GetOrCreatePrecedents(const std::vector<Position>& cells,
+                                                         std::vector<Range> ranges)
+{
+    DependencyGraph::Precedents precedents;
+    precedents.cells.reserve(cells.size());
+    for(Position pos : cells){
+        precedents.cells.push_back(GetOrCreateCell(pos));
+    }
+    precedents.ranges = std::move(ranges);
+    return precedents;
 }
 
 CellInterface::Value Sheet::GetValue(Position pos) const
@@ -179,21 +378,731 @@ CellInterface::Value Sheet::GetValue(Position pos) const
         throw FormulaError(FormulaError::Category::Ref);
     }
 
-    if(position_cell_.count(pos) == 0){
+    const Cell* cell = GetConcreteCell(pos);
+    if(!cell){
+        return 0.0;
+    }
+
+    return cell->GetValue();
+}
+
+Cell::ValueView Sheet::GetValueView(Position pos) const
+{
+    if(!pos.IsValid()){
+        throw FormulaError(FormulaError::Category::Ref);
+    }
+
+    const Cell* cell = GetConcreteCell(pos);
+    if(!cell){
+        return 0.0;
+    }
+
+    return cell->GetValueView();
+}
+
+double Sheet::GetNumber(Position pos) const
+{
+    if(!pos.IsValid()){
+        return ErrorToNumber(FormulaError::Category::Ref);
+    }
+
+    const Cell* cell = GetConcreteCell(pos);
+    if(!cell){
         return 0.0;
     }
 
-    return GetConcreteCell(pos)->GetValue();
+    return cell->GetNumber();
+}
+
+void Sheet::AggregateRange(Range range, ASTImpl::Aggregate& aggregate) const
+{
+    columns_->ForEachChunk(range, [this, &aggregate](const ColumnStore::Chunk& chunk, int col, int first_row,
+                                                     std::uint64_t mask){
+        // строки маски идут подряд: если все они числа, блок читается
+        // одним отрезком
+        std::uint64_t numbers = chunk.numbers & mask;
+        if(numbers == mask){
+            int begin = LowestBit(mask);
+            int end = begin;
+            while(end < ColumnStore::CHUNK_ROWS && (mask >> end & 1)){
+                ++end;
+            }
+            aggregate.Add(chunk.values + begin, end - begin);
+        }
+        else{
+            for(; numbers; numbers &= numbers - 1){
+                aggregate.Add(chunk.values[LowestBit(numbers)]);
+            }
+        }
+
+        for(std::uint64_t formulas = chunk.formulas & mask; formulas; formulas &= formulas - 1){
+            if(const Cell* cell = GetConcreteCell(Position{first_row + LowestBit(formulas), col})){
+                aggregate.Add(cell->GetRangeNumber());
+            }
+        }
+    });
 }
 
-void Sheet::SaveCell(std::unique_ptr<Cell> cell, Position pos)
+Cell* Sheet::CreateCell(Position pos, bool is_precedent)
 {
-    position_cell_[pos] = std::move(cell);
-    row_cell_[pos.row].insert(pos.col);
-    col_cell_[pos.col].insert(pos.row);
+    auto& cell = position_cell_[pos];
+    cell = std::make_unique<Cell>(*this, pos);
+    graph_.AddCell(cell.get(), is_precedent);
+    return cell.get();
 }
 
+Cell* Sheet::GetOwnCell(Position pos, bool is_precedent)
+{
+    auto it = position_cell_.find(pos);
+    if(it != position_cell_.end() && it->second){
+        return it->second.get();
+    }
+
+    // скрытая ячейка основы остаётся скрытой
+    const Cell* base_cell = base_ && it == position_cell_.end() ? base_->GetConcreteCell(pos) : nullptr;
+    Cell* cell = CreateCell(pos, is_precedent);
+    if(base_cell){
+        cell->content_.emplace<Cell::BaseImpl>(*base_cell);
+    }
+    return cell;
+}
 
+void Sheet::RemoveOwnCell(Position pos)
+{
+    if(base_ && base_->GetConcreteCell(pos)){
+        position_cell_[pos] = nullptr;
+    }
+    else{
+        position_cell_.erase(pos);
+    }
+}
+
+void Sheet::AddToPrintable(Position pos)
+{
+    auto row = printable_->row_cell.find(pos.row);
+    if(row != printable_->row_cell.end() && row->second.count(pos.col) != 0){
+        return;
+    }
+
+    PrintableIndex& index = GetMutablePrintable();
+    index.row_cell[pos.row].insert(pos.col);
+    ++index.col_count[pos.col];
+}
+
+Sheet::PrintableIndex& Sheet::GetMutablePrintable()
+{
+    if(printable_.use_count() > 1){
+        printable_ = std::make_shared<PrintableIndex>(*printable_);
+    }
+    return *printable_;
+}
+
+void Sheet::UpdateColumns(Position pos, const Cell& cell)
+{
+    if(cell.GetFormula()){
+        GetMutableColumns().SetFormula(pos);
+        return;
+    }
+
+    // у пустой ячейки и текста значение уже известно, вычислять нечего
+    double number = cell.GetRangeNumber();
+    if(std::isnan(number)){
+        GetMutableColumns().Clear(pos);
+    }
+    else{
+        GetMutableColumns().SetNumber(pos, number);
+    }
+}
+
+ColumnStore& Sheet::GetMutableColumns()
+{
+    if(columns_.use_count() > 1){
+        columns_ = std::make_shared<ColumnStore>(*columns_);
+    }
+    return *columns_;
+}
+
+void Sheet::BeginBatch()
+{
+    CheckNoForks();
+    if(in_batch_){
+        throw std::logic_error("пакет правок уже начат");
+    }
+    in_batch_ = true;
+}
+
+void Sheet::Commit()
+{
+    if(!in_batch_){
+        throw std::logic_error("пакет правок не начат");
+    }
+
+    std::vector<BatchEdit> batch = std::move(batch_);
+    Rollback();
+
+    std::vector<CellEdit> edits;
+    edits.reserve(batch.size());
+    for(const auto& edit : batch){
+        edits.push_back(CellEdit{edit.pos, edit.text, edit.clear});
+    }
+    ApplyBatch(edits);
+}
+
+void Sheet::Rollback()
+{
+    in_batch_ = false;
+    batch_.clear();
+    batch_index_.clear();
+}
+
+void Sheet::AddBatchEdit(Position pos, std::string text, bool clear)
+{
+    auto [it, inserted] = batch_index_.emplace(pos, batch_.size());
+    if(inserted){
+        batch_.push_back(BatchEdit{pos, std::move(text), clear});
+    }
+    else{
+        batch_[it->second] = BatchEdit{pos, std::move(text), clear};
+    }
+}
+
+void Sheet::ApplyBatch(const std::vector<CellEdit>& edits, size_t threads)
+{
+    if(base_){
+        for(const auto& edit : edits){
+            CopyDependentFormulas(edit.pos);
+        }
+    }
+
+    // ячейки, созданные пакетом; если пакет отклонён, всё возвращается
+    // как было, в том числе скрытые ячейки основы
+    struct CreatedCell {
+        Position pos;
+        bool hid_base;
+        bool is_new;
+    };
+    std::vector<CreatedCell> created;
+    auto get_cell = [this, &created](Position pos, bool is_precedent){
+        auto it = position_cell_.find(pos);
+        if(it != position_cell_.end() && it->second){
+            return it->second.get();
+        }
+        bool hid_base = it != position_cell_.end();
+        bool is_new = hid_base || !base_ || !base_->GetConcreteCell(pos);
+        created.push_back(CreatedCell{pos, hid_base, is_new});
+        return GetOwnCell(pos, is_precedent);
+    };
+
+    std::vector<std::pair<Cell*, std::optional<Cell::Content>>> contents;
+    try{
+        position_cell_.reserve(position_cell_.size() + edits.size());
+        contents.reserve(edits.size());
+        for(const auto& edit : edits){
+            contents.emplace_back(get_cell(edit.pos, /* is_precedent = */ false), std::nullopt);
+        }
+
+        // разбор текста трогает только свою ячейку и общий кэш формул
+        ThreadPool pool(threads);
+        pool.ParallelFor(edits.size(), [&edits, &contents](size_t i){
+            auto& [cell, content] = contents[i];
+            if(edits[i].text != cell->GetText()){
+                content = cell->MakeImpl(edits[i].text);
+            }
+        });
+        contents.erase(std::remove_if(contents.begin(), contents.end(), [](const auto& content){
+            return !content.second;
+        }), contents.end());
+
+        std::vector<std::pair<Cell*, DependencyGraph::Precedents>> links;
+        links.reserve(contents.size());
+        for(const auto& [cell, content] : contents){
+            DependencyGraph::Precedents precedents;
+            for(Position pos : Cell::GetReferencedCells(*content)){
+                precedents.cells.push_back(get_cell(pos, /* is_precedent = */ true));
+            }
+            precedents.ranges = Cell::GetReferencedRanges(*content);
+            links.emplace_back(cell, std::move(precedents));
+        }
+        graph_.SetPrecedents(std::move(links));
+    }
+    catch(...){
+        for(const auto& cell : created){
+            if(cell.hid_base){
+                position_cell_[cell.pos] = nullptr;
+            }
+            else{
+                position_cell_.erase(cell.pos);
+            }
+        }
+        throw;
+    }
+
+    // дальше исключений нет: рёбра уже заменены, осталось подменить
+    // содержимое и один раз сбросить кэш всех зависимых формул
+    std::vector<Cell*> dependents;
+    for(auto& [cell, content] : contents){
+        cell->content_ = std::move(*content);
+        UpdateColumns(cell->pos_, *cell);
+        graph_.ForEachDependent(*cell, [&dependents](Cell* dependent){
+            dependents.push_back(dependent);
+        });
+    }
+    Cell::InvalidateCache(std::move(dependents));
+
+    for(const auto& cell : created){
+        if(cell.is_new){
+            AddToPrintable(cell.pos);
+        }
+    }
+    for(const auto& edit : edits){
+        if(!edit.clear){
+            AddToPrintable(edit.pos);
+            continue;
+        }
+
+        if(!GetConcreteCell(edit.pos)->IsReferenced()){
+            RemoveOwnCell(edit.pos);
+        }
+        RemoveFromPrintable(edit.pos);
+    }
+}
+
+void Sheet::RecalculateAll(size_t threads)
+{
+    std::vector<const Cell*> dirty;
+    for(const auto& [pos, cell] : position_cell_){
+        if(cell && cell->NeedsEvaluation()){
+            dirty.push_back(cell.get());
+        }
+    }
+    std::sort(dirty.begin(), dirty.end(), [](const Cell* lhs, const Cell* rhs){
+        return lhs->order_ < rhs->order_;
+    });
+
+    // в топологическом порядке уровни ссылок известны раньше уровня формулы
+    std::unordered_map<const Cell*, size_t> levels;
+    levels.reserve(dirty.size());
+    std::vector<std::pair<size_t, const Cell*>> by_level;
+    by_level.reserve(dirty.size());
+    for(const Cell* cell : dirty){
+        size_t level = 0;
+        graph_.ForEachPrecedent(*cell, [&levels, &level](const Cell* precedent){
+            auto it = levels.find(precedent);
+            if(it != levels.end()){
+                level = std::max(level, it->second + 1);
+            }
+        });
+        levels.emplace(cell, level);
+        by_level.emplace_back(level, cell);
+    }
+    std::sort(by_level.begin(), by_level.end(), [](const auto& lhs, const auto& rhs){
+        return lhs.first < rhs.first;
+    });
+
+    // формулы уровня читают только кэш предыдущих уровней, которые
+    // ParallelFor завершил до возврата
+    ThreadPool pool(std::max<size_t>(threads, 1));
+    for(size_t begin = 0; begin < by_level.size();){
+        size_t end = begin;
+        while(end < by_level.size() && by_level[end].first == by_level[begin].first){
+            ++end;
+        }
+        pool.ParallelFor(end - begin, [&by_level, begin](size_t i){
+            std::get<Cell::FormulaImpl>(by_level[begin + i].second->content_).GetValue();
+        });
+        begin = end;
+    }
+}
+
+void Sheet::SaveSnapshot(const std::filesystem::path& path) const
+{
+    if(base_){
+        throw std::logic_error("ответвление нельзя сохранить в снимок");
+    }
+
+    std::vector<const Cell*> cells;
+    cells.reserve(position_cell_.size());
+    for(const auto& [pos, cell] : position_cell_){
+        cells.push_back(cell.get());
+    }
+    std::sort(cells.begin(), cells.end(), [](const Cell* lhs, const Cell* rhs){
+        return lhs->order_ < rhs->order_;
+    });
+    std::unordered_map<const Cell*, std::uint32_t> indices;
+    indices.reserve(cells.size());
+    for(const Cell* cell : cells){
+        indices.emplace(cell, static_cast<std::uint32_t>(indices.size()));
+    }
+
+    std::vector<const FormulaAST*> shapes;
+    std::unordered_map<const FormulaAST*, std::uint32_t> shape_indices;
+    for(const Cell* cell : cells){
+        if(const FormulaInterface* formula = cell->GetFormula()){
+            const FormulaAST* shape = &FormulaCache::GetShape(*formula);
+            if(shape_indices.emplace(shape, static_cast<std::uint32_t>(shapes.size())).second){
+                shapes.push_back(shape);
+            }
+        }
+    }
+    auto shape_keys = formula_cache_.GetShapeKeys();
+
+    std::filesystem::path temp_path = path;
+    temp_path += ".tmp";
+    std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+    if(!file){
+        throw std::runtime_error("не удалось открыть " + temp_path.string());
+    }
+    {
+        OutputBuffer output(file);
+        output.Write(std::string_view(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)));
+        WriteRaw(output, SNAPSHOT_VERSION);
+        WriteRaw(output, std::uint32_t{0});
+        WriteRaw(output, static_cast<std::uint64_t>(shapes.size()));
+        WriteRaw(output, static_cast<std::uint64_t>(cells.size()));
+
+        std::string tree;
+        for(const FormulaAST* shape : shapes){
+            WriteBytes(output, shape_keys.at(shape));
+            tree.clear();
+            shape->Serialize(tree);
+            WriteBytes(output, tree);
+        }
+
+        for(const Cell* cell : cells){
+            WriteRaw(output, static_cast<std::int32_t>(cell->pos_.row));
+            WriteRaw(output, static_cast<std::int32_t>(cell->pos_.col));
+
+            std::uint8_t flags = 0;
+            auto row_it = printable_->row_cell.find(cell->pos_.row);
+            if(row_it != printable_->row_cell.end() && row_it->second.count(cell->pos_.col)){
+                flags |= SNAPSHOT_PRINTABLE;
+            }
+
+            const FormulaInterface* formula = cell->GetFormula();
+            if(!formula){
+                std::string text = cell->GetText();
+                WriteRaw(output, text.empty() ? SnapshotCell::Empty : SnapshotCell::Text);
+                WriteRaw(output, flags);
+                if(!text.empty()){
+                    WriteBytes(output, text);
+                }
+                continue;
+            }
+
+            // значение из готового кэша, без вычисления
+            std::optional<CellInterface::Value> cache;
+            if(cell->HasCache()){
+                cache = cell->GetValue();
+                flags |= std::holds_alternative<double>(*cache) ? SNAPSHOT_NUMBER_CACHE : SNAPSHOT_ERROR_CACHE;
+            }
+            WriteRaw(output, SnapshotCell::Formula);
+            WriteRaw(output, flags);
+            WriteRaw(output, shape_indices.at(&FormulaCache::GetShape(*formula)));
+            WriteRaw(output, static_cast<std::uint32_t>(cell->referenced_cells_.size()));
+            for(const Cell* precedent : cell->referenced_cells_){
+                WriteRaw(output, indices.at(precedent));
+            }
+            if(flags & SNAPSHOT_NUMBER_CACHE){
+                WriteRaw(output, std::get<double>(*cache));
+            }
+            else if(flags & SNAPSHOT_ERROR_CACHE){
+                WriteRaw(output, static_cast<std::uint8_t>(std::get<FormulaError>(*cache).GetCategory()));
+            }
+        }
+    }
+    file.close();
+    if(!file){
+        throw std::runtime_error("не удалось записать " + temp_path.string());
+    }
+    std::filesystem::rename(temp_path, path);
+}
+
+std::unique_ptr<Sheet> Sheet::LoadSnapshot(const std::filesystem::path& path)
+{
+    auto sheet = std::make_unique<Sheet>();
+#if defined(__unix__) || defined(__APPLE__)
+    MappedFile file(path);
+    sheet->ReadSnapshot(file.GetView());
+#else
+    std::ifstream input(path, std::ios::binary);
+    if(!input){
+        throw std::runtime_error("не удалось открыть " + path.string());
+    }
+    std::ostringstream data;
+    data << input.rdbuf();
+    sheet->ReadSnapshot(data.str());
+#endif
+    return sheet;
+}
+
+void Sheet::ReadSnapshot(std::string_view data)
+{
+    SnapshotReader reader(data);
+    if(data.size() < sizeof(SNAPSHOT_MAGIC)
+       || reader.Take(sizeof(SNAPSHOT_MAGIC)) != std::string_view(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC))){
+        throw std::runtime_error("файл не является снимком таблицы");
+    }
+    auto version = reader.Read<std::uint32_t>();
+    if(version != SNAPSHOT_VERSION){
+        throw std::runtime_error("неподдерживаемая версия снимка таблицы");
+    }
+    reader.Read<std::uint32_t>();
+    auto shape_count = reader.Read<std::uint64_t>();
+    auto cell_count = reader.Read<std::uint64_t>();
+    // каждая запись занимает хотя бы байт
+    if(shape_count > data.size() || cell_count > data.size()){
+        ThrowCorruptedSnapshot();
+    }
+
+    // ключи не проверяются: по ним формулы не ищутся, см. FormulaCache::AddShape
+    std::vector<std::shared_ptr<const FormulaAST>> shapes;
+    shapes.reserve(shape_count);
+    std::unordered_set<std::string_view> keys;
+    for(std::uint64_t i = 0; i < shape_count; ++i){
+        std::string_view key = reader.ReadBytes();
+        std::string_view tree = reader.ReadBytes();
+        if(!key.empty() && !keys.insert(key).second){
+            ThrowCorruptedSnapshot();
+        }
+        try{
+            shapes.push_back(formula_cache_.AddShape(std::string(key), std::string(tree), DeserializeFormulaAST(tree)));
+        }
+        catch(const ParsingError&){
+            ThrowCorruptedSnapshot();
+        }
+    }
+
+    std::vector<Cell*> cells;
+    cells.reserve(cell_count);
+    position_cell_.reserve(cell_count);
+    for(std::uint64_t i = 0; i < cell_count; ++i){
+        Position pos;
+        pos.row = reader.Read<std::int32_t>();
+        pos.col = reader.Read<std::int32_t>();
+        auto kind = reader.Read<SnapshotCell>();
+        auto flags = reader.Read<std::uint8_t>();
+        if(!pos.IsValid()){
+            ThrowCorruptedSnapshot();
+        }
+        auto [it, inserted] = position_cell_.try_emplace(pos);
+        if(!inserted){
+            ThrowCorruptedSnapshot();
+        }
+        it->second = std::make_unique<Cell>(*this, pos);
+        Cell* cell = it->second.get();
+
+        std::vector<Cell*> precedents;
+        std::vector<Range> ranges;
+        switch(kind){
+        case SnapshotCell::Empty:
+            break;
+
+        case SnapshotCell::Text:
+            cell->content_.emplace<Cell::TextImpl>(std::string(reader.ReadBytes()));
+            break;
+
+        case SnapshotCell::Formula: {
+            auto shape = reader.Read<std::uint32_t>();
+            auto precedent_count = reader.Read<std::uint32_t>();
+            if(shape >= shapes.size() || precedent_count > cells.size()){
+                ThrowCorruptedSnapshot();
+            }
+            precedents.reserve(precedent_count);
+            for(std::uint32_t j = 0; j < precedent_count; ++j){
+                auto index = reader.Read<std::uint32_t>();
+                if(index >= cells.size()){
+                    ThrowCorruptedSnapshot();
+                }
+                precedents.push_back(cells[index]);
+            }
+
+            std::optional<CellInterface::Value> cache;
+            if(flags & SNAPSHOT_NUMBER_CACHE){
+                cache = reader.Read<double>();
+            }
+            else if(flags & SNAPSHOT_ERROR_CACHE){
+                auto category = reader.Read<std::uint8_t>();
+                if(category > static_cast<std::uint8_t>(FormulaError::Category::Div0)){
+                    ThrowCorruptedSnapshot();
+                }
+                cache = FormulaError(static_cast<FormulaError::Category>(category));
+            }
+
+            // рёбра должны совпадать со ссылками формулы
+            auto formula = FormulaCache::MakeFormula(shapes[shape], pos);
+            std::vector<Position> expected = formula->GetReferencedCells();
+            if(expected.size() != precedents.size()
+               || !std::equal(expected.begin(), expected.end(), precedents.begin(), [](Position expected, const Cell* precedent){
+                   return expected == precedent->pos_;
+               })){
+                ThrowCorruptedSnapshot();
+            }
+            ranges = formula->GetReferencedRanges();
+            cell->content_.emplace<Cell::FormulaImpl>(std::move(formula), *this, std::move(cache));
+            break;
+        }
+
+        default:
+            ThrowCorruptedSnapshot();
+        }
+
+        // ссылки ведут только на ячейки, записанные раньше, поэтому циклов
+        // через них нет; порядок для диапазонов проверяется в конце
+        graph_.AppendCell(cell, DependencyGraph::Precedents{std::move(precedents), std::move(ranges)});
+        UpdateColumns(pos, *cell);
+        if(flags & SNAPSHOT_PRINTABLE){
+            AddToPrintable(pos);
+        }
+        cells.push_back(cell);
+    }
+
+    if(!reader.AtEnd() || !graph_.IsOrdered()){
+        ThrowCorruptedSnapshot();
+    }
+}
+
+void Sheet::LoadTexts(std::istream& input, size_t threads)
+{
+    constexpr size_t CHUNK_SIZE = 1 << 20;
+    std::string texts;
+    while(input){
+        size_t size = texts.size();
+        texts.resize(size + CHUNK_SIZE);
+        input.read(texts.data() + size, CHUNK_SIZE);
+        texts.resize(size + input.gcount());
+    }
+    ApplyTexts(texts, threads);
+}
+
+void Sheet::LoadTexts(const std::filesystem::path& path, size_t threads)
+{
+#if defined(__unix__) || defined(__APPLE__)
+    MappedFile file(path);
+    ApplyTexts(file.GetView(), threads);
+#else
+    std::ifstream input(path, std::ios::binary);
+    if(!input){
+        throw std::runtime_error("не удалось открыть " + path.string());
+    }
+    LoadTexts(input, threads);
+#endif
+}
+
+void Sheet::ApplyTexts(std::string_view texts, size_t threads)
+{
+    CheckNoForks();
+    if(in_batch_){
+        throw std::logic_error("нельзя загружать таблицу посреди пакета правок");
+    }
+
+    std::vector<CellEdit> edits;
+    for(int row = 0; !texts.empty(); ++row){
+        size_t line_end = texts.find('\n');
+        std::string_view line = texts.substr(0, line_end);
+        texts.remove_prefix(line_end == texts.npos ? texts.size() : line_end + 1);
+
+        size_t field_start = 0;
+        for(int col = 0; ; ++col){
+            size_t field_end = line.find('\t', field_start);
+            std::string_view field = line.substr(field_start, field_end - field_start);
+            if(!field.empty()){
+                Position pos{row, col};
+                if(!pos.IsValid()){
+                    throw InvalidPositionException("позиция ошибочна");
+                }
+                edits.push_back(CellEdit{pos, field});
+            }
+            if(field_end == line.npos){
+                break;
+            }
+            field_start = field_end + 1;
+        }
+    }
+
+    ApplyBatch(edits, threads);
+}
+
+std::unique_ptr<Sheet> Sheet::Fork() const
+{
+    if(in_batch_){
+        throw std::logic_error("нельзя ответвить таблицу посреди пакета правок");
+    }
+
+    auto fork = std::make_unique<Sheet>();
+    fork->base_ = this;
+    fork->printable_ = printable_;
+    fork->columns_ = columns_;
+    ++forks_;
+    return fork;
+}
+
+Sheet::~Sheet()
+{
+    if(base_){
+        --base_->forks_;
+    }
+}
+
+void Sheet::CheckNoForks() const
+{
+    if(forks_ > 0){
+        throw std::logic_error("таблица с ответвлениями не изменяется");
+    }
+}
+
+void Sheet::CollectDependents(Position pos, std::vector<Position>& result) const
+{
+    auto push = [&result](const Cell* cell){
+        result.push_back(cell->pos_);
+    };
+    auto it = position_cell_.find(pos);
+    if(it != position_cell_.end() && it->second){
+        graph_.ForEachDependent(*it->second, push);
+    }
+    else{
+        graph_.ForEachRangeDependent(pos, push);
+    }
+    if(base_){
+        base_->CollectDependents(pos, result);
+    }
+}
+
+void Sheet::CopyDependentFormulas(Position pos)
+{
+    // После изменения pos формулы основы, зависящие от неё, должны считаться
+    // по ячейкам ответвления. Копии делят разобранную формулу с основой и
+    // получают рёбра в графе ответвления, так что дальше его проверка циклов
+    // и сброс кэша работают как в обычной таблице. Собственные формулы
+    // ответвления тоже обходятся: за ними могут быть формулы основы.
+    std::vector<Position> stack;
+    std::unordered_set<Position, PositionHash> seen;
+    CollectDependents(pos, stack);
+    while(!stack.empty()){
+        Position dependent = stack.back();
+        stack.pop_back();
+        if(!seen.insert(dependent).second){
+            continue;
+        }
+        CollectDependents(dependent, stack);
+
+        auto it = position_cell_.find(dependent);
+        if(it != position_cell_.end() && (!it->second || !it->second->IsBaseView())){
+            continue;
+        }
+        const Cell* origin = base_->GetConcreteCell(dependent);
+        std::optional<Cell::FormulaImpl> formula = origin ? origin->GetOrigin()->CopyFormula(*this) : std::nullopt;
+        if(!formula){
+            continue;
+        }
+
+        Cell* cell = GetOwnCell(dependent, /* is_precedent = */ false);
+        graph_.SetPrecedents(cell, GetOrCreatePrecedents(formula->GetReferencedCells(),
+                                                         formula->GetReferencedRanges()));
+        cell->content_ = std::move(*formula);
+        // зависимые формулы ответвления могли закэшировать значение основы
+        cell->InvalidateCache();
+    }
+}
 
 std::unique_ptr<SheetInterface> CreateSheet() {
     return std::make_unique<Sheet>();
@@ -1,18 +1,38 @@
 #pragma once
 
 #include "cell.h"
+#include "column_store.h"
 #include "common.h"
+#include "dependency_graph.h"
 #include <vector>
 #include <unordered_map>
 #include <unordered_set>
 #include <map>
+#include <set>
 
+#include <atomic>
+#include <filesystem>
 #include <functional>
-
+#include <istream>
+#include <memory>
+#include <string_view>
+#include <thread>
+
+namespace ASTImpl {
+class Aggregate;
+}  // namespace ASTImpl
+
+// Читать таблицу (GetCell, GetValue, PrintValues, PrintTexts) можно из
+// нескольких потоков одновременно, пока её никто не меняет: ленивое
+// вычисление формул публикует кэш атомарно и блокировок не берёт.
 class Sheet : public SheetInterface {
 public:
 
-    ~Sheet() override = default;
+    Sheet() = default;
+    Sheet(const Sheet&) = delete;
+    Sheet& operator=(const Sheet&) = delete;
+
+    ~Sheet() override;
 
     void SetCell(Position pos, std::string text) override;
 
@@ -26,20 +46,197 @@ public:
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    // Выгрузка значений в том же виде, что и PrintValues, но каждое число
+    // записывается так, чтобы читаться обратно без потерь: числа, которые
+    // PrintValues печатает точно, выглядят так же, остальные - кратчайшей
+    // точной записью. Настройки формата потока не учитываются.
+    void ExportValues(std::ostream& output) const;
+
+    // Ячейка, видимая в таблице, в том числе ячейка основы ответвления,
+    // или nullptr.
     const Cell* GetConcreteCell(Position pos) const;
+    // Собственная ячейка таблицы или nullptr.
     Cell* GetConcreteCell(Position pos);
 
     Cell* GetOrCreateCell(Position pos);
 
+    // Ссылки формулы на ячейки cells и диапазоны ranges для графа
+    // зависимостей. Недостающие ячейки cells создаются, как в
+    // GetOrCreateCell; ячейки диапазонов не создаются.
+    DependencyGraph::Precedents GetOrCreatePrecedents(const std::vector<Position>& cells,
+                                                      std::vector<Range> ranges);
+
     CellInterface::Value GetValue(Position pos) const;
+    // Значение ячейки без копирования текста, см. Cell::GetValueView.
+    Cell::ValueView GetValueView(Position pos) const;
+    // Значение ячейки как операнд формулы, см. Cell::GetNumber. Для
+    // некорректной позиции - ошибка #REF!, закодированная ErrorToNumber.
+    double GetNumber(Position pos) const;
+    // Добавляет в aggregate ячейки диапазона range, см. Cell::GetRangeNumber.
+    // Числа из текста читаются подряд из ColumnStore, к ячейкам обход
+    // обращается только за значениями формул.
+    void AggregateRange(Range range, ASTImpl::Aggregate& aggregate) const;
+
+    FormulaCache& GetFormulaCache() {
+        return formula_cache_;
+    }
+
+    DependencyGraph& GetGraph() {
+        return graph_;
+    }
+
+    // Пакетное редактирование. После BeginBatch вызовы SetCell и ClearCell
+    // только запоминаются, а GetCell и печать видят таблицу без них.
+    // Commit разбирает все тексты, проверяет циклы один раз для всех новых
+    // ссылок и сбрасывает кэш каждой зависимой формулы один раз. Если хоть
+    // одна правка отклонена, таблица остаётся такой, какой была до пакета,
+    // а исключение пробрасывается дальше. Rollback отбрасывает правки.
+    // Повторная правка ячейки внутри пакета заменяет предыдущую.
+    void BeginBatch();
+    void Commit();
+    void Rollback();
+
+    bool InBatch() const {
+        return in_batch_;
+    }
+
+    // Вычисляет все формулы без кэша в threads потоках. Формулы разбиваются
+    // на уровни: уровень формулы на единицу больше наибольшего уровня формул
+    // без кэша, на которые она ссылается. Формулы одного уровня друг от друга
+    // не зависят и вычисляются параллельно, кэш каждой записывается один раз.
+    void RecalculateAll(size_t threads = std::thread::hardware_concurrency());
+
+    // Загрузка таблицы из текста в формате PrintTexts: строки разделены
+    // '\n', поля строки - '\t', поле col строки row задаёт текст ячейки
+    // (row, col). Непустые поля применяются как SetCell одним пакетом
+    // (см. Commit), пустые поля ячеек не меняют. Формулы разбираются в
+    // threads потоках, циклы проверяются один раз для всего текста. Поля
+    // не копируются: файл отображается в память, поток читается целиком.
+    // Бросает InvalidPositionException, если текст выходит за пределы
+    // таблицы, FormulaException и CircularDependencyException; в этих
+    // случаях таблица не меняется.
+    void LoadTexts(std::istream& input, size_t threads = std::thread::hardware_concurrency());
+    void LoadTexts(const std::filesystem::path& path, size_t threads = std::thread::hardware_concurrency());
+
+    // Снимок таблицы в двоичном файле: позиции и виды ячеек, тексты,
+    // разобранные формулы (каждая форма один раз), рёбра зависимостей,
+    // печатная область и вычисленные значения формул. SaveSnapshot пишет во
+    // временный файл рядом с path и затем подменяет им path. LoadSnapshot
+    // отображает файл в память и восстанавливает таблицу без разбора формул
+    // и поиска циклов; вычисленные при сохранении значения доступны сразу.
+    // Формат версионный, числа записаны в порядке байт машины. Файл другой
+    // версии или повреждённый отклоняется с std::runtime_error. Ответвление
+    // сохранить нельзя (std::logic_error), правки незавершённого пакета в
+    // снимок не попадают.
+    void SaveSnapshot(const std::filesystem::path& path) const;
+    static std::unique_ptr<Sheet> LoadSnapshot(const std::filesystem::path& path);
+
+    // Ответвление для сценариев "что если": новая таблица, которая видит
+    // ячейки, разобранные формулы и кэш этой таблицы, а хранит только то,
+    // что в ней изменено. Перед изменением ячейки ответвление копирует к себе
+    // формулы основы, которые от неё зависят, - остальные продолжают
+    // читать общий кэш. Пока живы ответвления, таблица-основа не должна
+    // изменяться (правки бросают std::logic_error) и должна их пережить.
+    // Читать основу и разные ответвления можно из разных потоков.
+    std::unique_ptr<Sheet> Fork() const;
 
 private:
-
-    void SaveCell(std::unique_ptr<Cell> cell, Position pos);
+    struct BatchEdit {
+        Position pos;
+        std::string text;
+        bool clear = false;
+    };
+
+    // Правка, которую применяет ApplyBatch; текст принадлежит вызывающему.
+    struct CellEdit {
+        Position pos;
+        std::string_view text;
+        bool clear = false;
+    };
+
+    // Ячейки печатной области: для каждой строки - занятые столбцы по
+    // порядку, для каждого столбца - число занятых ячеек. Печать идёт по
+    // строкам и не заглядывает в пустые позиции. Ответвление разделяет
+    // индекс с основой, пока не изменит.
+    struct PrintableIndex {
+        std::map<int, std::set<int>> row_cell;
+        std::map<int, size_t> col_count;
+    };
+
+    Cell* CreateCell(Position pos, bool is_precedent);
+    // Собственная ячейка таблицы; если её нет, создаётся пустая ячейка или,
+    // в ответвлении, ячейка, которая смотрит на ячейку основы.
+    Cell* GetOwnCell(Position pos, bool is_precedent);
+    // Убирает собственную ячейку; в ответвлении ячейка основы на этом месте
+    // тоже скрывается.
+    void RemoveOwnCell(Position pos);
+
+    void AddToPrintable(Position pos);
+    void RemoveFromPrintable(Position pos);
+    PrintableIndex& GetMutablePrintable();
+
+    // Записывает в ColumnStore новое содержимое ячейки cell на месте pos.
+    void UpdateColumns(Position pos, const Cell& cell);
+    ColumnStore& GetMutableColumns();
+
+    template <typename PrintCell>
+    void PrintArea(std::ostream& output, PrintCell print_cell) const;
+
+    void CheckNoForks() const;
+    // Позиции формул, которые ссылаются на pos, с учётом основы.
+    void CollectDependents(Position pos, std::vector<Position>& result) const;
+    // Копирует в ответвление формулы основы, зависящие от pos.
+    void CopyDependentFormulas(Position pos);
+
+    void AddBatchEdit(Position pos, std::string text, bool clear);
+    // Тексты правок разбираются в threads потоках.
+    void ApplyBatch(const std::vector<CellEdit>& edits, size_t threads = 1);
+    void ApplyTexts(std::string_view texts, size_t threads);
+    // Заполняет пустую таблицу из снимка.
+    void ReadSnapshot(std::string_view data);
+
+    // в ответвлении nullptr означает, что ячейка основы удалена
     std::unordered_map<Position, std::unique_ptr<Cell>, PositionHash> position_cell_;
 
-    std::map<int, std::unordered_set<int>> row_cell_;
-    std::map<int, std::unordered_set<int>> col_cell_;
+    std::shared_ptr<PrintableIndex> printable_ = std::make_shared<PrintableIndex>();
+    // ответвление разделяет хранилище с основой, пока не изменит
+    std::shared_ptr<ColumnStore> columns_ = std::make_shared<ColumnStore>();
+
+    const Sheet* base_ = nullptr;
+    mutable std::atomic<size_t> forks_{0};
+
+    FormulaCache formula_cache_;
+    DependencyGraph graph_;
 
+    bool in_batch_ = false;
+    std::vector<BatchEdit> batch_;
+    std::unordered_map<Position, size_t, PositionHash> batch_index_;
+};
 
+// Пакет правок на время жизни объекта: если Commit не был вызван,
+// деструктор отменяет правки.
+class SheetBatch {
+public:
+    explicit SheetBatch(Sheet& sheet)
+        : sheet_(sheet) {
+        sheet_.BeginBatch();
+    }
+
+    SheetBatch(const SheetBatch&) = delete;
+    SheetBatch& operator=(const SheetBatch&) = delete;
+
+    ~SheetBatch() {
+        if (!finished_) {
+            sheet_.Rollback();
+        }
+    }
+
+    void Commit() {
+        finished_ = true;
+        sheet_.Commit();
+    }
+
+private:
+    Sheet& sheet_;
+    bool finished_ = false;
 };
\ No newline at end of file
@@ -1,12 +1,11 @@
 #include "common.h"
 
-#include <cctype>
-#include <sstream>
 #include <algorithm>
+#include <charconv>
 #include <string_view>
+#include <tuple>
 
 const int LETTERS = 26;
-const int MAX_POSITION_LENGTH = 17;
 const int MAX_POS_LETTER_COUNT = 3;
 
 const Position Position::NONE = {-1, -1};
@@ -23,57 +22,92 @@ bool Position::IsValid() const {
     return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
 }
 
-std::string Position::ToString() const {
+char* Position::ToChars(char* buffer) const {
     if (!IsValid()) {
-        return "";
+        return buffer;
     }
+    char* const begin = buffer;
 
-    std::string result;
-    result.reserve(MAX_POSITION_LENGTH);
+    // буквы столбца пишутся с конца, поэтому сначала нужна их длина
+    int letter_count = col < LETTERS ? 1 : col < LETTERS + LETTERS * LETTERS ? 2 : 3;
     int c = col;
-    while (c >= 0) {
-        result.insert(result.begin(), 'A' + c % LETTERS);
+    for (char* it = buffer + letter_count; it != buffer;) {
+        *--it = static_cast<char>('A' + c % LETTERS);
         c = c / LETTERS - 1;
     }
+    buffer += letter_count;
 
-    result += std::to_string(row + 1);
+    return std::to_chars(buffer, begin + MAX_POSITION_LENGTH, row + 1).ptr;
+}
 
-    return result;
+std::string Position::ToString() const {
+    char buffer[MAX_POSITION_LENGTH];
+    return std::string(buffer, ToChars(buffer));
 }
 
-Position Position::FromString(std::string_view str) {
-    auto it = std::find_if(str.begin(), str.end(), [](const char c) {
-        return !(std::isalpha(c) && std::isupper(c));
+Position Position::FromChars(const char* first, const char* last) {
+    const char* digits = std::find_if(first, last, [](const char c) {
+        return !(c >= 'A' && c <= 'Z');
     });
-    auto letters = str.substr(0, it - str.begin());
-    auto digits = str.substr(it - str.begin());
 
-    if (letters.empty() || digits.empty()) {
+    if (digits == first || digits == last) {
         return Position::NONE;
     }
-    if (letters.size() > MAX_POS_LETTER_COUNT) {
+    if (digits - first > MAX_POS_LETTER_COUNT) {
         return Position::NONE;
     }
 
-    if (!std::isdigit(digits[0])) {
+    if (!(*digits >= '0' && *digits <= '9')) {
         return Position::NONE;
     }
 
     int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
+    auto [end, error] = std::from_chars(digits, last, row);
+    if (error != std::errc() || end != last) {
         return Position::NONE;
     }
 
     int col = 0;
-    for (char ch : letters) {
+    for (const char* it = first; it != digits; ++it) {
         col *= LETTERS;
-        col += ch - 'A' + 1;
+        col += *it - 'A' + 1;
     }
 
     return {row - 1, col - 1};
 }
 
+Position Position::FromString(std::string_view str) {
+    return FromChars(str.data(), str.data() + str.size());
+}
+
+bool Range::operator==(Range rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+
+bool Range::operator<(Range rhs) const {
+    return std::tie(first, last) < std::tie(rhs.first, rhs.last);
+}
+
+bool Range::IsValid() const {
+    return first.IsValid() && last.IsValid() && first.row <= last.row && first.col <= last.col;
+}
+
+bool Range::Contains(Position pos) const {
+    return pos.row >= first.row && pos.row <= last.row && pos.col >= first.col && pos.col <= last.col;
+}
+
+std::string Range::ToString() const {
+    if (!IsValid()) {
+        return std::string();
+    }
+    return first.ToString() + ':' + last.ToString();
+}
+
+Range Range::FromCorners(Position lhs, Position rhs) {
+    return {{std::min(lhs.row, rhs.row), std::min(lhs.col, rhs.col)},
+            {std::max(lhs.row, rhs.row), std::max(lhs.col, rhs.col)}};
+}
+
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
 }
\ No newline at end of file
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков для серии параллельных циклов: потоки создаются один раз
+// и ждут следующего цикла, а не запускаются заново на каждый.
+class ThreadPool {
+public:
+    // threads - число потоков вместе с вызывающим.
+    explicit ThreadPool(std::size_t threads) {
+        for (std::size_t i = 1; i < threads; ++i) {
+            workers_.emplace_back([this] {
+                Work();
+            });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    // Вызывает func(i) для всех i из [0, count) и ждёт завершения. Потоки
+    // забирают индексы блоками через общий счётчик, так что неравномерная
+    // работа распределяется сама. Короткие циклы выполняются в вызывающем
+    // потоке. Первое исключение из func пробрасывается после завершения.
+    template <typename Func>
+    void ParallelFor(std::size_t count, Func func) {
+        std::size_t blocks = (count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (workers_.empty() || blocks < MIN_PARALLEL_BLOCKS) {
+            for (std::size_t i = 0; i < count; ++i) {
+                func(i);
+            }
+            return;
+        }
+
+        Job job;
+        job.count = count;
+        job.blocks = blocks;
+        job.func = &func;
+        job.run = [](void* func, std::size_t begin, std::size_t end) {
+            for (std::size_t i = begin; i < end; ++i) {
+                (*static_cast<Func*>(func))(i);
+            }
+        };
+
+        {
+            std::lock_guard lock(mutex_);
+            job_ = &job;
+            active_ = workers_.size();
+            ++generation_;
+        }
+        wake_.notify_all();
+        RunBlocks(job);
+        {
+            std::unique_lock lock(mutex_);
+            done_.wait(lock, [this] {
+                return active_ == 0;
+            });
+            job_ = nullptr;
+        }
+
+        if (job.error) {
+            std::rethrow_exception(job.error);
+        }
+    }
+
+private:
+    static constexpr std::size_t BLOCK_SIZE = 128;
+    static constexpr std::size_t MIN_PARALLEL_BLOCKS = 4;
+
+    struct Job {
+        std::size_t count = 0;
+        std::size_t blocks = 0;
+        std::atomic<std::size_t> next_block{0};
+        void* func = nullptr;
+        void (*run)(void*, std::size_t, std::size_t) = nullptr;
+        std::exception_ptr error;
+        std::mutex error_mutex;
+    };
+
+    static void RunBlocks(Job& job) {
+        try {
+            for (std::size_t block = job.next_block++; block < job.blocks; block = job.next_block++) {
+                std::size_t begin = block * BLOCK_SIZE;
+                job.run(job.func, begin, std::min(job.count, begin + BLOCK_SIZE));
+            }
+        } catch (...) {
+            std::lock_guard lock(job.error_mutex);
+            if (!job.error) {
+                job.error = std::current_exception();
+            }
+            job.next_block = job.blocks;
+        }
+    }
+
+    void Work() {
+        std::size_t seen_generation = 0;
+        for (;;) {
+            Job* job = nullptr;
+            {
+                std::unique_lock lock(mutex_);
+                wake_.wait(lock, [this, seen_generation] {
+                    return stop_ || generation_ != seen_generation;
+                });
+                if (stop_) {
+                    return;
+                }
+                seen_generation = generation_;
+                job = job_;
+            }
+
+            RunBlocks(*job);
+
+            std::lock_guard lock(mutex_);
+            if (--active_ == 0) {
+                done_.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    Job* job_ = nullptr;
+    std::size_t active_ = 0;
+    std::size_t generation_ = 0;
+    bool stop_ = false;
+};